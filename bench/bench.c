@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kdgu.h"
+#include "kdgu_inline.h"
+#include "ktre.h"
+
+/*
+ * Runs the common operations over the files named on the command line,
+ * repeated until there's at least `SIZE' bytes of text. It's both the
+ * benchmark and the training run for `make pgo', so what it does
+ * should look like what real programs do with the library.
+ */
+
+#define SIZE (4 << 20)
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint8_t *
+load(int argc, char **argv, size_t *len)
+{
+	uint8_t *s = NULL;
+	size_t n = 0;
+
+	for (int i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		if (!f) return perror(argv[i]), free(s), NULL;
+
+		uint8_t buf[4096];
+		for (size_t l; (l = fread(buf, 1, sizeof buf, f));) {
+			s = realloc(s, n + l);
+			memcpy(s + n, buf, l);
+			n += l;
+		}
+
+		fclose(f);
+	}
+
+	if (!n) return free(s), NULL;
+
+	size_t copies = SIZE / n + 1;
+	s = realloc(s, n * copies);
+	for (size_t i = 1; i < copies; i++)
+		memcpy(s + n * i, s, n);
+
+	return *len = n * copies, s;
+}
+
+#define RUN(NAME, ...)	  \
+	do { \
+		double start = now(); \
+		__VA_ARGS__; \
+		printf("%-12s %8.2f ms\n", NAME, (now() - start) * 1000); \
+	} while (0)
+
+int
+main(int argc, char **argv)
+{
+	size_t len;
+	uint8_t *text = load(argc, argv, &len);
+	if (!text) {
+		fprintf(stderr, "usage: %s FILE...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	kdgu *k = NULL, *t = NULL;
+	unsigned n = 0;
+
+	RUN("validate", k = kdgu_new(KDGU_FMT_UTF8, text, len));
+
+	RUN("codepoints",
+	    for (kdgu_iter it = kdgu_iterbegin(k, 0); kdgu_iternext(&it);)
+		    n += !!(cp_category(kdgu_codepoint_inline(it.c))
+		            & CATEGORY_LU));
+
+	RUN("decode",
+	    for (unsigned i = 0; i < k->len; kdgu_inc_inline(k, &i))
+		    n += kdgu_decode_inline(k, i) == ' ');
+
+	RUN("graphemes", n += kdgu_len(k));
+
+	RUN("utf16",
+	    t = kdgu_copy(k);
+	    kdgu_convert(t, KDGU_FMT_UTF16LE);
+	    kdgu_convert(t, KDGU_FMT_UTF8);
+	    kdgu_free(t));
+
+	RUN("utf32",
+	    t = kdgu_copy(k);
+	    kdgu_convert(t, KDGU_FMT_UTF32BE);
+	    n += kdgu_len(t);
+	    kdgu_convert(t, KDGU_FMT_UTF8);
+	    kdgu_free(t));
+
+	RUN("nfd",
+	    t = kdgu_copy(k);
+	    kdgu_normalize(t, KDGU_NORM_NFD);
+	    kdgu_normalize(t, KDGU_NORM_NFC);
+	    kdgu_free(t));
+
+	RUN("nfkc",
+	    t = kdgu_copy(k);
+	    kdgu_normalize(t, KDGU_NORM_NFKC);
+	    kdgu_free(t));
+
+	/* Case mapping and matching are done a line at a time. */
+	unsigned lines = 0, matches = 0;
+	kdgu *pat = kdgu_news("\\b\\w+@\\w+(\\.\\w+)+|\\p{Lu}\\p{Ll}+");
+	ktre *re = ktre_compile(pat, KTRE_UNANCHORED | KTRE_GLOBAL);
+
+	RUN("lines",
+	    for (unsigned a = 0, b = 0; b < k->len && lines < 20000; a = b) {
+		    while (b < k->len && k->s[b++] != '\n');
+		    kdgu *line = kdgu_substr(k, a, b);
+		    if (!line) continue;
+
+		    if (re && !re->err) matches += ktre_exec(re, line, NULL);
+		    kdgu *upper = kdgu_copy(line);
+		    kdgu_uc(upper), kdgu_lc(line);
+		    n += kdgu_cmp(line, upper, true, NULL);
+		    kdgu_free(upper), kdgu_free(line), lines++;
+	    });
+
+	printf("(%zu bytes, %u lines, %u matches, %u)\n",
+	       len, lines, matches, n);
+
+	ktre_free(re);
+	kdgu_free(pat);
+	kdgu_free(k);
+	free(text);
+
+	return EXIT_SUCCESS;
+}
@@ -36,15 +36,17 @@ struct error {
 
 	unsigned loc;
 	uint32_t codepoint;
+	unsigned run; /* How many errors of this kind in a row it stands for. */
 	char *data;
 };
 
 #define ERR(X,Y)	  \
 	(struct error){.kind = (X), .loc = (Y), .data = NULL}
 
+/* Reports that the character at `idx' has no encoding. */
 #define ENCERR(X,...)					\
 	do {						\
-		err = ERR(ERR_NO_CONVERSION, -1);	\
+		err = ERR(ERR_NO_CONVERSION, idx);	\
 		X(KDGU_REPLACEMENT, __VA_ARGS__);	\
 	} while (false)
 
@@ -21,9 +21,25 @@ typedef struct kdgu {
 	unsigned alloc, len;
 	uint8_t *s;
 
+	/*
+	 * `policy' says which errors are kept in `err' and `total'
+	 * counts all of them, kept or not. A ring of the last `max'
+	 * errors starts at `head' once it has filled up, so
+	 * kdgu_geterror() is the way to read them in order.
+	 */
 	struct errorlist {
 		struct error *err;
-		unsigned num;
+		unsigned num, alloc, total;
+
+		enum errpolicy {
+			KDGU_ERRORS_ALL,
+			KDGU_ERRORS_COUNT,
+			KDGU_ERRORS_FIRST,
+			KDGU_ERRORS_LAST,
+			KDGU_ERRORS_RUNS
+		} policy;
+
+		unsigned max, head;
 	} *errlist;
 
 	enum normalization {
@@ -49,16 +65,120 @@ typedef struct kdgu {
 		KDGU_FMT_UTF32LE,
 		KDGU_FMT_UTF32BE
 	} fmt;
+
+	struct chrindex *index;
+	unsigned flags;
+
+	/*
+	 * Whether `s' is borrowed from someone else. A view is given
+	 * its own copy before anything changes it, and `s' is never
+	 * freed.
+	 */
+	bool view;
+	bool mapped; /* `s' is a whole file mapped by kdgu_open_mmap(). */
+	bool heap;   /* It's let go of by kdgu_free(), so it can keep an index. */
 } kdgu;
 
+/*
+ * Properties that are known to hold for every code point in a
+ * string. A clear bit means that nothing is known, not that the
+ * property doesn't hold.
+ */
+enum {
+	KDGU_FLAG_ASCII   = 1 << 0, /* Everything is below U+0080. */
+	KDGU_FLAG_BMP     = 1 << 1, /* Everything is below U+10000. */
+	KDGU_FLAG_NOMARKS = 1 << 2  /* No non-zero combining classes. */
+};
+
+/*
+ * Strings of at least KDGU_INDEX_MIN bytes get a grapheme offset
+ * index the first time they're addressed by grapheme position; it
+ * holds the byte offset of every KDGU_INDEX_STRIDE-th grapheme.
+ */
+#define KDGU_INDEX_STRIDE 64
+#define KDGU_INDEX_MIN 256
+
+/*
+ * Walks the grapheme clusters of a string without allocating. `off'
+ * and `len' give the byte span of the current one:
+ *
+ *     for (kdgu_chriter it = kdgu_chrbegin(k, 0); kdgu_chrnext(&it);)
+ *             fwrite(k->s + it.off, 1, it.len, f);
+ */
+typedef struct kdgu_chriter {
+	const kdgu *k;
+	unsigned off, len;
+} kdgu_chriter;
+
+/*
+ * Walks the code points of a string. The decoder for the string's
+ * format is picked once by kdgu_iterbegin, so the loop doesn't switch
+ * on the format for every character. `c' is the current code point
+ * and `off' and `len' give its byte span; the next call carries on
+ * from `off + len', so changing `len' skips (or revisits) bytes:
+ *
+ *     for (kdgu_iter it = kdgu_iterbegin(k, 0); kdgu_iternext(&it);)
+ *             printf("U+%04"PRIX32"\n", it.c);
+ */
+typedef struct kdgu_iter {
+	const kdgu *k;
+	unsigned off, len;
+	uint32_t c;
+	unsigned (*step)(const uint8_t *s, unsigned n, uint32_t *c);
+} kdgu_iter;
+
+/*
+ * A set of code points kept as an inversion list: `r' holds the
+ * sorted code points at which membership flips, starting from
+ * outside the set, so `r[0]' is the first member and `r[1]' the first
+ * code point after it that isn't. Membership below U+0100 is also kept
+ * in a bitmap so the common case doesn't need a search.
+ */
+typedef struct kdgu_set {
+	uint64_t bits[4];
+	uint32_t *r;
+	unsigned len, alloc;
+} kdgu_set;
+
+/*
+ * Validates a stream that arrives in pieces, such as reads from a
+ * socket, and converts it to `to'. A sequence split between two
+ * pieces is held in `part' until the rest of it arrives, so memory
+ * use doesn't grow with the stream. `pos' is the offset in the
+ * stream of the first byte that hasn't been decoded yet.
+ */
+typedef struct kdgu_decoder {
+	enum fmt fmt, to;
+	uint8_t part[4];
+	unsigned npart;
+	size_t pos;
+	bool started; /* Whether the byte order mark has been looked for. */
+	bool skip;    /* Whether to drop leading UTF-8 continuation bytes. */
+
+	/* How the strings it returns keep their errors. */
+	enum errpolicy policy;
+	unsigned max;
+} kdgu_decoder;
+
 #define GETENDIAN(X)	  \
 	((X) == KDGU_FMT_UTF32LE || (X) == KDGU_FMT_UTF16LE \
 	 ? KDGU_ENDIAN_LITTLE : KDGU_ENDIAN_BIG)
 
 kdgu *kdgu_new(enum fmt fmt, const uint8_t *s, size_t len);
+kdgu *kdgu_new_policy(enum fmt fmt, const uint8_t *s, size_t len,
+                      enum errpolicy policy, unsigned max);
 kdgu *kdgu_news(const char *s);
+kdgu *kdgu_view(enum fmt fmt, const uint8_t *s, size_t len);
+kdgu *kdgu_open_mmap(const char *path, enum fmt fmt);
+kdgu_decoder *kdgu_decoder_new(enum fmt from, enum fmt to);
+kdgu_decoder *kdgu_decoder_new_policy(enum fmt from, enum fmt to,
+                                      enum errpolicy policy, unsigned max);
+kdgu *kdgu_decoder_push(kdgu_decoder *d, const uint8_t *s, size_t len, bool last);
+void kdgu_decoder_free(kdgu_decoder *d);
 kdgu *kdgu_copy(const kdgu *k);
 kdgu *kdgu_substr(const kdgu *k, unsigned a, unsigned b);
+kdgu *kdgu_subview(const kdgu *k, unsigned a, unsigned b);
+kdgu *kdgu_chrsubstr(const kdgu *k, unsigned a, unsigned b);
 kdgu *kdgu_getchr(const kdgu *k, unsigned idx);
 
 bool kdgu_nth(const kdgu *k, unsigned *idx, unsigned n);
@@ -91,6 +211,33 @@ bool kdgu_chrcmp(const kdgu *k, unsigned n, uint32_t c);
 bool kdgu_chrcat(kdgu *k, uint32_t c);
 bool kdgu_chrappend(kdgu *k, uint32_t c);
 
+kdgu_chriter kdgu_chrbegin(const kdgu *k, unsigned idx);
+bool kdgu_chrnext(kdgu_chriter *it);
+
+kdgu_iter kdgu_iterbegin(const kdgu *k, unsigned idx);
+bool kdgu_iternext(kdgu_iter *it);
+uint32_t kdgu_iterpeek(const kdgu_iter *it);
+
+kdgu_set *kdgu_setnew(void);
+kdgu_set *kdgu_setcopy(const kdgu_set *s);
+kdgu_set *kdgu_setstr(const kdgu *k);
+kdgu_set *kdgu_setrange(uint32_t a, uint32_t b);
+kdgu_set *kdgu_setcategory(uint32_t cat);
+kdgu_set *kdgu_setscript(enum script script);
+bool kdgu_setadd(kdgu_set *s, uint32_t a, uint32_t b);
+bool kdgu_setunion(kdgu_set *s, const kdgu_set *t);
+bool kdgu_setintersect(kdgu_set *s, const kdgu_set *t);
+bool kdgu_setdiff(kdgu_set *s, const kdgu_set *t);
+bool kdgu_setcomplement(kdgu_set *s);
+bool kdgu_sethas(const kdgu_set *s, uint32_t c);
+void kdgu_setfree(kdgu_set *s);
+
+/*
+ * These move `idx' one code point (inc, dec) or one grapheme (next,
+ * prev) and return how many bytes it moved, or 0 if it couldn't.
+ * Going back works from the end of the string, `k->len', as well as
+ * from inside it.
+ */
 unsigned kdgu_inc(const kdgu *k, unsigned *idx);
 unsigned kdgu_dec(const kdgu *k, unsigned *idx);
 unsigned kdgu_next(const kdgu *k, unsigned *idx);
@@ -105,6 +252,8 @@ void kdgu_debugprint1(const kdgu *k, FILE *f);
 void kdgu_debugprint2(const kdgu *k, FILE *f);
 void kdgu_pchr(const kdgu *k, unsigned idx, FILE *f);
 void kdgu_print_error(struct error err);
+bool kdgu_errpolicy(kdgu *k, enum errpolicy policy, unsigned max);
+const struct error *kdgu_geterror(const kdgu *k, unsigned i);
 void kdgu_free(kdgu *k);
 void kdgu_size(kdgu *k, size_t n);
 void kdgu_move(const kdgu *k, unsigned *idx, int n);
@@ -118,7 +267,7 @@ struct error kdgu_encode(uint32_t c, uint8_t *buf, unsigned *len,
 			 enum fmt fmt, unsigned idx, int endian);
 
 const struct codepoint *kdgu_codepoint(uint32_t c);
-const char *kdgu_getname(uint32_t c);
+char *kdgu_getname(uint32_t c, char *buf);
 uint32_t kdgu_getcode(const kdgu *k);
 uint32_t kdgu_getcat(const kdgu *k);
 char *kdgu_getcatname(uint32_t c);
@@ -129,6 +278,6 @@ const char *kdgu_getscriptname(enum script script);
 #include "ktre.h"
 
 #define KDGU(X)							\
-	(struct kdgu){0,strlen(X),(uint8_t *)X,NULL,KDGU_NORM_NFC,KDGU_FMT_UTF8}
+	(struct kdgu){0,strlen(X),(uint8_t *)X,NULL,KDGU_NORM_NFC,KDGU_FMT_UTF8,NULL,0,true,false,false}
 
 #endif /* ifndef KDGU_H */
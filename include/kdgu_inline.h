@@ -0,0 +1,178 @@
+#ifndef KDGU_INLINE_H
+#define KDGU_INLINE_H
+
+/*
+ * Static inline copies of the primitives every loop is built from,
+ * for code that wants them inlined instead of called through the
+ * shared library's PLT. Each behaves exactly like the function it's
+ * named after. CP1252 and EBCDIC need tables private to kdgu.c, so
+ * decoding them still goes through kdgu_decode.
+ */
+
+#include "kdgu.h"
+#include "unicode_data.h"
+#include "encoding.h"
+#include "utf8.h"
+#include "utf16.h"
+#include "utf32.h"
+
+static inline const struct codepoint *
+kdgu_codepoint_inline(uint32_t c)
+{
+	return lookup_codepoint(c);
+}
+
+static inline uint32_t
+kdgu_decode_inline(const kdgu *k, unsigned idx)
+{
+	if (!k->len || idx >= k->len) return UINT32_MAX;
+	const uint8_t *s = k->s + idx;
+
+	switch (k->fmt) {
+	case KDGU_FMT_ASCII:
+		return *s;
+
+	case KDGU_FMT_UTF8: {
+		if (*s < 0x80) return *s;
+
+		unsigned len = 1;
+		while (len < k->len - idx && UTF8CONT(s[len])) len++;
+
+		uint32_t c = (s[0] & ((1 << (8 - len)) - 1))
+			<< (len - 1) * 6;
+		for (unsigned i = 1; i < len; i++)
+			c |= (s[i] & 0x3F) << (len - i - 1) * 6;
+
+		return c;
+	}
+
+	case KDGU_FMT_UTF16BE:
+	case KDGU_FMT_UTF16LE:
+	case KDGU_FMT_UTF16: {
+		if (k->len - idx < 2) return KDGU_REPLACEMENT;
+
+		uint16_t d = READUTF16(GETENDIAN(k->fmt), s);
+		if (d <= 0xD7FF || d >= 0xE000 || k->len - idx < 4) return d;
+
+		/* It's a surrogate upper byte. */
+		uint16_t e = READUTF16(GETENDIAN(k->fmt), s + 2);
+		return (d - 0xD800) * 0x400 + e - 0xDC00 + 0x10000;
+	}
+
+	case KDGU_FMT_UTF32BE:
+	case KDGU_FMT_UTF32LE:
+	case KDGU_FMT_UTF32:
+		if (k->len - idx < 4) return KDGU_REPLACEMENT;
+		return READUTF32(GETENDIAN(k->fmt), s);
+
+	default:
+		return kdgu_decode(k, idx);
+	}
+}
+
+static inline unsigned
+kdgu_inc_inline(const kdgu *k, unsigned *idx)
+{
+	if (!k || *idx >= k->len) return 0;
+	unsigned now = *idx;
+
+	switch (k->fmt) {
+	case KDGU_FMT_CP1252:
+	case KDGU_FMT_EBCDIC:
+	case KDGU_FMT_ASCII:
+		now++;
+		break;
+
+	case KDGU_FMT_UTF8:
+		do {
+			now++;
+		} while (now < k->len && UTF8CONT(k->s[now]));
+		break;
+
+	case KDGU_FMT_UTF16BE:
+	case KDGU_FMT_UTF16LE:
+	case KDGU_FMT_UTF16:
+		/* A high surrogate takes its low surrogate along. */
+		if (!(k->flags & KDGU_FLAG_BMP)
+		    && now + 2 < k->len
+		    && UTF16HIGH_SURROGATE(READUTF16(GETENDIAN(k->fmt),
+		                                     k->s + now)))
+			now += 2;
+		now += 2;
+		break;
+
+	case KDGU_FMT_UTF32BE:
+	case KDGU_FMT_UTF32LE:
+	case KDGU_FMT_UTF32:
+		now += 4;
+		break;
+	}
+
+	if (now > k->len) return 0;
+	unsigned r = now - *idx;
+	*idx = now;
+
+	return r;
+}
+
+static inline unsigned
+kdgu_dec_inline(const kdgu *k, unsigned *idx)
+{
+	if (!k || !idx) return 0;
+	unsigned now = *idx;
+	if (!now || now > k->len) return 0;
+
+	switch (k->fmt) {
+	case KDGU_FMT_CP1252:
+	case KDGU_FMT_EBCDIC:
+	case KDGU_FMT_ASCII:
+		now--;
+		break;
+	case KDGU_FMT_UTF8:
+		do {
+			now--;
+		} while (now && UTF8CONT(k->s[now]));
+		break;
+	case KDGU_FMT_UTF16BE:
+	case KDGU_FMT_UTF16LE:
+	case KDGU_FMT_UTF16:
+		now -= 2;
+		if (!now || k->flags & KDGU_FLAG_BMP) break;
+		if (UTF16LOW_SURROGATE(READUTF16(GETENDIAN(k->fmt),
+		                                 k->s + now))
+		    && UTF16HIGH_SURROGATE(READUTF16(GETENDIAN(k->fmt),
+		                                     k->s + now - 2)))
+			now -= 2;
+		break;
+	case KDGU_FMT_UTF32BE:
+	case KDGU_FMT_UTF32LE:
+	case KDGU_FMT_UTF32:
+		now -= 4;
+		break;
+	}
+
+	if (now >= k->len) return 0;
+
+	unsigned r = *idx - now;
+	*idx = now;
+
+	return r;
+}
+
+/*
+ * Two ASCII characters are always in separate graphemes unless they
+ * are CR LF, which covers most text without looking at any tables.
+ * Everything else is left to kdgu_next.
+ */
+static inline unsigned
+kdgu_next_inline(const kdgu *k, unsigned *idx)
+{
+	if (k && (k->fmt == KDGU_FMT_UTF8 || k->fmt == KDGU_FMT_ASCII)
+	    && *idx < k->len && k->s[*idx] < 0x80 && k->s[*idx] != '\r'
+	    && (*idx + 1 == k->len || k->s[*idx + 1] < 0x80))
+		return ++*idx, 1;
+
+	return kdgu_next(k, idx);
+}
+
+#endif
@@ -25,7 +25,8 @@ enum {
 	KTRE_DEBUG       = 1 << 6,
 	KTRE_ECMA        = 1 << 7,
 	KTRE_DUMB        = 1 << 8,
-	KTRE_STRETCHY    = 1 << 9
+	KTRE_STRETCHY    = 1 << 9,
+	KTRE_LINEAR      = 1 << 10
 };
 
 /* Compile-time settings. */
@@ -33,6 +34,10 @@ enum {
 #define KTRE_MAX_GROUPS 100
 #define KTRE_MAX_THREAD 2000
 #define KTRE_MAX_CALL_DEPTH 100
+#define KTRE_CACHE_SIZE 256
+#define KTRE_CACHE_SHARDS 16
+#define KTRE_DFA_STATES 512
+#define KTRE_MAX_LOOPS 6
 
 struct ktre {
 	/* ===================== public fields ==================== */
@@ -63,7 +68,21 @@ struct ktre {
 	int gp;          /* Group pointer                           */
 	struct node *n;  /* The head node of the ast                */
 	_Bool literal;   /* Whether to escape metacharacters or not */
-	int cont;
+	_Bool pike;      /* Whether it runs on the breadth-first VM */
+	_Bool dfa;       /* Whether the lazy DFA can look first     */
+	_Bool skip;      /* Whether matches start with `first'      */
+	kdgu *prefix;    /* A string every match starts with        */
+
+	/*
+	 * The bit the breadth-first VM keeps for each progress
+	 * instruction that can come round again without reading
+	 * anything, or -1.
+	 */
+	int *loop;
+	int num_loops;
+
+	/* The bytes an unanchored match can start with. */
+	uint64_t first[4];
 
 	struct group {
 		int address;
@@ -80,32 +99,88 @@ struct ktre {
 		kdgu *name;
 	} *group;
 
-	/* runtime */
+	/*
+	 * The context that the calls which don't take one run in.
+	 * Its results are copied into the public fields above.
+	 */
+	struct ktre_ctx *ctx;
+
+	_Bool copied;
+	int instr_alloc;
+};
+
+/*
+ * Everything that changes while a regex runs. The compiled program is
+ * only read by the matcher, so each thread can run one pattern in a
+ * context of its own with no locking. Subjects can be shared too, as
+ * long as nothing changes them while they're being read.
+ */
+struct ktre_ctx {
+	/* ===================== public fields ==================== */
+	unsigned num_matches;
+	int **vec;
+	enum ktre_error err;
+	char *err_str;
+	int loc;
+
+	/* ==================== private fields ==================== */
+	const struct ktre *re;
+	int cont;
+
 	struct thread {
 		unsigned ip, sp, fp, la, ep, opt;
 		int *frame, *vec, *prog, *las, *exception;
 		_Bool die, rev;
 	} *t;
 
-	int tp, max_tp;
-	int **vec;
+	int tp, max_tp, thread_alloc;
 
-	_Bool copied;
-	int instr_alloc, thread_alloc;
+	/*
+	 * The breadth-first VM's threads: the ones to run, the ones
+	 * they leave for later and the alternatives of the one that's
+	 * running, each in order of priority.
+	 */
+	struct pike {
+		struct pike_thread {
+			unsigned ip, opt, loops;
+			int sp;
+		} *t;
+		int *vec;
+		unsigned n, alloc;
+	} now, later, alt;
+
+	int *mark, *pvec, *best;
+
+	/* The states of the lazy DFA built so far. */
+	struct dfa *dfa;
 };
 
 typedef struct ktre ktre;
+typedef struct ktre_ctx ktre_ctx;
+
+/* How the compiled program cache of ktre_match() has done so far. */
+struct ktre_cache_stats {
+	unsigned long hits, misses, evictions;
+	unsigned size;
+};
 
 /* API prototypes. */
 ktre *ktre_compile(const kdgu *pat, int opt);
 ktre *ktre_copy(ktre *re);
 _Bool ktre_exec(ktre *re, const kdgu *subject, int ***vec);
+ktre_ctx *ktre_ctx_new(const ktre *re);
+_Bool ktre_ctx_exec(ktre_ctx *ctx, const kdgu *subject, int ***vec);
+void ktre_ctx_free(ktre_ctx *ctx);
 _Bool ktre_match(const kdgu *subject, const kdgu *pat, int opt, int ***vec);
 kdgu *ktre_filter(ktre *re, const kdgu *subject, const kdgu *replacement, const kdgu *indicator);
 kdgu *ktre_replace(const kdgu *subject, const kdgu *pat, const kdgu *replacement, const kdgu *indicator, int opt);
 kdgu **ktre_split(ktre *re, const kdgu *subject, int *len);
+kdgu **ktre_splitview(ktre *re, const kdgu *subject, int *len);
 int **ktre_getvec(const ktre *re);
 kdgu *ktre_getgroup(int **const vec, int match, int group, const kdgu *subject);
+kdgu *ktre_getgroupview(int **const vec, int match, int group, const kdgu *subject);
 void ktre_free(ktre *re);
+void ktre_cache_stats(struct ktre_cache_stats *st);
+void ktre_cache_clear(void);
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A bulk kernel converts a prefix of `s' made of blocks it knows how
+ * to handle, writing at `d + *j' and advancing `*j'. It returns the
+ * number of bytes of `s' it consumed, which may be zero. Kernels may
+ * write up to one block past the end of their output, so `d' must
+ * have room for the worst case of the whole remaining input. The two
+ * int arguments are kernel-specific (widths and byte orders).
+ */
+typedef size_t bulk(uint8_t *d, size_t *j,
+                    const uint8_t *s, size_t len, int a, int b);
+
+/*
+ * The kernels best suited to the CPU we're running on, selected once
+ * when the library is loaded.
+ */
+struct kernels {
+	/* The number of bytes below 0x80 at the start of `s'. */
+	size_t (*ascii)(const uint8_t *s, size_t len);
+
+	bulk *utf8_wide;   /* UTF-8 to UTF-16 or UTF-32 (width, endian) */
+	bulk *utf16_utf8;  /* UTF-16 to UTF-8 (endian, unused)          */
+	bulk *utf16_utf32; /* UTF-16 to UTF-32 (from, to)               */
+	bulk *utf32_utf8;  /* UTF-32 to UTF-8 (endian, unused)          */
+	bulk *utf32_utf16; /* UTF-32 to UTF-16 (from, to)               */
+
+	/* Reverse the byte order of every code unit; return `len'. */
+	size_t (*swap16)(uint8_t *d, const uint8_t *s, size_t len);
+	size_t (*swap32)(uint8_t *d, const uint8_t *s, size_t len);
+
+	/*
+	 * The number of bytes at the start of `s' that the UTF-16 and
+	 * UTF-32 validators would copy through without complaint.
+	 */
+	size_t (*utf16_plain)(const uint8_t *s, size_t len, int endian);
+	size_t (*utf32_plain)(const uint8_t *s, size_t len, int endian);
+
+	/*
+	 * Copies the ASCII at the start of `s' to `d' with its letters
+	 * upper-cased (or lower-cased) and returns how many bytes that
+	 * was. `d' may be `s'.
+	 */
+	size_t (*ascii_case)(uint8_t *d, const uint8_t *s, size_t len,
+	                     int upper);
+};
+
+extern struct kernels kernels;
+
+#endif
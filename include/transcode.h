@@ -0,0 +1,19 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include "kdgu.h"
+
+/*
+ * A transcoder converts as much of `s' as it can into `dst' and
+ * returns the number of bytes of `s' it consumed; `n' is set to the
+ * number of bytes it wrote. It stops early at anything it can't
+ * convert exactly (truncated sequences, lone surrogates and code
+ * points the target can't hold) and leaves that to the caller.
+ */
+typedef size_t transcoder(uint8_t *dst, size_t *n,
+                          const uint8_t *s, size_t len);
+
+transcoder *get_transcoder(enum fmt from, enum fmt to);
+size_t transcode_bound(enum fmt from, enum fmt to, size_t len);
+
+#endif
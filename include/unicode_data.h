@@ -104,16 +104,38 @@ enum decomptype {
 	DECOMP_TYPE_COMPAT    /* Compat   */
 };
 
+/*
+ * The `*_QC' properties from `DerivedNormalizationProps.txt'. A form
+ * with neither of its flags set is "Yes".
+ */
+enum quickcheck {
+	QC_NFD_NO     = 1 << 0,
+	QC_NFC_NO     = 1 << 1,
+	QC_NFC_MAYBE  = 1 << 2,
+	QC_NFKD_NO    = 1 << 3,
+	QC_NFKC_NO    = 1 << 4,
+	QC_NFKC_MAYBE = 1 << 5
+};
+
+/*
+ * The properties looked up for every code point, packed into eight
+ * bytes. Fields that most code points leave empty live in a separate
+ * `struct mapping', found through cp_mapping().
+ */
 struct codepoint {
-	enum category category;
-	enum boundclass bound;
-	enum bidiclass bidi;
-	enum decomptype decomp_type;
-	enum script script;
+	unsigned gc : 5;	/* Index of its bit in `enum category' */
+	unsigned bound : 5;	/* enum boundclass */
+	unsigned bidi : 5;	/* enum bidiclass */
+	unsigned decomp_type : 4;	/* enum decomptype */
+	unsigned bidi_mirrored : 1;
+	unsigned qc : 6;	/* Normalization quick check flags */
 
-	int bidi_mirrored;
-	int ccc;		/* Canonical Combining Class */
+	unsigned ccc : 8;	/* Canonical Combining Class */
+	unsigned script : 8;	/* enum script */
+	unsigned mapping : 16;	/* Index of its entry in `mappings' */
+};
 
+struct mapping {
 	uint16_t lower;
 	uint16_t upper;
 	uint16_t title;
@@ -123,11 +145,8 @@ struct codepoint {
 	uint16_t special_uc;
 
 	uint16_t decomp;
-};
-
-struct name {
-	uint32_t c;
-	char *name;
+	uint16_t comp;		/* Offset of its run in `compositions' */
+	uint16_t fold;		/* Index of its entry in `casefold' */
 };
 
 struct name_alias {
@@ -155,8 +174,9 @@ struct casefold {
 };
 
 extern const struct codepoint codepoints[];
+extern const struct codepoint latin1[];
+extern const struct mapping mappings[];
 
-extern const struct name names[];
 extern const struct name_alias name_aliases[];
 extern const struct category_alias category_aliases[];
 extern const struct named_sequence named_sequences[];
@@ -167,16 +187,53 @@ extern const uint16_t stage2[];
 extern const uint16_t sequences[];
 extern const uint32_t compositions[];
 
+extern const char jamo_names[][4];
+extern const char name_words[];
+extern const uint32_t name_word_offsets[];
+extern const uint8_t name_data[];
+extern const uint16_t name_stage1[];
+extern const uint32_t name_stage2[];
+extern const uint32_t name_codes[];
+
 const struct codepoint *codepoint(uint32_t c);
 unsigned write_sequence(uint32_t *buf, uint16_t idx);
 uint32_t lookup_comp(uint32_t a, uint32_t b);
 unsigned lookup_fold(uint32_t a, uint32_t **seq);
+unsigned lookup_name(uint32_t c, char *buf);
+uint32_t lookup_code(const char *key);
+
+/*
+ * The body of codepoint(), for callers that want the lookup inlined.
+ * Anything past U+10FFFF gets the record at index zero.
+ */
+static inline const struct codepoint *
+lookup_codepoint(uint32_t c)
+{
+	if (c < 0x100) return latin1 + c;
+	if (c > 0x10FFFF) return codepoints;
+	return codepoints + stage2[stage1[c / 256] + c % 256];
+}
+
+static inline enum category
+cp_category(const struct codepoint *cp)
+{
+	return 1 << cp->gc;
+}
+
+static inline const struct mapping *
+cp_mapping(const struct codepoint *cp)
+{
+	return mappings + cp->mapping;
+}
 
-extern int num_names;
 extern int num_name_aliases;
+extern int num_name_codes;
 extern int num_category_aliases;
 extern int num_casefold;
 
+/* Enough room for any character name and its terminator. */
+#define KDGU_NAME_MAX 128
+
 #define HANGUL_SBASE  0xAC00
 #define HANGUL_LBASE  0x1100
 #define HANGUL_VBASE  0x1161
@@ -17,6 +17,9 @@
 
 uint8_t *utf16validate(kdgu *k, const uint8_t *s,
                        size_t *l, int endian);
+uint8_t *utf16validatepart(kdgu *k, const uint8_t *s, size_t *l,
+                           size_t end, int endian);
+size_t utf16run(const uint8_t *s, size_t l, int endian);
 struct error utf16encode(uint32_t c, uint8_t *buf, unsigned *len,
 			 int idx, int endian);
 
@@ -12,6 +12,9 @@
 #define UTF8CONT(X) (((uint8_t)(X) & 0xc0) == 0x80)
 
 uint8_t *utf8validate(kdgu *k, const uint8_t *s, size_t *l);
+uint8_t *utf8validatepart(kdgu *k, const uint8_t *s, size_t *l, size_t end,
+			  bool *skip);
+size_t utf8run(const uint8_t *s, size_t l, bool *ascii);
 unsigned utf8chrlen(const uint8_t *s, unsigned l);
 uint32_t utf8decode(const uint8_t *s, unsigned l);
 struct error utf8encode(uint32_t c, uint8_t *buf,
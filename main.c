@@ -1,34 +1,10 @@
 #include "kdgu.h"
 #include <assert.h>
 
-char *
-load_file(const char *p, unsigned *l)
-{
-	char *b = NULL;
-	FILE *f = NULL;
-	int len = -1;
-
-	*l = 0;
-	f = fopen(p, "rb");
-	if (!f) return NULL;
-	if (fseek(f, 0L, SEEK_END)) return fclose(f), NULL;
-	len = ftell(f);
-	if (len == -1) return fclose(f), NULL;
-	b = malloc(len);
-	if (!b) return fclose(f), NULL;
-	if (fseek(f, 0L, SEEK_SET)) return fclose(f), free(b), NULL;
-	len = fread(b, 1, len, f);
-	if (ferror(f)) return fclose(f), free(b), NULL;
-	*l = len, fclose(f);
-
-	return b;
-}
-
 int
 main(int argc, char **argv)
 {
-	unsigned len = 0;
-	char *text = load_file(argv[argc - 1], &len);
+	kdgu *text = kdgu_open_mmap(argv[argc - 1], KDGU_FMT_UTF8);
 	if (!text) return EXIT_FAILURE;
 
 	char *a = "(?<=12.*) ";
@@ -66,7 +42,7 @@ main(int argc, char **argv)
 	assert(!kdgu_cmp(&KDGU("while"), &KDGU("w"), false, NULL));
 	assert(!kdgu_cmp(&KDGU("w"), &KDGU("while"), false, NULL));
 
-	free(text);
+	kdgu_free(text);
 
 	return 0;
 }
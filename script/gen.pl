@@ -11,6 +11,7 @@
 #     - SpecialCasing.txt
 #     - CaseFolding.txt
 #     - CompositionExclusions.txt
+#     - DerivedNormalizationProps.txt
 #     - PropertyValueAliases.txt
 #     - auxiliary/GraphemeBreakProperty.txt
 #
@@ -49,6 +50,9 @@ has bidi_mirrored => (is => 'rw');
 has uppercase     => (is => 'rw');
 has lowercase     => (is => 'rw');
 has titlecase     => (is => 'rw');
+has comp          => (is => 'rw');
+has fold          => (is => 'rw');
+has qc            => (is => 'rw');
 
 sub BUILD {
     my $self = shift;
@@ -106,21 +110,38 @@ sub cvar {
 	: $prefix . "_" . uc $data . ",";
 }
 
-# Prints out the code point as an entry in the C table.
+# The general categories in the order of their bits in `enum category'.
+my %category_index;
+@category_index{qw(Cn Lu Ll Lt Lm Lo Mn Mc Me Nd Nl No Pc Pd Ps Pe Pi
+		   Pf Po Sm Sc Sk So Zs Zl Zp Cc Cf Cs Co)} = 0 .. 29;
+
+# Prints out the code point as an entry in the C table, given the
+# index of its entry in the mapping table.
 
 sub echo {
-    my $self = shift;
+    my ($self, $mapping) = @_;
 
     return "{" .
-	cvar("CATEGORY",    $self->{category})    .
+	$category_index{$self->{category}} . "," .
 	cvar("BOUNDCLASS",  $self->{bound_class}) .
 	cvar("BIDI",        $self->{bidi_class})  .
 	cvar("DECOMP_TYPE", $self->{decomp_type}) .
-	cvar("SCRIPT",      $self->{script}) .
 
-	$self->{ccc}           . "," .
 	$self->{bidi_mirrored} . "," .
+	($self->{qc} ? join('|', @{$self->{qc}}) : "0") . "," .
+	$self->{ccc}           . "," .
+
+	cvar("SCRIPT",      $self->{script}) .
+	$mapping . "},";
+}
 
+# Prints out the code point's entry in the mapping table, which holds
+# the fields most code points leave empty.
+
+sub echo_mapping {
+    my $self = shift;
+
+    return "{" .
 	$self->{lowercase}     . "," .
 	$self->{uppercase}     . "," .
 	$self->{titlecase}     . "," .
@@ -129,7 +150,9 @@ sub echo {
 	($self->{special_tc} ? main::emit_sequence(@{$self->{special_tc}}) : "-1") . "," .
 	($self->{special_uc} ? main::emit_sequence(@{$self->{special_uc}}) : "-1") . "," .
 
-	($self->{decomp} ? main::emit_sequence(@{$self->{decomp}}) : "-1") . "},";
+	($self->{decomp} ? main::emit_sequence(@{$self->{decomp}}) : "-1") . "," .
+	(defined $self->{comp} ? $self->{comp} : "-1") . "," .
+	(defined $self->{fold} ? $self->{fold} : "-1") . "},";
 }
 
 package main;
@@ -179,6 +202,18 @@ while (my $l = <$fh>) {
     }
 }
 
+# The quick check properties are stored as a set of flags; a form
+# without a flag is "Yes".
+$fh = load("DerivedNormalizationProps.txt");
+my %quickcheck;
+while (my $l = <$fh>) {
+    next if $l !~ /^([0-9A-F]+)(?:\.\.([0-9A-F]+))?\s*;\s*(NFK?[CD])_QC\s*;\s*([NM])/;
+    my $flag = "QC_$3_" . ($4 eq 'N' ? "NO" : "MAYBE");
+    for (my $i = hex($1); $i <= hex($2 // $1); $i++) {
+	push @{$quickcheck{$i}}, $flag;
+    }
+}
+
 $fh = load("GraphemeBreakProperty.txt");
 my %boundclasses;
 while (my $l = <$fh>) {
@@ -202,6 +237,16 @@ while (my $l = <$fh>) {
     }
 }
 
+# Only the common and full foldings are used. Every code point that
+# has one stores the index of its entry in `casefold'.
+$fh = load("CaseFolding.txt");
+my (@casefold, %casefold_index);
+while (my $l = <$fh>) {
+    next if $l !~ /^(\S+); ([CF]); (.*?); # .*$/;
+    $casefold_index{hex($1)} = scalar @casefold;
+    push @casefold, [$1, $3];
+}
+
 $fh = load("Jamo.txt");
 my %jamo;
 while (my $l = <$fh>) {
@@ -221,7 +266,7 @@ sub utf16_encode {
 	return @buf
     }
 
-    push @buf, (($c - 0x10000) >> 10)   | 0xDC00;
+    push @buf, (($c - 0x10000) >> 10)   | 0xD800;
     push @buf, (($c - 0x10000) & 0x3FF) | 0xDC00;
 
     return @buf;
@@ -327,6 +372,12 @@ sub gen_chars {
 	    $clone->{code} = $i;
 	    $clone->{name} = $name;
 	    $chars{$i} = $clone;
+
+	    # These are named by NR2 in section 4.8 of the standard.
+	    $names{$i} = sprintf("CJK UNIFIED IDEOGRAPH-%04X", $i)
+		if $name =~ /^CJK Ideograph/;
+	    $names{$i} = sprintf("TANGUT IDEOGRAPH-%04X", $i)
+		if $name =~ /^Tangut Ideograph/;
 	}
     }
 
@@ -346,19 +397,41 @@ sub gen_chars {
 	}
     }
 
+    foreach my $i (keys %quickcheck) {
+	next if not defined $chars{$i};
+	$chars{$i}->{qc} = $quickcheck{$i};
+    }
+
+    foreach my $i (keys %casefold_index) {
+	next if not defined $chars{$i};
+	$chars{$i}->{fold} = $casefold_index{$i};
+    }
+
     return %chars;
 }
 
-# Build and return an array of unique strings.
+# Build and return arrays of unique entries for the code point and
+# mapping tables. The first mapping is the empty one.
 sub gen_properties {
     my (%chars) = @_;
     my (%properties_indicies, @properties);
+    my (%mapping_indices, @mappings);
+    my $empty = "{-1,-1,-1,-1,-1,-1,-1,-1,-1},";
+    $mapping_indices{$empty} = 0;
+    push @mappings, "\t" . $empty;
 
     LOG("Generating properties...");
 
     for (my $i = 0; $i < 0x10FFFF; $i++) {
 	next if not defined $chars{$i};
-	my $entry = $chars{$i}->echo;
+	my $mapping = $chars{$i}->echo_mapping;
+
+	if (not defined $mapping_indices{$mapping}) {
+	    $mapping_indices{$mapping} = scalar @mappings;
+	    push @mappings, "\t" . $mapping;
+	}
+
+	my $entry = $chars{$i}->echo($mapping_indices{$mapping});
 	$chars{$i}->{entry_index} = $properties_indicies{$entry};
 
 	if (not defined $chars{$i}->{entry_index}) {
@@ -368,9 +441,10 @@ sub gen_properties {
 	}
     }
 
-    LOG("Generated ", scalar(@properties), " properties.");
+    LOG("Generated ", scalar(@properties), " properties and ",
+	scalar(@mappings), " mappings.");
 
-    return (\%chars, \@properties);
+    return (\%chars, \@properties, \@mappings);
 }
 
 # Generates tables used for efficient look ups of Unicode code
@@ -419,11 +493,16 @@ sub gen_tables {
     return (\@stage1, \@stage2);
 }
 
-# Generates a table mapping a pair of code points (the first two
-# numbers in the entry) to a canonical composition.
+# Generates the canonical composition table. The pairs are grouped by
+# their first code point into runs of the form
+#
+#     count, second, composite, second, composite, ...
+#
+# sorted by the second code point, and every code point that starts a
+# pair stores the offset of its run.
 sub gen_comb {
     my (%chars) = @_;
-    my @comb;
+    my (%pairs, @comb);
 
     LOG("Generating combining indices...");
 
@@ -440,12 +519,17 @@ sub gen_comb {
 	    next;
 	}
 
-	push @comb, $cp->{decomp}[0];
-	push @comb, $cp->{decomp}[1];
-	push @comb, $cp->{code};
+	$pairs{$cp->{decomp}[0]}{$cp->{decomp}[1]} = $cp->{code};
+    }
+
+    foreach my $first (sort { $a <=> $b } keys %pairs) {
+	my @second = sort { $a <=> $b } keys %{$pairs{$first}};
+	$chars{$first}->{comp} = scalar @comb;
+	push @comb, scalar @second;
+	push @comb, $_, $pairs{$first}{$_} foreach @second;
     }
 
-    LOG("Generated ", (scalar @comb / 3), " combining indices.");
+    LOG("Generated ", scalar(keys %pairs), " composition runs.");
 
     return @comb;
 }
@@ -463,10 +547,26 @@ sub print_array {
     print $out "};\n\n";
 };
 
+# The loose matching form of a name (UAX44-LM2), as `loose()' in the
+# generated code computes it; unlike LM2 every hyphen is dropped.
+sub loose {
+    my $name = lc shift;
+    $name =~ s/[ _-]//g;
+    return $name;
+}
+
+# 32 bit FNV-1a, as `hash_name()' in the generated code computes it.
+sub fnv {
+    my $h = 2166136261;
+    $h = (($h ^ $_) * 16777619) & 0xFFFFFFFF foreach unpack 'C*', shift;
+    return $h;
+}
+
 $fh = load("UnicodeData.txt");
-my ($chars, $properties) = gen_properties(gen_chars($fh));
+my %chars = gen_chars($fh);
+my @comb = gen_comb(%chars);
+my ($chars, $properties, $mappings) = gen_properties(%chars);
 my ($stage1, $stage2) = gen_tables(%$chars);
-my @comb = gen_comb(%$chars);
 
 $fh = load("NameAliases.txt");
 my %name_aliases;
@@ -486,65 +586,110 @@ while (my $l = <$fh>) {
     }
 }
 
-# Formal names
+# Formal names. They are stored as runs of words from a shared
+# dictionary rather than as strings; see `lookup_name()'. Hangul
+# syllable names are built from the jamo short names at run time,
+# and names that end in their own code point (ideographs, controls
+# and the like) only store what comes before it.
 
-my $SBase = 0xAC00;
 my $LBase = 0x1100;
 my $VBase = 0x1161;
 my $TBase = 0x11A7;
-my $TCount = 28;
-my $NCount = 588;
 
-my $num_names = 0;
-print $out "const struct name names[] = {\n";
-for (my $i = 0; $i < 0x10FFFF; $i++) {
-    if ($i >= 0xAC00 && $i <= 0xD7A3) { # Hangul syllable
-	print $out "\t{$i,\"";
-	my $SIndex = $i - $SBase;
-
-	my $LIndex = int($SIndex / $NCount);
-	my $VIndex = int(($SIndex % $NCount) / $TCount);
-	my $TIndex = int($SIndex % $TCount);
-
-	my $LPart = $LBase + $LIndex;
-	my $VPart = $VBase + $VIndex;
-	my $TPart = $TBase + $TIndex;
-
-	die if not defined $jamo{$LPart} or
-	    not defined $jamo{$VPart} or
-	    ($TIndex > 0 && not defined $jamo{$TPart});
-
-	print $out "HANGUL SYLLABLE ",
-	    $jamo{$LPart},
-	    $jamo{$VPart};
-	print $out $jamo{$TPart} if $TIndex > 0;
-	print $out "\"},\n";
-	$num_names++;
-	next;
-    }
+my @jamo_names;
+push @jamo_names, ($jamo{$LBase + $_} // die) foreach 0 .. 18;
+push @jamo_names, ($jamo{$VBase + $_} // die) foreach 0 .. 20;
+push @jamo_names, ($_ ? $jamo{$TBase + $_} // die : "") foreach 0 .. 27;
 
-    my $name;
+my (%name_entries, @name_entries, %word_count, %name_index);
+my @loose_names;
+for (my $i = 0; $i < 0x10FFFF; $i++) {
     next if not defined $$chars{$i};
+    next if $i >= 0xAC00 && $i <= 0xD7A3;
 
     # There are few enough of these we can just generate them.
-    if ($$chars{$i}->{category} eq 'Cc') {
-	$name = "control-" . sprintf("%04X", $i);
-    } else {
-	$name = $names{$i};
+    my $name = $$chars{$i}->{category} eq 'Cc'
+	? "control-" . sprintf("%04X", $i)
+	: $names{$i};
+    next if not defined $name;
+
+    my $hex = sprintf("-%04X", $i);
+    die "$0: The name of $i is too long.\n"
+	if length($name) + length($hex) >= 128;
+    my $suffix = $name =~ s/\Q$hex\E$// ? 1 : 0;
+    my $key = "$suffix $name";
+
+    if (not defined $name_entries{$key}) {
+	$name_entries{$key} = scalar @name_entries;
+	push @name_entries, [$suffix, split / /, $name];
+	$word_count{$_}++ foreach split / /, $name;
     }
 
-    next if not defined $name;
+    $name_index{$i} = $name_entries{$key};
+
+    # Names that end in their code point are found from that instead.
+    push @loose_names, [loose($name), $i + 1] if not $suffix;
+}
+
+# The 128 most common words are encoded in one byte, the rest in two.
+my @words = sort {
+    $word_count{$b} <=> $word_count{$a} or $a cmp $b
+} keys %word_count;
+die "$0: Too many distinct words in names.\n" if @words > 0x8000;
+
+my (%word_rank, @name_words, @name_word_offsets);
+for (my $i = 0; $i < scalar @words; $i++) {
+    $word_rank{$words[$i]} = $i;
+    push @name_word_offsets, scalar @name_words;
+    push @name_words, (map { ord } split //, $words[$i]), 0;
+}
 
-    $num_names++;
-    print $out "\t{$i,\"$name\"},\n";
+my (@name_data, @name_offsets);
+foreach my $entry (@name_entries) {
+    my ($suffix, @w) = @$entry;
+    die "$0: Too many words in a name.\n" if @w > 0x7F;
+    push @name_offsets, scalar @name_data;
+    push @name_data, scalar(@w) | $suffix << 7;
+    foreach my $r (map { $word_rank{$_} } @w) {
+	push @name_data, $r < 0x80 ? $r : (0x80 | $r >> 8, $r & 0xFF);
+    }
 }
+
+# The same two stage layout as `stage1' and `stage2', with blocks of
+# 128 code points. Entries are offsets into `name_data' plus one.
+my (@name_stage1, @name_stage2, %name_blocks);
+for (my $code = 0; $code < 0x110000; $code += 128) {
+    my @block = map {
+	defined $name_index{$_} ? $name_offsets[$name_index{$_}] + 1 : 0
+    } $code .. $code + 127;
+    my $key = join ',', @block;
+
+    if (not defined $name_blocks{$key}) {
+	$name_blocks{$key} = scalar @name_stage2;
+	push @name_stage2, @block;
+    }
+
+    push @name_stage1, $name_blocks{$key};
+}
+
+LOG("Generated ", scalar(@name_entries), " names from ",
+    scalar(@words), " words.");
+
+print $out "const char jamo_names[][4] = {\n";
+print $out "\t\"$_\",\n" foreach @jamo_names;
 print $out "};\n\n";
-print $out "int num_names = ", $num_names, ";\n";
+
+print_array("char", "name_words", @name_words);
+print_array("uint32_t", "name_word_offsets", @name_word_offsets);
+print_array("uint8_t", "name_data", @name_data);
+print_array("uint16_t", "name_stage1", @name_stage1);
+print_array("uint32_t", "name_stage2", @name_stage2);
 
 # Name aliases
 
-print $out "\nint num_name_aliases = ", (scalar values %name_aliases), ";\n";
+print $out "int num_name_aliases = ", (scalar values %name_aliases), ";\n";
 print $out "const struct name_alias name_aliases[] = {\n";
+my $num_name_aliases = 0;
 for (my $i = 0; $i < 0x10FFFF; $i++) {
     next if not defined $name_aliases{$i};
     print $out "\t{$i,",
@@ -552,11 +697,35 @@ for (my $i = 0; $i < 0x10FFFF; $i++) {
 	",(char *[]){";
     for (my $j = 0; $j < scalar values @{$name_aliases{$i}}; $j++) {
 	print $out "\"", $name_aliases{$i}[$j], "\",";
+	push @loose_names, [loose($name_aliases{$i}[$j]),
+			    0x80000000 | $num_name_aliases << 8 | $j];
     }
     print $out "}},\n";
+    $num_name_aliases++;
 }
 print $out "};\n\n";
 
+# An open addressed hash table from the loose form of each name to
+# its code point plus one, or for aliases to the high bit set over
+# the index in `name_aliases' and in its list of names. The first
+# name with a given loose form wins, as the linear search did.
+
+my $num_name_codes = 1;
+$num_name_codes *= 2 while $num_name_codes < 2 * @loose_names;
+my (@name_codes, %loose_seen);
+$name_codes[$_] = 0 foreach 0 .. $num_name_codes - 1;
+
+foreach my $entry (@loose_names) {
+    my ($key, $value) = @$entry;
+    next if $loose_seen{$key}++;
+    my $h = fnv($key) & ($num_name_codes - 1);
+    $h = ($h + 1) & ($num_name_codes - 1) while $name_codes[$h];
+    $name_codes[$h] = $value;
+}
+
+print $out "int num_name_codes = $num_name_codes;\n";
+print_array("uint32_t", "name_codes", @name_codes);
+
 # Property value aliases
 
 print $out "const struct category_alias category_aliases[] = {\n";
@@ -586,34 +755,36 @@ print $out "int num_category_aliases = $num_category_aliases;\n\n";
 # Case folding.
 
 print $out "const struct casefold casefold[] = {\n";
-$fh = load("CaseFolding.txt");
-my $num_casefold = 0;
-while (my $l = <$fh>) {
-    if ($l =~ /^(\S+); (.); (.*?); # .*$/) {
-	next if not $2 eq 'F' and not $2 eq 'C';
-	print $out "\t{0x$1, ", scalar split / /, $3;
-	print $out ", (uint32_t []){";
-	foreach my $i (split / /, $3) {
-	    print $out hex($i), ",";
-	}
-	print $out "}},\n";
-	$num_casefold++;
+foreach my $fold (@casefold) {
+    print $out "\t{0x$$fold[0], ", scalar split / /, $$fold[1];
+    print $out ", (uint32_t []){";
+    foreach my $i (split / /, $$fold[1]) {
+	print $out hex($i), ",";
     }
+    print $out "}},\n";
 }
 print $out "};\n\n";
-print $out "int num_casefold = $num_casefold;\n\n";
+print $out "int num_casefold = ", scalar(@casefold), ";\n\n";
 
 # Generation is done.
 
 LOG("Generated ", scalar(@sequences), " sequence elements.");
 
 print $out "const struct codepoint codepoints[] = {\n";
-print $out "\t{0,0,0,0,0,0,0,-1,-1,-1,-1,-1,-1,-1},\n";
+print $out "\t{0,0,0,0,0,0,0,0,0},\n";
 foreach my $cp (@$properties) { print $out "$cp\n"; }
 print $out "};\n\n";
 
+# Latin-1 is looked up directly, without going through the stages.
+print $out "const struct codepoint latin1[] = {\n";
+print $out $$properties[$$chars{$_}->{entry_index}], "\n" foreach 0 .. 0xFF;
+print $out "};\n\n";
+
+print $out "const struct mapping mappings[] = {\n";
+foreach my $mapping (@$mappings) { print $out "$mapping\n"; }
+print $out "};\n\n";
+
 print_array("uint32_t", "compositions", @comb);
-print $out "int num_comp = ", (scalar @comb / 3), ";\n";
 
 print_array("uint16_t", "stage1", @$stage1);
 print_array("uint16_t", "stage2", flat @$stage2);
@@ -629,17 +800,17 @@ __DATA__
  */
 
 // #include "kdgu.h"
-#include "unicode_data.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 
-int num_comp;
-int num_names;
+#include "unicode_data.h"
 
 const struct codepoint *
 codepoint(uint32_t c)
 {
-	if (c > 0x10FFFF) return codepoints;
-	return codepoints + (stage2[stage1[c / 256]
-	                            + (c % 256)]);
+	return lookup_codepoint(c);
 }
 
 unsigned
@@ -650,10 +821,10 @@ write_sequence(uint32_t *buf, uint16_t idx)
 	unsigned len = (idx & 0xC000) == 0xC000
 		          ? sequences[idx & 0x3FFF]
 			  : (idx & 0xC000) >> 14;
-	if (!buf) return len;
 	unsigned j = 0;
 	idx &= 0x3FFF;
 
+	/* `len' counts UTF-16 code units; the return value doesn't. */
 	for (unsigned i = len >= 3 ? 1 : 0;
 	     i < (len >= 3 ? len + 1 : len);
 	     i++) {
@@ -663,26 +834,176 @@ write_sequence(uint32_t *buf, uint16_t idx)
 			d = (d - 0xD800) * 0x400 + e - 0xDC00 + 0x10000;
 			i++;
 		}
-		buf[j++] = d;
+		if (buf) buf[j] = d;
+		j++;
 	}
 
-	return len;
+	return j;
 }
 
 uint32_t
 lookup_comp(uint32_t a, uint32_t b)
 {
-	for (int i = 0; i < num_comp * 3; i += 3)
-		if (compositions[i] == a && compositions[i + 1] == b)
-			return compositions[i + 2];
+	uint16_t idx = cp_mapping(codepoint(a))->comp;
+	if (idx == UINT16_MAX) return UINT32_MAX;
+
+	/* Binary search the run of pairs that start with `a'. */
+	const uint32_t *run = compositions + idx + 1;
+	unsigned lo = 0, hi = compositions[idx];
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (run[mid * 2] == b) return run[mid * 2 + 1];
+		if (run[mid * 2] < b) lo = mid + 1;
+		else hi = mid;
+	}
+
 	return UINT32_MAX;
 }
 
 unsigned
 lookup_fold(uint32_t a, uint32_t **seq)
 {
-	for (int i = 0; i < num_casefold; i++)
-		if (casefold[i].c == a)
-			return *seq = casefold[i].name, casefold[i].num;
-	return *seq = 0, 0;
+	uint16_t idx = cp_mapping(codepoint(a))->fold;
+	if (idx == UINT16_MAX) return *seq = 0, 0;
+	return *seq = casefold[idx].name, casefold[idx].num;
+}
+
+unsigned
+lookup_name(uint32_t c, char *buf)
+{
+	if (c > 0x10FFFF) return 0;
+
+	if (c >= HANGUL_SBASE && c < HANGUL_SBASE + HANGUL_SCOUNT) {
+		unsigned s = c - HANGUL_SBASE;
+		return sprintf(buf, "HANGUL SYLLABLE %s%s%s",
+		               jamo_names[s / HANGUL_NCOUNT],
+		               jamo_names[HANGUL_LCOUNT
+		                          + s % HANGUL_NCOUNT / HANGUL_TCOUNT],
+		               jamo_names[HANGUL_LCOUNT + HANGUL_VCOUNT
+		                          + s % HANGUL_TCOUNT]);
+	}
+
+	uint32_t idx = name_stage2[name_stage1[c / 128] + c % 128];
+	if (!idx--) return 0;
+
+	/*
+	 * A count of words with the suffix flag in the top bit, then
+	 * the rank of each word in one or two bytes.
+	 */
+	const uint8_t *p = name_data + idx;
+	unsigned num = *p & 0x7F, len = 0;
+
+	for (unsigned i = 0; i < num; i++) {
+		unsigned r = *++p;
+		if (r & 0x80) r = (r & 0x7F) << 8 | *++p;
+		if (i) buf[len++] = ' ';
+		for (const char *w = name_words + name_word_offsets[r]; *w; w++)
+			buf[len++] = *w;
+	}
+
+	if (name_data[idx] & 0x80)
+		return len + sprintf(buf + len, "-%04" PRIX32, c);
+
+	buf[len] = 0;
+	return len;
+}
+
+/*
+ * Writes the loose matching form of `s' into `buf', which may be `s'
+ * itself, and returns its length.
+ */
+static size_t
+loose(char *buf, const char *s)
+{
+	size_t len = 0;
+
+	for (; *s; s++)
+		if (*s != ' ' && *s != '-' && *s != '_')
+			buf[len++] = tolower((unsigned char)*s);
+
+	buf[len] = 0;
+	return len;
+}
+
+static uint32_t
+hash_name(const char *s)
+{
+	uint32_t h = 2166136261;
+	while (*s) h = (h ^ (uint8_t)*s++) * 16777619;
+	return h;
+}
+
+static int
+find_jamo(const char *s, size_t len, int first, int num)
+{
+	for (int i = first; i < first + num; i++) {
+		size_t j = 0;
+		while (j < len && jamo_names[i][j]
+		       && tolower((unsigned char)jamo_names[i][j]) == s[j])
+			j++;
+		if (j == len && !jamo_names[i][j]) return i - first;
+	}
+
+	return -1;
+}
+
+/*
+ * The short names of leading consonants, vowels and trailing
+ * consonants are made of distinct letters, so the split is unique.
+ */
+static uint32_t
+lookup_hangul(const char *s)
+{
+	size_t l = strcspn(s, "aeiouwy");
+	size_t v = strspn(s + l, "aeiouwy");
+	int li = find_jamo(s, l, 0, HANGUL_LCOUNT);
+	int vi = find_jamo(s + l, v, HANGUL_LCOUNT, HANGUL_VCOUNT);
+	int ti = find_jamo(s + l + v, strlen(s + l + v),
+	                   HANGUL_LCOUNT + HANGUL_VCOUNT, HANGUL_TCOUNT);
+
+	if (li < 0 || vi < 0 || ti < 0) return UINT32_MAX;
+	return HANGUL_SBASE
+		+ (li * HANGUL_VCOUNT + vi) * HANGUL_TCOUNT + ti;
+}
+
+uint32_t
+lookup_code(const char *key)
+{
+	char buf[KDGU_NAME_MAX];
+	size_t len = strlen(key);
+
+	if (!strncmp(key, "hangulsyllable", 14)) {
+		uint32_t c = lookup_hangul(key + 14);
+		if (c != UINT32_MAX) return c;
+	}
+
+	for (uint32_t h = hash_name(key) & (num_name_codes - 1);
+	     name_codes[h];
+	     h = (h + 1) & (num_name_codes - 1)) {
+		uint32_t v = name_codes[h];
+
+		if (v & 0x80000000) {
+			const struct name_alias *a = name_aliases
+				+ ((v & 0x7FFFFFFF) >> 8);
+			loose(buf, a->name[v & 0xFF]);
+			if (!strcmp(buf, key)) return a->c;
+		} else if (lookup_name(v - 1, buf)) {
+			loose(buf, buf);
+			if (!strcmp(buf, key)) return v - 1;
+		}
+	}
+
+	/* The rest end in their code point, in four to six digits. */
+	for (size_t n = 4; n <= 6 && n < len; n++) {
+		const char *hex = key + len - n;
+		if (strspn(hex, "0123456789abcdef") != n) break;
+
+		uint32_t c = strtoul(hex, NULL, 16);
+		if (!lookup_name(c, buf)) continue;
+		loose(buf, buf);
+		if (!strcmp(buf, key)) return c;
+	}
+
+	return UINT32_MAX;
 }
@@ -8,6 +8,7 @@ if [ ! -f UnicodeData.txt ]; then
     wget https://www.unicode.org/Public/$VERSION/ucd/SpecialCasing.txt
     wget https://www.unicode.org/Public/$VERSION/ucd/DerivedCoreProperties.txt
     wget https://www.unicode.org/Public/$VERSION/ucd/CompositionExclusions.txt
+    wget https://www.unicode.org/Public/$VERSION/ucd/DerivedNormalizationProps.txt
     wget https://www.unicode.org/Public/$VERSION/ucd/CaseFolding.txt
     wget https://www.unicode.org/Public/$VERSION/ucd/NameAliases.txt
     wget https://www.unicode.org/Public/$VERSION/ucd/NamedSequences.txt
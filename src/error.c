@@ -5,26 +5,87 @@
 #include "kdgu.h"
 #include "error.h"
 
+/*
+ * Makes `k' keep its errors according to `policy' from now on, which
+ * throws away any it has already. `max' is how many the ring of
+ * KDGU_ERRORS_LAST holds.
+ */
 bool
-pusherror(kdgu *k, struct error err)
+kdgu_errpolicy(kdgu *k, enum errpolicy policy, unsigned max)
 {
+	if (!k) return false;
+
 	if (!k->errlist) {
 		k->errlist = malloc(sizeof *k->errlist);
 		if (!k->errlist) return false;
 		memset(k->errlist, 0, sizeof *k->errlist);
 	}
 
-	void *p = realloc(k->errlist->err,
-	                  (k->errlist->num + 1)
-	                  * sizeof *k->errlist->err);
+	struct errorlist *l = k->errlist;
+	l->num = l->total = l->head = 0;
+	l->policy = policy, l->max = max;
+
+	return true;
+}
 
-	if (!p) {
-		free(k->errlist->err);
+/* Returns the `i'th oldest error that `k' has kept. */
+const struct error *
+kdgu_geterror(const kdgu *k, unsigned i)
+{
+	if (!k || !k->errlist || i >= k->errlist->num) return NULL;
+
+	const struct errorlist *l = k->errlist;
+	return l->err + (l->head + i) % l->num;
+}
+
+/*
+ * The list grows geometrically, and under every policy but the
+ * default its size is bounded no matter how bad the input is.
+ */
+bool
+pusherror(kdgu *k, struct error err)
+{
+	if (!k->errlist && !kdgu_errpolicy(k, KDGU_ERRORS_ALL, 0))
 		return false;
+
+	struct errorlist *l = k->errlist;
+	l->total++, err.run = 1;
+
+	switch (l->policy) {
+	case KDGU_ERRORS_COUNT:
+		return true;
+
+	case KDGU_ERRORS_FIRST:
+		if (l->num) return true;
+		break;
+
+	case KDGU_ERRORS_LAST:
+		if (!l->max) return true;
+		if (l->num < l->max) break;
+		l->err[l->head] = err;
+		l->head = (l->head + 1) % l->max;
+		return true;
+
+	case KDGU_ERRORS_RUNS:
+		if (!l->num || l->err[l->num - 1].kind != err.kind) break;
+		l->err[l->num - 1].run++;
+		return true;
+
+	default:
+		break;
+	}
+
+	if (l->num == l->alloc) {
+		unsigned n = l->alloc ? l->alloc * 2 : 8;
+		if (l->policy == KDGU_ERRORS_LAST && n > l->max) n = l->max;
+		if (l->policy == KDGU_ERRORS_FIRST) n = 1;
+
+		void *p = realloc(l->err, n * sizeof *l->err);
+		if (!p) return false;
+		l->err = p, l->alloc = n;
 	}
 
-	k->errlist->err = p;
-	k->errlist->err[k->errlist->num++] = err;
+	l->err[l->num++] = err;
 
 	return true;
 }
@@ -4,8 +4,14 @@
 #include <ctype.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "kdgu.h"
+#include "kdgu_inline.h"
 
 #include "unicode_data.h"
 #include "encoding.h"
@@ -14,6 +20,8 @@
 #include "utf8.h"
 #include "utf16.h"
 #include "utf32.h"
+#include "transcode.h"
+#include "simd.h"
 
 /*
  * TODO: Case folding will need to specially consider U+0345:
@@ -47,6 +55,22 @@ static char *format[] = {
 	"UTF-32-BE"
 };
 
+#define ASCII_FLAGS	  \
+	(KDGU_FLAG_ASCII | KDGU_FLAG_BMP | KDGU_FLAG_NOMARKS)
+
+/*
+ * Strings whose code points are all ASCII and whose encoding stores
+ * ASCII as plain bytes can be handled a byte at a time.
+ */
+#define BYTEWISE(X)	  \
+	((X)->flags & KDGU_FLAG_ASCII \
+	 && ((X)->fmt == KDGU_FMT_UTF8 \
+	     || (X)->fmt == KDGU_FMT_ASCII \
+	     || (X)->fmt == KDGU_FMT_CP1252))
+
+/* The longest full decomposition is U+FDFA's, at 18 code points. */
+#define DECOMP_MAX 18
+
 #define IS_VALID_CP1252(X)	  \
 	!((X) == 0x81 \
 	  || (X) == 0x8D \
@@ -54,6 +78,14 @@ static char *format[] = {
 	  || (X) == 0x90 \
 	  || (X) == 0x9D)
 
+/*
+ * The code point iterator. The public kdgu_iter* functions wrap these
+ * so that the loops in this file can have them inlined.
+ */
+static inline kdgu_iter iter_begin(const kdgu *k, unsigned idx);
+static inline bool iter_next(kdgu_iter *it);
+static inline uint32_t iter_peek(const kdgu_iter *it);
+
 static uint8_t *
 cp1252validate(kdgu *k, const uint8_t *s, size_t *l)
 {
@@ -113,16 +145,145 @@ kdgu_print_error(struct error err)
 	}
 }
 
+/*
+ * The grapheme index is built lazily by functions that take a const
+ * kdgu, so it is owned by the string but not part of its value. Every
+ * function that changes the contents of a string must drop it.
+ * Only strings made by kdgu itself get an index, views and mappings
+ * included, since kdgu_free() frees it; one made some other way (like
+ * with `KDGU()') never does, because nothing would.
+ *
+ * Readers may share a string between threads, so the index is built
+ * privately and published with a compare-and-swap; a thread that
+ * loses the race frees its copy and uses the winner's. Nothing but a
+ * function that takes a non-const kdgu ever takes an index away.
+ */
+
+struct chrindex {
+	unsigned len, num;
+	enum fmt fmt;
+	unsigned *off;
+};
+
+static void
+drop_index(kdgu *k)
+{
+	if (!k->index) return;
+	free(k->index->off);
+	free(k->index);
+	k->index = NULL;
+}
+
+/*
+ * Whether a change in front of `idx' keeps `k' in its normalization
+ * form, if what's put there is ASCII too: the end of the string and
+ * ASCII never combine with what comes before them.
+ */
+static bool
+keeps_norm(const kdgu *k, unsigned idx)
+{
+	return idx >= k->len || kdgu_decode(k, idx) < 0x80;
+}
+
+/* Lets go of the bytes of `k' in whatever way it got them. */
+static void
+release(kdgu *k)
+{
+	if (k->mapped) munmap(k->s, k->len);
+	else if (!k->view) free(k->s);
+	k->view = k->mapped = false;
+}
+
+/* Gives a view its own copy of its bytes so they can be changed. */
+static bool
+own(kdgu *k)
+{
+	if (!k->view) return true;
+
+	uint8_t *s = malloc(k->len ? k->len : 1);
+	if (!s) return false;
+	memcpy(s, k->s, k->len);
+	release(k);
+	k->s = s, k->alloc = k->len;
+
+	return true;
+}
+
+static const struct chrindex *
+get_index(const kdgu *k)
+{
+	struct chrindex *x = __atomic_load_n(&k->index, __ATOMIC_ACQUIRE);
+
+	/*
+	 * A stale index can only be left by a caller that changed the
+	 * fields of `k' by hand; it's ignored until a mutator drops it.
+	 */
+	if (x) return x->len == k->len && x->fmt == k->fmt ? x : NULL;
+	if (!k->heap || k->len < KDGU_INDEX_MIN) return NULL;
+
+	x = malloc(sizeof *x);
+	if (!x) return NULL;
+
+	/* Every grapheme is at least one byte long. */
+	x->off = malloc((k->len / KDGU_INDEX_STRIDE + 1) * sizeof *x->off);
+	if (!x->off) return free(x), NULL;
+	x->len = k->len, x->fmt = k->fmt, x->num = 0;
+
+	for (unsigned idx = 0;; x->num++) {
+		if (!(x->num % KDGU_INDEX_STRIDE))
+			x->off[x->num / KDGU_INDEX_STRIDE] = idx;
+		if (!kdgu_next(k, &idx)) break;
+	}
+
+	struct chrindex *old = NULL;
+	kdgu *m = (kdgu *)(uintptr_t)k;
+
+	if (!__atomic_compare_exchange_n(&m->index, &old, x, false,
+	                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(x->off), free(x);
+		x = old;
+	}
+
+	return x;
+}
+
+/*
+ * Finds the byte offset of the `n'th grapheme of `k'. `n' may be one
+ * past the last grapheme, in which case `idx' is set to the end of the
+ * string.
+ */
+
+static bool
+chroffset(const kdgu *k, unsigned n, unsigned *idx)
+{
+	const struct chrindex *x = get_index(k);
+	unsigned i = 0, j = 0;
+
+	if (x) {
+		if (n > x->num) return false;
+		j = n - n % KDGU_INDEX_STRIDE;
+		i = x->off[n / KDGU_INDEX_STRIDE];
+	}
+
+	for (; j < n; j++)
+		if (!kdgu_next(k, &i))
+			return false;
+
+	return *idx = i, true;
+}
+
 static bool
 delete_point(kdgu *k, unsigned idx)
 {
 	unsigned l = kdgu_inc(k, &(unsigned){idx});
-	if (!l) return false;
+	if (!l || !own(k)) return false;
+	drop_index(k);
 
 	memmove(k->s + idx,
 	        k->s + idx + l,
 	        k->len - idx - l);
 	k->len -= l;
+	if (!keeps_norm(k, idx)) k->norm = KDGU_NORM_NONE;
 
 	return true;
 }
@@ -131,6 +292,9 @@ static int
 overwritechr(kdgu *k, unsigned idx, uint8_t *b, unsigned l1)
 {
 	unsigned l2 = kdgu_chrsize(k, idx);
+	if (!own(k)) return 0;
+	drop_index(k);
+	k->norm = KDGU_NORM_NONE;
 
 	if (l1 == l2) {
 		memcpy(k->s + idx, b, l1);
@@ -157,54 +321,177 @@ overwritechr(kdgu *k, unsigned idx, uint8_t *b, unsigned l1)
 	assert(false);
 }
 
+static unsigned
+point_flags(uint32_t c)
+{
+	if (c < 0x80) return ASCII_FLAGS;
+	unsigned f = 0;
+	if (c <= 0xFFFF) f |= KDGU_FLAG_BMP;
+	if (!codepoint(c)->ccc) f |= KDGU_FLAG_NOMARKS;
+	return f;
+}
+
+/*
+ * Grapheme cluster boundaries (UAX #29) are found with a state
+ * machine. The state is the break class of the last code point, plus
+ * two states that remember an emoji base followed by extenders (for
+ * GB10) and a complete pair of regional indicators (for GB12 and
+ * GB13). An entry of `grapheme_table' gives the state after the code
+ * point on the right, with GB_BREAK set if a cluster ends before it.
+ */
+
+#define GB_NUM_CLASSES (BOUNDCLASS_E_BASE_GAZ + 1)
+#define GB_EB_EXTEND   (GB_NUM_CLASSES + 0)
+#define GB_RI_PAIR     (GB_NUM_CLASSES + 1)
+#define GB_NUM_STATES  (GB_NUM_CLASSES + 2)
+#define GB_BREAK       0x80
+
+/* The class the rules see on the left in state `s'. */
+#define GB_LEFT(s)						\
+	((s) == GB_EB_EXTEND ? BOUNDCLASS_EXTEND		\
+	 : (s) == GB_RI_PAIR ? BOUNDCLASS_REGIONAL_INDICATOR	\
+	 : (s))
+
+#define GB_CONTROL(c) ((c) >= BOUNDCLASS_CR && (c) <= BOUNDCLASS_CONTROL)
+
+#define GB_JOIN(s, r)							\
+	((GB_LEFT(s) == BOUNDCLASS_CR && (r) == BOUNDCLASS_LF) /* GB3 */ \
+	 || (!GB_CONTROL(GB_LEFT(s)) && !GB_CONTROL(r) /* GB4, GB5 */	\
+	     && ((GB_LEFT(s) == BOUNDCLASS_L /* GB6 */			\
+	          && ((r) == BOUNDCLASS_L || (r) == BOUNDCLASS_V	\
+	              || (r) == BOUNDCLASS_LV || (r) == BOUNDCLASS_LVT)) \
+	         || ((GB_LEFT(s) == BOUNDCLASS_LV /* GB7 */		\
+	              || GB_LEFT(s) == BOUNDCLASS_V)			\
+	             && ((r) == BOUNDCLASS_V || (r) == BOUNDCLASS_T))	\
+	         || ((GB_LEFT(s) == BOUNDCLASS_LVT /* GB8 */		\
+	              || GB_LEFT(s) == BOUNDCLASS_T)			\
+	             && (r) == BOUNDCLASS_T)				\
+	         || (r) == BOUNDCLASS_EXTEND /* GB9 */			\
+	         || (r) == BOUNDCLASS_ZWJ				\
+	         || (r) == BOUNDCLASS_SPACINGMARK /* GB9a */		\
+	         || GB_LEFT(s) == BOUNDCLASS_PREPEND /* GB9b */		\
+	         || (((s) == BOUNDCLASS_E_BASE /* GB10 */		\
+	              || (s) == BOUNDCLASS_E_BASE_GAZ			\
+	              || (s) == GB_EB_EXTEND)				\
+	             && (r) == BOUNDCLASS_E_MODIFIER)			\
+	         || (GB_LEFT(s) == BOUNDCLASS_ZWJ /* GB11 */		\
+	             && ((r) == BOUNDCLASS_GLUE_AFTER_ZWJ		\
+	                 || (r) == BOUNDCLASS_E_BASE_GAZ))		\
+	         || ((s) == BOUNDCLASS_REGIONAL_INDICATOR /* GB12, GB13 */ \
+	             && (r) == BOUNDCLASS_REGIONAL_INDICATOR))))
+
+#define GB_NEXT(s, r)							\
+	((r) == BOUNDCLASS_EXTEND					\
+	 && ((s) == BOUNDCLASS_E_BASE || (s) == BOUNDCLASS_E_BASE_GAZ	\
+	     || (s) == GB_EB_EXTEND) ? GB_EB_EXTEND			\
+	 : (r) == BOUNDCLASS_REGIONAL_INDICATOR				\
+	 && (s) == BOUNDCLASS_REGIONAL_INDICATOR ? GB_RI_PAIR		\
+	 : (r))
+
+#define GB(s, r) (GB_NEXT(s, r) | (GB_JOIN(s, r) ? 0 : GB_BREAK))
+#define GB_ROW(s)							\
+	{ GB(s, 0), GB(s, 1), GB(s, 2), GB(s, 3), GB(s, 4), GB(s, 5),	\
+	  GB(s, 6), GB(s, 7), GB(s, 8), GB(s, 9), GB(s, 10), GB(s, 11), \
+	  GB(s, 12), GB(s, 13), GB(s, 14), GB(s, 15), GB(s, 16),	\
+	  GB(s, 17), GB(s, 18) }
+
+static const uint8_t grapheme_table[GB_NUM_STATES][GB_NUM_CLASSES] = {
+	GB_ROW(0), GB_ROW(1), GB_ROW(2), GB_ROW(3), GB_ROW(4),
+	GB_ROW(5), GB_ROW(6), GB_ROW(7), GB_ROW(8), GB_ROW(9),
+	GB_ROW(10), GB_ROW(11), GB_ROW(12), GB_ROW(13), GB_ROW(14),
+	GB_ROW(15), GB_ROW(16), GB_ROW(17), GB_ROW(18),
+	GB_ROW(GB_EB_EXTEND), GB_ROW(GB_RI_PAIR)
+};
+
+static unsigned
+bound(const kdgu *k, unsigned idx)
+{
+	return codepoint(kdgu_decode(k, idx))->bound;
+}
+
+/*
+ * Returns the end of the grapheme cluster that starts at `idx'. The
+ * state is always just the class of the first code point, because
+ * no rule that looks further back can end at a boundary.
+ */
+
+static unsigned
+grapheme_end(const kdgu *k, unsigned idx)
+{
+	if (idx >= k->len) return idx;
+
+	/* The only ASCII grapheme cluster is CR LF. */
+	if (BYTEWISE(k))
+		return idx + (idx + 1 < k->len
+		              && k->s[idx] == '\r'
+		              && k->s[idx + 1] == '\n' ? 2 : 1);
+
+	unsigned state = bound(k, idx);
+	if (!kdgu_inc(k, &idx)) return k->len;
+
+	while (idx < k->len) {
+		/* The same goes for any two ASCII characters. */
+		if (k->fmt == KDGU_FMT_UTF8
+		    && k->s[idx] < 0x80 && k->s[idx - 1] < 0x80
+		    && (k->s[idx - 1] != '\r' || k->s[idx] != '\n'))
+			break;
+
+		uint8_t e = grapheme_table[state][bound(k, idx)];
+		if (e & GB_BREAK) break;
+		state = e;
+		if (!kdgu_inc(k, &idx)) return k->len;
+	}
+
+	return idx;
+}
+
+/* Whether a grapheme cluster ends right before `idx'. */
+
 static bool
-grapheme_break(enum boundclass l, enum boundclass r)
-{
-	if (l == BOUNDCLASS_START) {
-		return true; /* GB1 */
-	} else if (l == BOUNDCLASS_CR
-	           && r == BOUNDCLASS_LF) {
-		return false; /* GB3 */
-	} else if (l >= BOUNDCLASS_CR
-	           && l <= BOUNDCLASS_CONTROL) {
-		return true; /* GB4 */
-	} else if (r >= BOUNDCLASS_CR
-	           && r <= BOUNDCLASS_CONTROL) {
-		return true; /* GB5 */
-	} else if (l == BOUNDCLASS_L &&
-	           (r == BOUNDCLASS_L ||
-	            r == BOUNDCLASS_V ||
-	            r == BOUNDCLASS_LV ||
-	            r == BOUNDCLASS_LVT)) {
-		return false; /* GB6 */
-	} else if ((l == BOUNDCLASS_LV ||
-	            l == BOUNDCLASS_V) &&
-	           (r == BOUNDCLASS_V ||
-	            r == BOUNDCLASS_T)) {
-		return false; /* GB7 */
-	} else if ((l == BOUNDCLASS_LVT ||
-	            l == BOUNDCLASS_T) &&
-	           r == BOUNDCLASS_T) {
-		return false; /* GB8 */
-	} else if (r == BOUNDCLASS_EXTEND || /* GB9 */
-	           r == BOUNDCLASS_ZWJ ||
-	           r == BOUNDCLASS_SPACINGMARK || /* GB9a */
-	           l == BOUNDCLASS_PREPEND) {
-		return false; /* GB9b */
-	} else if ((l == BOUNDCLASS_E_BASE ||
-	            l == BOUNDCLASS_E_BASE_GAZ) &&
-	           r == BOUNDCLASS_E_MODIFIER) {
-		return false; /* GB10  */
-	} else if ((l == BOUNDCLASS_ZWJ &&
-	            (r == BOUNDCLASS_GLUE_AFTER_ZWJ ||
-	             r == BOUNDCLASS_E_BASE_GAZ))) {
-		return false; /* GB11 */
-	} else if (l == BOUNDCLASS_REGIONAL_INDICATOR &&
-	           r == BOUNDCLASS_REGIONAL_INDICATOR) {
-		return false; /* GB12/13 */
+grapheme_boundary(const kdgu *k, unsigned idx)
+{
+	if (!idx || idx >= k->len) return true;
+	if (BYTEWISE(k))
+		return k->s[idx - 1] != '\r' || k->s[idx] != '\n';
+
+	unsigned r = bound(k, idx), i = idx;
+	if (!kdgu_dec(k, &i)) return true;
+	unsigned state = bound(k, i);
+
+	/* GB10, GB12 and GB13 depend on more than the last class. */
+	if (state == BOUNDCLASS_EXTEND && r == BOUNDCLASS_E_MODIFIER) {
+		while (kdgu_dec(k, &i) && bound(k, i) == BOUNDCLASS_EXTEND);
+		if (bound(k, i) == BOUNDCLASS_E_BASE
+		    || bound(k, i) == BOUNDCLASS_E_BASE_GAZ)
+			state = GB_EB_EXTEND;
+	} else if (state == BOUNDCLASS_REGIONAL_INDICATOR
+	           && r == BOUNDCLASS_REGIONAL_INDICATOR) {
+		unsigned n = 1;
+		while (kdgu_dec(k, &i)
+		       && bound(k, i) == BOUNDCLASS_REGIONAL_INDICATOR)
+			n++;
+		if (!(n % 2)) state = GB_RI_PAIR;
 	}
 
-	return true; /* GB999 */
+	return grapheme_table[state][r] & GB_BREAK;
+}
+
+kdgu_chriter
+kdgu_chrbegin(const kdgu *k, unsigned idx)
+{
+	return (kdgu_chriter){ k, idx, 0 };
+}
+
+bool
+kdgu_chrnext(kdgu_chriter *it)
+{
+	it->off += it->len;
+
+	if (!it->k || it->off >= it->k->len)
+		return it->len = 0, false;
+
+	it->len = grapheme_end(it->k, it->off) - it->off;
+	return true;
 }
 
 unsigned
@@ -212,41 +499,19 @@ kdgu_next(const kdgu *k, unsigned *idx)
 {
 	if (!k) return 0;
 	unsigned now = *idx;
-
-	do {
-		unsigned tmp = *idx;
-		uint32_t c1 = kdgu_decode(k, *idx);
-		kdgu_inc(k, idx);
-		uint32_t c2 = kdgu_decode(k, *idx);
-		*idx = tmp;
-		if (grapheme_break(codepoint(c1)->bound,
-		                   codepoint(c2)->bound))
-			break;
-	} while (kdgu_inc(k, idx));
-	if (!kdgu_inc(k, idx)) *idx = now;
-
+	*idx = grapheme_end(k, now);
 	return *idx - now;
 }
 
 unsigned
 kdgu_prev(const kdgu *k, unsigned *idx)
 {
-	if (!k) return 0;
+	if (!k || !*idx || *idx > k->len) return 0;
 	unsigned now = *idx;
 
-	do {
-		unsigned tmp = *idx;
-		uint32_t c1 = kdgu_decode(k, *idx);
-		kdgu_dec(k, idx);
-		uint32_t c2 = kdgu_decode(k, *idx);
-		*idx = tmp;
-		if (grapheme_break(codepoint(c1)->bound,
-		                   codepoint(c2)->bound))
-			break;
-	} while (kdgu_dec(k, idx));
-	if (!kdgu_dec(k, idx)) *idx = now;
+	while (kdgu_dec(k, idx) && !grapheme_boundary(k, *idx));
 
-	return *idx - now;
+	return now - *idx;
 }
 
 static unsigned
@@ -265,6 +530,10 @@ insert_point(kdgu *k, unsigned idx, uint32_t c)
 		return 0;
 	}
 
+	if (!own(k)) return 0;
+	drop_index(k);
+	if (c >= 0x80 || !keeps_norm(k, idx)) k->norm = KDGU_NORM_NONE;
+	k->flags &= point_flags(c);
 	kdgu_size(k, k->len + len);
 	if (k->len)
 		memmove(k->s + idx + len,
@@ -276,36 +545,29 @@ insert_point(kdgu *k, unsigned idx, uint32_t c)
 	return len;
 }
 
-static unsigned
-insert_buffer(kdgu *k, unsigned idx, uint8_t *buf, unsigned len)
-{
-	if (!k) return 0;
-
-	kdgu_size(k, k->len + len);
-	memmove(k->s + idx + len,
-	        k->s + idx,
-	        k->len - idx);
-	memcpy(k->s + idx, buf, len);
-	k->len += len;
-
-	return len;
-}
-
 unsigned
 kdgu_len(const kdgu *k)
 {
 	if (!k || !k->len) return 0;
 
-	unsigned l = 0, idx = 0;
-	while (kdgu_next(k, &idx)) l++;
+	const struct chrindex *x = get_index(k);
+	if (x) return x->num;
+
+	unsigned l = 0;
+	for (kdgu_chriter it = kdgu_chrbegin(k, 0); kdgu_chrnext(&it);)
+		l++;
 
 	return l;
 }
 
+/*
+ * Writes the full decomposition of `c' into `buf', which must have
+ * room for DECOMP_MAX code points, and returns its length. Only the
+ * canonical mappings are applied unless `compat' is set.
+ */
+
 static unsigned
-decompose_char(uint32_t c,
-               uint32_t *buf,
-               unsigned buflen)
+decompose_char(uint32_t c, uint32_t *buf, bool compat)
 {
 	const struct codepoint *cp = codepoint(c);
 	int32_t hangul_s = c - HANGUL_SBASE;
@@ -313,9 +575,6 @@ decompose_char(uint32_t c,
 	if (hangul_s >= 0 && hangul_s < HANGUL_SCOUNT) {
 		uint32_t hangul_t = hangul_s % HANGUL_TCOUNT;
 
-		if (!buf || !buflen)
-			return hangul_t ? 3 : 2;
-
 		buf[0] = HANGUL_LBASE +
 			hangul_s / HANGUL_NCOUNT;
 
@@ -327,10 +586,22 @@ decompose_char(uint32_t c,
 		return buf[2] = HANGUL_TBASE + hangul_t, 3;
 	}
 
-	if (cp->decomp != UINT16_MAX)
-		return write_sequence(buf, cp->decomp);
+	/*
+	 * The decomposition type doesn't distinguish <font> from a
+	 * canonical mapping, but the NFD quick check does.
+	 */
+	uint16_t decomp = cp_mapping(cp)->decomp;
+	if (decomp == UINT16_MAX
+	    || (!compat && !(cp->qc & QC_NFD_NO)))
+		return *buf = c, 1;
+
+	uint32_t seq[DECOMP_MAX];
+	unsigned len = write_sequence(seq, decomp), n = 0;
 
-	return *buf = c, 1;
+	for (unsigned i = 0; i < len; i++)
+		n += decompose_char(seq[i], buf + n, compat);
+
+	return n;
 }
 
 bool
@@ -339,56 +610,134 @@ kdgu_setchr(kdgu *k, unsigned idx, uint32_t c)
 	return delete_point(k, idx), insert_point(k, idx, c);
 }
 
-bool
-kdgu_uc(kdgu *k)
+static void
+append_bytes(kdgu *k, const uint8_t *s, unsigned n)
+{
+	kdgu_size(k, k->len + n);
+	memcpy(k->s + k->len, s, n);
+	k->len += n;
+}
+
+/*
+ * Changes the case of every code point of `k' in one pass into a new
+ * buffer. Runs of ASCII go through the vector kernel and everything
+ * else through the tables, with the simple mapping taking precedence
+ * over the special one. Code points that don't change are copied a
+ * run at a time, and if nothing turns out to have changed the new
+ * buffer is thrown away and the string is left alone. A code point
+ * whose mapping can't be encoded is reported and kept.
+ */
+
+static bool
+map_case(kdgu *k, bool upper)
 {
 	if (!k || !k->len) return false;
-	unsigned idx = 0;
 
-	do {
-		uint32_t c = kdgu_decode(k, idx);
-		const struct codepoint *cp = codepoint(c);
+	/* ASCII doesn't change length, so it can be done in place. */
+	if (BYTEWISE(k)) {
+		if (!own(k)) return false;
+		kernels.ascii_case(k->s, k->s, k->len, upper);
+		return true;
+	}
+
+	bool bytewise = k->fmt == KDGU_FMT_UTF8
+		|| k->fmt == KDGU_FMT_ASCII
+		|| k->fmt == KDGU_FMT_CP1252;
+	bool wide = !bytewise && k->fmt != KDGU_FMT_EBCDIC;
+	bool little = GETENDIAN(k->fmt) == KDGU_ENDIAN_LITTLE;
+	kdgu out = { .fmt = k->fmt };
+	unsigned flags = ASCII_FLAGS, copied = 0;
+	bool changed = false;
+
+	for (kdgu_iter it = iter_begin(k, 0); iter_next(&it);) {
+		/* In UTF-16 and UTF-32 an ASCII letter's case is one bit. */
+		if (wide && it.c < 0x80) {
+			if (it.c - (upper ? 'a' : 'A') > 25) continue;
+			if (!out.alloc) kdgu_size(&out, k->len);
+			append_bytes(&out, k->s + copied, it.off + it.len - copied);
+			out.s[out.len - (little ? it.len : 1)] ^= 0x20;
+			copied = it.off + it.len, changed = true;
+			continue;
+		}
+
+		if (bytewise && it.c < 0x80) {
+			append_bytes(&out, k->s + copied, it.off - copied);
+			kdgu_size(&out, out.len + k->len - it.off);
+			it.len = kernels.ascii_case(out.s + out.len,
+			                            k->s + it.off,
+			                            k->len - it.off,
+			                            upper);
+			changed |= memcmp(out.s + out.len, k->s + it.off, it.len);
+			out.len += it.len, copied = it.off + it.len;
+			continue;
+		}
+
+		const struct mapping *m = cp_mapping(lookup_codepoint(it.c));
+		uint16_t seq = upper
+			? (m->upper != UINT16_MAX ? m->upper : m->special_uc)
+			: (m->lower != UINT16_MAX ? m->lower : m->special_lc);
+
 		uint32_t buf[20];
-		unsigned len;
+		unsigned len = write_sequence(buf, seq), n = 0, f = flags;
+
+		if (!len) {
+			flags &= point_flags(it.c);
+			continue;
+		}
+
+		if (!out.alloc) kdgu_size(&out, k->len + len * 4);
+		append_bytes(&out, k->s + copied, it.off - copied);
+		kdgu_size(&out, out.len + len * 4);
+
+		for (unsigned i = 0; i < len; i++) {
+			unsigned l;
+			struct error err = kdgu_encode(buf[i],
+			                               out.s + out.len + n, &l,
+			                               k->fmt, it.off,
+			                               GETENDIAN(k->fmt));
+
+			if (err.kind) {
+				err.codepoint = buf[i];
+				err.data = format[k->fmt];
+				if (!pusherror(k, err)) {
+					free(out.s);
+					return false;
+				}
+
+				memcpy(out.s + out.len, k->s + it.off, it.len);
+				n = it.len, f = flags & point_flags(it.c);
+				break;
+			}
+
+			n += l, f &= point_flags(buf[i]);
+		}
 
-		if (cp->upper != UINT16_MAX) {
-			len = write_sequence(buf, cp->upper);
-		} else if (cp->special_uc != UINT16_MAX) {
-			len = write_sequence(buf, cp->special_uc);
-		} else continue;
+		changed |= n != it.len || memcmp(out.s + out.len, k->s + it.off, n);
+		out.len += n;
+		copied = it.off + it.len, flags = f;
+	}
+
+	if (!changed) return free(out.s), k->flags = flags, true;
 
-		delete_point(k, idx);
-		for (unsigned i = 0; i < len; i++)
-			insert_point(k, idx, buf[i]);
-	} while (kdgu_inc(k, &idx));
+	append_bytes(&out, k->s + copied, k->len - copied);
+	drop_index(k);
+	release(k);
+	k->s = out.s, k->len = out.len, k->alloc = out.alloc;
+	k->flags = flags, k->norm = KDGU_NORM_NONE;
 
 	return true;
 }
 
 bool
-kdgu_lc(kdgu *k)
+kdgu_uc(kdgu *k)
 {
-	if (!k || !k->len) return false;
-	unsigned idx = 0;
-
-	do {
-		uint32_t c = kdgu_decode(k, idx);
-		const struct codepoint *cp = codepoint(c);
-		uint32_t buf[20];
-		unsigned len;
-
-		if (cp->lower != UINT16_MAX) {
-			len = write_sequence(buf, cp->lower);
-		} else if (cp->special_lc != UINT16_MAX) {
-			len = write_sequence(buf, cp->special_lc);
-		} else continue;
-
-		delete_point(k, idx);
-		for (unsigned i = 0; i < len; i++)
-			insert_point(k, idx, buf[i]);
-	} while (kdgu_inc(k, &idx));
+	return map_case(k, true);
+}
 
-	return true;
+bool
+kdgu_lc(kdgu *k)
+{
+	return map_case(k, false);
 }
 
 bool
@@ -421,7 +770,7 @@ kdgu_reverse(kdgu *k)
 void
 kdgu_size(kdgu *k, size_t n)
 {
-	if (n <= k->alloc) return;
+	if (!own(k) || n <= k->alloc) return;
 
 	if (!k->alloc || n >= k->alloc * 2) k->alloc = n;
 	else k->alloc *= 2;
@@ -498,9 +847,9 @@ leading_nonstarters(uint32_t *buf, unsigned len)
 static unsigned
 trailing_nonstarters(uint32_t *buf, unsigned len)
 {
-	int n = len - 1;
-	while (n >= 0 && codepoint(buf[n])->ccc) n--;
-	return len - n;
+	unsigned n = 0;
+	while (n < len && codepoint(buf[len - n - 1])->ccc) n++;
+	return n;
 }
 
 /*
@@ -513,61 +862,97 @@ safenize(kdgu *k)
 {
 	unsigned non_starter_count = 0;
 
-	for (unsigned i = 0; i < k->len; kdgu_inc(k, &i)) {
+	for (unsigned i = 0; i < k->len;) {
+		if (k->fmt == KDGU_FMT_UTF8 && k->s[i] < 0x80) {
+			i += kernels.ascii(k->s + i, k->len - i);
+			non_starter_count = 0;
+			continue;
+		}
+
 		uint32_t c = kdgu_decode(k, i);
-		uint32_t buf[100];
-		unsigned len = decompose_char(c, buf, 100);
+		uint32_t buf[DECOMP_MAX];
+		unsigned len = decompose_char(c, buf, true);
+		unsigned leading = leading_nonstarters(buf, len);
 
-		if (leading_nonstarters(buf, len)
-		    + non_starter_count > 30) {
+		if (leading + non_starter_count > 30) {
 			/* Insert the combining grapheme joiner. */
 			insert_point(k, i, 0x34F);
 			kdgu_inc(k, &i);
 			non_starter_count = 0;
 		}
 
-		unsigned trailing = trailing_nonstarters(buf, len);
-		non_starter_count = trailing == len
-			? trailing
-			: non_starter_count + len;
+		non_starter_count = leading == len
+			? non_starter_count + len
+			: trailing_nonstarters(buf, len);
+
+		if (!kdgu_inc(k, &i)) break;
 	}
 }
 
-kdgu *
-kdgu_new(enum fmt fmt, const uint8_t *s, size_t len)
+/*
+ * Runs `s' through the validator for the format of `k'. UTF-16 and
+ * UTF-32 look for a byte order mark only if `endian' is
+ * KDGU_ENDIAN_NONE.
+ */
+static uint8_t *
+validate(kdgu *k, const uint8_t *s, size_t *len, int endian)
 {
-	kdgu *k = malloc(sizeof *k);
-	if (!k) return NULL;
-
-	memset(k, 0, sizeof *k), k->fmt = fmt;
-	if (!len) return k;
-
-	int endian = KDGU_ENDIAN_NONE;
-
-	switch (fmt) {
-	case KDGU_FMT_CP1252: k->s = cp1252validate(k, s, &len); break;
-	case KDGU_FMT_ASCII:  k->s = asciivalidate(k, s, &len); break;
-	case KDGU_FMT_EBCDIC: k->s = ebcdicvalidate(k, s, &len); break;
-	case KDGU_FMT_UTF8:   k->s = utf8validate(k, s, &len); break;
+	switch (k->fmt) {
+	case KDGU_FMT_CP1252: return cp1252validate(k, s, len);
+	case KDGU_FMT_ASCII:  return asciivalidate(k, s, len);
+	case KDGU_FMT_EBCDIC: return ebcdicvalidate(k, s, len);
+	case KDGU_FMT_UTF8:   return utf8validate(k, s, len);
 	case KDGU_FMT_UTF16LE:
 	case KDGU_FMT_UTF16BE:
 	case KDGU_FMT_UTF16:
-		k->s = utf16validate(k, s, &len, endian);
-		break;
+		return utf16validate(k, s, len, endian);
 	case KDGU_FMT_UTF32LE:
 	case KDGU_FMT_UTF32BE:
 	case KDGU_FMT_UTF32:
-		k->s = utf32validate(k, s, &len, endian);
-		break;
+		return utf32validate(k, s, len, endian);
 	}
 
+	return NULL;
+}
+
+kdgu *
+kdgu_new(enum fmt fmt, const uint8_t *s, size_t len)
+{
+	return kdgu_new_policy(fmt, s, len, KDGU_ERRORS_ALL, 0);
+}
+
+/*
+ * Like kdgu_new(), but keeps the errors found along the way according
+ * to `policy', so that a file of garbage doesn't cost an error for
+ * every byte of it.
+ */
+kdgu *
+kdgu_new_policy(enum fmt fmt, const uint8_t *s, size_t len,
+		enum errpolicy policy, unsigned max)
+{
+	kdgu *k = malloc(sizeof *k);
+	if (!k) return NULL;
+
+	memset(k, 0, sizeof *k), k->fmt = fmt, k->heap = true;
+	if (policy != KDGU_ERRORS_ALL && !kdgu_errpolicy(k, policy, max))
+		return free(k), NULL;
+	if (!len) return k->flags = ASCII_FLAGS, k;
+
+	k->s = validate(k, s, &len, KDGU_ENDIAN_NONE);
+
 	if (!k->s) {
-		free(k);
+		kdgu_free(k);
 		return NULL;
 	}
 
 	k->len = len, k->alloc = k->len;
-	kdgu_normalize(k, KDGU_NORM_NFC), safenize(k);
+
+	/* Normalization works out the flags as it scans. */
+	if (k->flags & KDGU_FLAG_ASCII) k->flags = ASCII_FLAGS;
+	else k->flags = 0;
+
+	kdgu_normalize(k, KDGU_NORM_NFC);
+	if (!(k->flags & KDGU_FLAG_ASCII)) safenize(k);
 
 	return k;
 }
@@ -578,117 +963,363 @@ kdgu_news(const char *s)
 	return kdgu_new(KDGU_FMT_UTF8, (const uint8_t *)s, strlen(s));
 }
 
+/*
+ * Returns the number of bytes at the start of `s' that the validator
+ * for `fmt' would copy through unchanged. A byte order mark is left
+ * to the validator, since it changes the format.
+ */
+static size_t
+valid_run(enum fmt fmt, const uint8_t *s, size_t len, bool *ascii)
+{
+	size_t i = 0;
+
+	switch (fmt) {
+	case KDGU_FMT_CP1252:
+		while (i < len && IS_VALID_CP1252(s[i])) i++;
+		return i;
+
+	case KDGU_FMT_EBCDIC:
+		while (i < len && s[i] != 48 && s[i] != 49) i++;
+		return i;
+
+	case KDGU_FMT_ASCII:
+		return kernels.ascii(s, len);
+
+	case KDGU_FMT_UTF8:
+		if (len >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF)
+			return 0;
+		return utf8run(s, len, ascii);
+
+	case KDGU_FMT_UTF16:
+	case KDGU_FMT_UTF16BE:
+	case KDGU_FMT_UTF16LE:
+		if (len >= 2 && ((s[0] == 0xFF && s[1] == 0xFE)
+		                 || (s[0] == 0xFE && s[1] == 0xFF)))
+			return 0;
+		*ascii = false;
+		return utf16run(s, len, GETENDIAN(fmt));
+
+	case KDGU_FMT_UTF32:
+	case KDGU_FMT_UTF32BE:
+	case KDGU_FMT_UTF32LE:
+		if (len >= 4 && (READUTF32(KDGU_ENDIAN_BIG, s) == 0xFEFF
+		                 || READUTF32(KDGU_ENDIAN_BIG, s) == 0xFFFE0000))
+			return 0;
+		*ascii = false;
+		return len % 4 ? 0 : kernels.utf32_plain(s, len, GETENDIAN(fmt));
+	}
+
+	return 0;
+}
+
+/*
+ * Makes a string that borrows `s' instead of copying it, so `s' has
+ * to outlive it and stay unchanged. Only input that needs no repair
+ * can be borrowed; anything else is copied, repaired and has its
+ * errors recorded exactly as kdgu_new() would. A view is not
+ * normalized.
+ */
 kdgu *
-kdgu_copy(const kdgu *k)
+kdgu_view(enum fmt fmt, const uint8_t *s, size_t len)
 {
-	kdgu *r = malloc(sizeof *r);
-	if (!r) return NULL;
-	memset(r, 0, sizeof *r);
+	bool ascii = true;
+	if (!len || len > UINT_MAX || valid_run(fmt, s, len, &ascii) != len)
+		return kdgu_new(fmt, s, len);
 
-	r->fmt = k->fmt;
-	r->len = k->len;
-	r->alloc = k->len;
-	r->s = malloc(k->len);
+	kdgu *k = malloc(sizeof *k);
+	if (!k) return NULL;
 
-	if (!r->s) return free(r), NULL;
-	memcpy(r->s, k->s, k->len);
+	memset(k, 0, sizeof *k);
+	k->fmt = fmt, k->len = len, k->view = k->heap = true;
+	k->s = (uint8_t *)(uintptr_t)s;
+	k->flags = ascii ? ASCII_FLAGS : 0;
 
-	return r;
+	return k;
+}
+
+/*
+ * Maps the file at `path' and, if it's valid in `fmt', returns a view
+ * of the mapping, so the file is read straight from the page cache
+ * and never copied. A file that needs repair is copied out of the
+ * mapping by kdgu_new() instead. Returns NULL with errno set if the
+ * file can't be opened or mapped; a string's length has to fit in an
+ * unsigned, so larger files fail with EFBIG.
+ */
+kdgu *
+kdgu_open_mmap(const char *path, enum fmt fmt)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st)) return close(fd), NULL;
+
+	if (st.st_size > UINT_MAX) {
+		close(fd);
+		errno = EFBIG;
+		return NULL;
+	}
+
+	if (!st.st_size) return close(fd), kdgu_new(fmt, NULL, 0);
+
+	size_t len = st.st_size;
+	uint8_t *s = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) return NULL;
+
+	/* Validation reads it once from start to end. */
+	madvise(s, len, MADV_SEQUENTIAL);
+
+	kdgu *k = kdgu_view(fmt, s, len);
+	if (k && k->view) return k->mapped = true, k;
+
+	munmap(s, len);
+	return k;
+}
+
+kdgu_decoder *
+kdgu_decoder_new(enum fmt from, enum fmt to)
+{
+	return kdgu_decoder_new_policy(from, to, KDGU_ERRORS_ALL, 0);
+}
+
+/*
+ * Like kdgu_decoder_new(), but every string it returns keeps its
+ * errors according to `policy', as kdgu_new_policy() does, so a
+ * hostile stream can't cost an error for every byte of it.
+ */
+kdgu_decoder *
+kdgu_decoder_new_policy(enum fmt from, enum fmt to,
+			enum errpolicy policy, unsigned max)
+{
+	kdgu_decoder *d = malloc(sizeof *d);
+	if (!d) return NULL;
+	memset(d, 0, sizeof *d);
+	d->fmt = from, d->to = to;
+	d->policy = policy, d->max = max;
+	return d;
 }
 
 void
-kdgu_free(kdgu *k)
+kdgu_decoder_free(kdgu_decoder *d)
 {
-	if (!k) return;
-	if (k->errlist) free(k->errlist->err);
-	free(k->errlist);
-	free(k->s);
-	free(k);
+	free(d);
 }
 
-unsigned
-kdgu_inc(const kdgu *k, unsigned *idx)
+/*
+ * Looks for a byte order mark at the start of the stream, the same
+ * ones kdgu_new() takes off. Returns its length, or -1 if there
+ * aren't enough bytes yet to tell.
+ */
+static int
+stream_bom(kdgu_decoder *d, const uint8_t *s, size_t n, bool last)
 {
-	if (!k || *idx >= k->len) return 0;
-	unsigned now = *idx;
+	static const uint8_t utf8[] = { 0xEF, 0xBB, 0xBF };
+	static const uint8_t be16[] = { 0xFE, 0xFF }, le16[] = { 0xFF, 0xFE };
+	static const uint8_t be32[] = { 0, 0, 0xFE, 0xFF };
+	static const uint8_t le32[] = { 0xFF, 0xFE, 0, 0 };
 
-	switch (k->fmt) {
-	case KDGU_FMT_CP1252:
-	case KDGU_FMT_EBCDIC:
-	case KDGU_FMT_ASCII:
-		now++;
-		break;
+	const uint8_t *bom[2] = { NULL, NULL };
+	size_t len = 0;
+
+	switch (d->fmt) {
+	case KDGU_FMT_UTF8:  bom[0] = utf8, len = 3; break;
+	case KDGU_FMT_UTF16: bom[0] = be16, bom[1] = le16, len = 2; break;
+	case KDGU_FMT_UTF32: bom[0] = be32, bom[1] = le32, len = 4; break;
+	default: return 0;
+	}
+
+	for (int i = 0; i < 2 && bom[i]; i++) {
+		if (memcmp(s, bom[i], n < len ? n : len)) continue;
+		if (n < len) return last ? 0 : -1;
+
+		/* Big endian is what the generic formats mean already. */
+		if (i) d->fmt = d->fmt == KDGU_FMT_UTF16
+			? KDGU_FMT_UTF16LE : KDGU_FMT_UTF32LE;
+
+		return len;
+	}
+
+	return 0;
+}
 
+/*
+ * Returns how much of `s' can be decoded without the next chunk,
+ * leaving out a trailing sequence that the next chunk could still
+ * complete. A UTF-8 sequence is left out if it could run past the
+ * end, even if the bytes that are there already show it's broken, so
+ * that it fails the same way it would have in one piece.
+ */
+static size_t
+stream_cut(const kdgu_decoder *d, const uint8_t *s, size_t n)
+{
+	switch (d->fmt) {
 	case KDGU_FMT_UTF8:
-		do {
-			now++;
-		} while (now < k->len && UTF8CONT(k->s[now]));
-		break;
+		for (size_t i = n > 3 ? n - 3 : 0; i < n; i++) {
+			if (UTF8CONT(s[i]) || !UTF8VALID(s[i])) continue;
 
+			unsigned len = s[i] >= 0xF0 ? 3 : s[i] >= 0xE0 ? 2
+				: s[i] >= 0xC0 ? 1 : 0;
+			if (i + len >= n) return i;
+		}
+		return n;
+
+	case KDGU_FMT_UTF16:
 	case KDGU_FMT_UTF16BE:
 	case KDGU_FMT_UTF16LE:
-	case KDGU_FMT_UTF16:
-		now += 2;
-		if (now >= k->len) break;
-		if (UTF16HIGH_SURROGATE(READUTF16(GETENDIAN(k->fmt),
-		                                  k->s + now)))
-			now += 2;
-		break;
+		n -= n % 2;
+
+		/* A high surrogate waits for its low surrogate. */
+		if (n >= 2 && UTF16HIGH_SURROGATE(READUTF16(GETENDIAN(d->fmt),
+		                                            s + n - 2)))
+			n -= 2;
+
+		return n;
 
+	case KDGU_FMT_UTF32:
 	case KDGU_FMT_UTF32BE:
 	case KDGU_FMT_UTF32LE:
-	case KDGU_FMT_UTF32:
-		now += 4;
-		break;
+		return n - n % 4;
+
+	default:
+		return n;
+	}
+}
+
+/*
+ * Validates the first `n' of the `len' bytes of a chunk into `k'.
+ * UTF-8 and UTF-16 can look past `n' to finish a sequence, and don't
+ * take off a byte order mark partway through the stream.
+ */
+static bool
+stream_validate(kdgu_decoder *d, kdgu *k, const uint8_t *s, size_t n,
+		size_t len)
+{
+	uint8_t *r;
+
+	if (d->fmt == KDGU_FMT_UTF8) {
+		r = utf8validatepart(k, s, &len, n, &d->skip);
+	} else if (d->fmt >= KDGU_FMT_UTF16 && d->fmt <= KDGU_FMT_UTF16LE) {
+		r = utf16validatepart(k, s, &len, n, GETENDIAN(d->fmt));
+	} else {
+		len = n;
+		r = n ? validate(k, s, &len, GETENDIAN(d->fmt)) : malloc(1);
+	}
+
+	if (!r) return false;
+
+	k->s = r;
+	k->len = k->alloc = len;
+
+	return true;
+}
+
+/*
+ * Takes the next `len' bytes of a stream and returns the part of it
+ * that can be decoded so far as a string in the decoder's output
+ * format. A sequence cut off at the end of the chunk is kept for the
+ * next call, unless `last' says the stream is over, and the errors
+ * of the string give their offsets in the stream rather than in the
+ * chunk. A character that can't be converted is placed by where it
+ * was decoded to, which is where it was in the chunk unless something
+ * before it was repaired. The output isn't normalized, since a chunk
+ * can end partway through something normalization would change.
+ */
+kdgu *
+kdgu_decoder_push(kdgu_decoder *d, const uint8_t *s, size_t len, bool last)
+{
+	if (!d) return NULL;
+
+	uint8_t *joined = NULL;
+
+	if (d->npart) {
+		joined = malloc(d->npart + len);
+		if (!joined) return NULL;
+		memcpy(joined, d->part, d->npart);
+		if (len) memcpy(joined + d->npart, s, len);
+		s = joined, len += d->npart;
+	}
+
+	size_t base = d->pos;
+	d->npart = 0;
+
+	if (!d->started) {
+		int bom = len ? stream_bom(d, s, len, last) : -1;
+		if (bom > 0) s += bom, len -= bom, base += bom;
+		d->started = bom >= 0 || last;
 	}
 
-	if (now > k->len) return 0;
-	unsigned r = now - *idx;
-	*idx = now;
+	size_t n = !d->started ? 0 : last ? len : stream_cut(d, s, len);
+	if (len > n) memcpy(d->part, s + n, len - n);
+	d->npart = len - n, d->pos = base + n;
+
+	kdgu *k = malloc(sizeof *k);
+	if (!k) return free(joined), NULL;
+	memset(k, 0, sizeof *k);
+	k->fmt = d->fmt, k->heap = true;
+
+	if ((d->policy != KDGU_ERRORS_ALL
+	     && !kdgu_errpolicy(k, d->policy, d->max))
+	    || !stream_validate(d, k, s, n, len)) {
+		free(joined), kdgu_free(k);
+		return NULL;
+	}
+
+	free(joined);
+	k->flags = k->flags & KDGU_FLAG_ASCII || !k->len ? ASCII_FLAGS : 0;
+
+	if (d->to != d->fmt) {
+		if (k->len) kdgu_convert(k, d->to);
+		k->fmt = d->to;
+	}
+
+	if (k->errlist)
+		for (unsigned i = 0; i < k->errlist->num; i++)
+			k->errlist->err[i].loc += base;
+
+	return k;
+}
+
+kdgu *
+kdgu_copy(const kdgu *k)
+{
+	kdgu *r = malloc(sizeof *r);
+	if (!r) return NULL;
+	memset(r, 0, sizeof *r);
+
+	r->fmt = k->fmt, r->heap = true;
+	r->flags = k->flags;
+	r->len = k->len;
+	r->alloc = k->len;
+	r->s = malloc(k->len);
+
+	if (!r->s) return free(r), NULL;
+	memcpy(r->s, k->s, k->len);
+
+	return r;
+}
+
+void
+kdgu_free(kdgu *k)
+{
+	if (!k) return;
+	if (k->errlist) free(k->errlist->err);
+	free(k->errlist);
+	drop_index(k);
+	release(k);
+	free(k);
+}
 
-	return r;
+unsigned
+kdgu_inc(const kdgu *k, unsigned *idx)
+{
+	return kdgu_inc_inline(k, idx);
 }
 
 unsigned
 kdgu_dec(const kdgu *k, unsigned *idx)
 {
-	if (!k || !idx) return 0;
-	unsigned now = *idx;
-	if (!now || now >= k->len) return 0;
-
-	switch (k->fmt) {
-	case KDGU_FMT_CP1252:
-	case KDGU_FMT_EBCDIC:
-	case KDGU_FMT_ASCII:
-		now--;
-		break;
-	case KDGU_FMT_UTF8:
-		do {
-			now--;
-		} while (now && UTF8CONT(k->s[now]));
-		break;
-	case KDGU_FMT_UTF16BE:
-	case KDGU_FMT_UTF16LE:
-	case KDGU_FMT_UTF16:
-		now -= 2;
-		if (!now) break;
-		if (UTF16LOW_SURROGATE(READUTF16(GETENDIAN(k->fmt),
-		                                 k->s + now - 2)))
-			now -= 2;
-		break;
-	case KDGU_FMT_UTF32BE:
-	case KDGU_FMT_UTF32LE:
-	case KDGU_FMT_UTF32:
-		now -= 4;
-		break;
-	}
-
-	if (now >= k->len) return 0;
-
-	unsigned r = *idx - now;
-	*idx = now;
-
-	return r;
+	return kdgu_dec_inline(k, idx);
 }
 
 bool
@@ -696,24 +1327,9 @@ kdgu_nth(const kdgu *k, unsigned *idx, unsigned n)
 {
 	if (!k) return false;
 
-	if (k->fmt == KDGU_FMT_ASCII
-	    || k->fmt == KDGU_FMT_EBCDIC
-	    || k->fmt == KDGU_FMT_CP1252) {
-		if (n >= k->len) return false;
-		*idx = n;
-		return true;
-	}
-
-	if (k->fmt == KDGU_FMT_UTF32) {
-		if (n >= k->len / 4) return false;
-		*idx = n * 4;
-		return true;
-	}
-
 	unsigned i;
-	for (i = 0; i < n; i++)
-		if (!kdgu_next(k, &i))
-			return false;
+	if (!chroffset(k, n, &i) || i >= k->len)
+		return false;
 
 	return *idx = i, true;
 }
@@ -727,38 +1343,48 @@ kdgu_convert(kdgu *k, enum fmt fmt)
 		return true;
 	}
 
-	unsigned idx = 0;
-	int endian = GETENDIAN(k->fmt);
-	if (!endian) endian = KDGU_ENDIAN_BIG;
-	else {
-		if (fmt == KDGU_FMT_UTF16LE
-		    || fmt == KDGU_FMT_UTF32LE)
-			endian = KDGU_ENDIAN_LITTLE;
-	}
+	size_t max = transcode_bound(k->fmt, fmt, k->len);
+	uint8_t *r = malloc(max);
+	if (!r) return false;
 
-	while (idx < k->len) {
-		unsigned len;
-		uint32_t c = kdgu_decode(k, idx);
-		uint8_t buf[4];
+	transcoder *f = get_transcoder(k->fmt, fmt);
+	int endian = GETENDIAN(fmt);
+	unsigned len;
+	size_t n = 0, w;
+
+	for (kdgu_iter it = iter_begin(k, 0); iter_next(&it);) {
+		/*
+		 * The transcoder does the bulk of the work and
+		 * whatever it stops at is converted by hand.
+		 */
+		if (f) {
+			it.len = f(r + n, &w, k->s + it.off, k->len - it.off);
+			n += w;
+			if (!iter_next(&it)) break;
+		}
 
-		struct error err =
-			kdgu_encode(c, buf, &len,
-				    fmt, idx, endian);
+		struct error err = kdgu_encode(it.c, r + n, &len,
+		                               fmt, it.off, endian);
 
 		if (err.kind) {
-			err.codepoint = c;
+			err.codepoint = it.c;
 			err.data = format[fmt];
 			pusherror(k, err);
 
-			kdgu_encode(KDGU_REPLACEMENT, buf, &len,
-				    fmt, idx, endian);
+			kdgu_encode(KDGU_REPLACEMENT, r + n, &len,
+				    fmt, it.off, endian);
 		}
 
-		delete_point(k, idx);
-		insert_buffer(k, idx, buf, len);
-		idx += len;
+		n += len;
 	}
 
+	/*
+	 * The flags describe code points rather than bytes, and the
+	 * replacement character is ASCII, so they're still accurate.
+	 */
+	drop_index(k);
+	release(k);
+	k->s = r, k->len = n, k->alloc = max;
 	k->fmt = fmt;
 
 	return true;
@@ -766,208 +1392,242 @@ kdgu_convert(kdgu *k, enum fmt fmt)
 
 
 /*
- * Uses bubble sort to organize the code points in `buf' according to
- * their Canonical_Combining_Class (ccc) properties.
+ * Puts the code points of `buf' into canonical order: every run of
+ * non-starters is stably sorted by Canonical_Combining_Class.
  */
 
 static void
 sort_combining_marks(uint32_t *buf, unsigned len)
 {
- sort:
-	/* We use `len - 1' because we read pairs of numbers here. */
-	for (unsigned i = 0; i < len - 1; i++) {
-		const struct codepoint *cp1 = codepoint(buf[i]);
-		const struct codepoint *cp2 = codepoint(buf[i + 1]);
+	for (unsigned i = 1; i < len; i++) {
+		uint32_t c = buf[i];
+		int ccc = codepoint(c)->ccc;
+		if (!ccc) continue;
 
-		if (!cp2->ccc
-		    || !cp1->ccc
-		    || cp2->ccc >= cp1->ccc)
-			continue;
-
-		uint32_t temp = buf[i + 1];
-
-		buf[i + 1] = buf[i];
-		buf[i] = temp;
-
-		goto sort;
+		unsigned j = i;
+		while (j && codepoint(buf[j - 1])->ccc > ccc)
+			buf[j] = buf[j - 1], j--;
+		buf[j] = c;
 	}
 }
 
 /*
- * This function does two things: it converts all decomposable code
- * points into their decomposed forms, then it sorts all sequences of
- * combining marks according to the Canonical Ordering Algorithm
- * described in Standard Annex #15.
+ * Returns the primary composite of `a' and `b', or UINT32_MAX if
+ * there isn't one. Hangul syllables aren't in the composition table
+ * and are composed arithmetically.
  */
 
-static void
-decompose(kdgu *k, bool compat)
+static uint32_t
+compose_pair(uint32_t a, uint32_t b)
 {
-	if ((k->norm == KDGU_NORM_NFD && !compat)
-	    || (k->norm == KDGU_NORM_NFKD && compat))
-		return;
-
-	/*
-	 * KDGU strings are in Stream-Safe Text Format, so there will
-	 * never be any sequences of starters and non-starters longer
-	 * than 32 code points long:
-	 * http://unicode.org/reports/tr15/#Stream_Safe_Text_Format
-	 */
-	uint32_t buf[32];
-	unsigned len;
-
-	/* This first loop decomposes all decomposable characters. */
-	for (unsigned i = 0; i < k->len; kdgu_inc(k, &i)) {
-		uint32_t c = kdgu_decode(k, i);
-		if (c == UINT32_MAX) break;
-		const struct codepoint *cp = codepoint(c);
+	/* Only code points that are "Maybe" in NFC ever come second. */
+	if (!(codepoint(b)->qc & QC_NFC_MAYBE)) return UINT32_MAX;
 
-		/* printf("the thing is: %u\n", i); */
-
-		/*
-		 * We don't need to continue if the character has no
-		 * decomposition.
-		 */
-		if (cp->decomp == UINT16_MAX) continue;
-		if (!compat && cp->decomp_type != DECOMP_TYPE_FONT)
-			continue;
+	if (a >= HANGUL_LBASE && a < HANGUL_LBASE + HANGUL_LCOUNT
+	    && b >= HANGUL_VBASE && b < HANGUL_VBASE + HANGUL_VCOUNT)
+		return HANGUL_SBASE
+			+ ((a - HANGUL_LBASE) * HANGUL_VCOUNT
+			   + b - HANGUL_VBASE) * HANGUL_TCOUNT;
 
-		len = decompose_char(c, buf,
-				     sizeof buf / sizeof *buf);
+	if (a >= HANGUL_SBASE && a < HANGUL_SBASE + HANGUL_SCOUNT
+	    && !((a - HANGUL_SBASE) % HANGUL_TCOUNT)
+	    && b > HANGUL_TBASE && b < HANGUL_TBASE + HANGUL_TCOUNT)
+		return a + b - HANGUL_TBASE;
 
-		if (!len) continue;
-		delete_point(k, i);
+	return lookup_comp(a, b);
+}
 
-		for (unsigned j = 0; j < len; j++) {
-			insert_point(k, i, buf[j]);
-			if (j != len - 1) kdgu_inc(k, &i);
-		}
-	}
+/*
+ * The Canonical Composition Algorithm from Standard Annex #15 run
+ * over the decomposed, canonically ordered code points in `buf'. The
+ * result is written back into `buf' and its length is returned.
+ */
 
-	/* This loop sorts all sequences of combining marks. */
-	for (unsigned i = 0; i < k->len; kdgu_inc(k, &i)) {
-		uint32_t c = kdgu_decode(k, i);
-		const struct codepoint *cp = codepoint(c);
+static unsigned
+compose_points(uint32_t *buf, unsigned len)
+{
+	if (!len) return 0;
 
-		/* It's a starter. No sequence here! */
-		if (!cp->ccc) continue;
+	unsigned starter = 0, out = 1;
+	bool have_starter = !codepoint(buf[0])->ccc;
+	int last = 0;
 
-		unsigned now = i;
-		len = 0;
+	for (unsigned i = 1; i < len; i++) {
+		int ccc = codepoint(buf[i])->ccc;
 
-		/* Search for the end of the sequence. */
-		do {
-			buf[len++] = c;
-			kdgu_inc(k, &i);
+		/*
+		 * `last' is zero only when the last code point we kept
+		 * is the starter itself, so nothing can block it.
+		 */
+		if (have_starter && (!last || last < ccc)) {
+			uint32_t c = compose_pair(buf[starter], buf[i]);
+			if (c != UINT32_MAX) {
+				buf[starter] = c;
+				continue;
+			}
+		}
 
-			c = kdgu_decode(k, i);
-			cp = codepoint(c);
-		} while (cp->ccc
-		         && len < sizeof buf / sizeof *buf);
+		if (!ccc) starter = out, have_starter = true;
+		last = ccc;
+		buf[out++] = buf[i];
+	}
 
-		sort_combining_marks(buf, len);
+	return out;
+}
 
-		/* Delete the sequence. */
-		kdgu_delete(k, now, i);
-		i = now;
+struct segment {
+	uint32_t *c;
+	unsigned len, alloc;
+};
 
-		for (unsigned j = 0; j < len; j++) {
-			insert_point(k, i, buf[j]);
-			if (j != len - 1) kdgu_inc(k, &i);
-		}
+static bool
+segment_push(struct segment *seg, const uint32_t *c, unsigned n)
+{
+	if (seg->len + n > seg->alloc) {
+		unsigned alloc = seg->alloc ? seg->alloc * 2 : 64;
+		while (alloc < seg->len + n) alloc *= 2;
+		uint32_t *p = realloc(seg->c, alloc * sizeof *p);
+		if (!p) return false;
+		seg->c = p, seg->alloc = alloc;
 	}
 
-	k->norm = compat ? KDGU_NORM_NFKD : KDGU_NORM_NFD;
+	memcpy(seg->c + seg->len, c, n * sizeof *c);
+	seg->len += n;
+
+	return true;
 }
 
+/*
+ * Normalizes the bytes of `k' in [a, b) and appends the result to
+ * `out', reporting any code points that can't be encoded to `k'.
+ */
+
 static bool
-compose_char(kdgu *k, unsigned idx)
+normalize_segment(kdgu *k, kdgu *out, struct segment *seg,
+                  unsigned a, unsigned b, bool compat, bool comp)
 {
-	unsigned now = idx;
-
-	/* Read the pair of code points. */
-	uint32_t c1 = kdgu_decode(k, idx);
-	if (!kdgu_inc(k, &idx) || idx == k->len) return false;
-	uint32_t c2 = kdgu_decode(k, idx);
+	seg->len = 0;
 
-	idx = now;
+	for (kdgu_iter it = iter_begin(k, a); iter_next(&it) && it.off < b;) {
+		uint32_t buf[DECOMP_MAX];
+		unsigned len = decompose_char(it.c, buf, compat);
+		if (!segment_push(seg, buf, len)) return false;
+	}
 
-	const struct codepoint *cp1 = codepoint(c1);
-	const struct codepoint *cp2 = codepoint(c2);
-	if (!cp1 || !cp2) return false;
+	sort_combining_marks(seg->c, seg->len);
+	if (comp) seg->len = compose_points(seg->c, seg->len);
 
-	uint32_t composition = lookup_comp(c1, c2);
-	/* No valid composition exists; do nothing. */
-	if (composition == UINT32_MAX) return false;
+	for (unsigned i = 0; i < seg->len; i++) {
+		uint8_t buf[4];
+		unsigned len;
+		struct error err = kdgu_encode(seg->c[i], buf, &len, k->fmt,
+		                               out->len, GETENDIAN(k->fmt));
 
-	/*
-	 * Only at this point are we sure we have a valid composition.
-	 */
+		if (err.kind) {
+			err.codepoint = seg->c[i];
+			err.data = format[k->fmt];
+			if (!pusherror(k, err)) return false;
+			continue;
+		}
 
-	kdgu_inc(k, &idx), kdgu_inc(k, &idx);
-	kdgu_delete(k, now, idx);
-	insert_point(k, now, composition);
+		out->flags &= point_flags(seg->c[i]);
+		append_bytes(out, buf, len);
+	}
 
 	return true;
 }
 
 /*
- * This function will first decompose all decomposable code points and
- * sort all combining marks with `decompose()'. Then it will read
- * pairs of code points and use the trie sequence indices to look up
- * possible compositions. If it successfully finds a composition for
- * any pair of characters it will delete that pair and insert the
- * composition at that point.
+ * Brings `k' into the normalization form `norm' in a single pass.
  *
- * It's worth noting that NFC and NFKC have identical compositions
- * (only their decompositions differ), so this function's composition
- * code has no additional logic for NFKC.
+ * Code points whose quick check value for the form is "Yes" and that
+ * are in canonical order with their neighbours are left alone. When
+ * one isn't, we back up to the last stable starter (a starter that is
+ * "Yes" itself, so nothing before it can interact with anything after
+ * it), run forward to the next one, and normalize just the code
+ * points in between. Everything else is copied through verbatim, so
+ * text that is already normalized costs one scan and no allocation.
  */
 
-/* TODO: Use faster checks to reduce unnecessary processing. */
-static void
-compose(kdgu *k, bool compat)
-{
-	if ((k->norm == KDGU_NORM_NFC && !compat)
-	    || (k->norm == KDGU_NORM_NFKC && compat))
-		return;
+static bool
+normalize(kdgu *k, enum normalization norm)
+{
+	bool compat = norm == KDGU_NORM_NFKC || norm == KDGU_NORM_NFKD;
+	bool comp = norm == KDGU_NORM_NFC || norm == KDGU_NORM_NFKC;
+	unsigned mask =
+		norm == KDGU_NORM_NFC  ? QC_NFC_NO | QC_NFC_MAYBE :
+		norm == KDGU_NORM_NFKC ? QC_NFKC_NO | QC_NFKC_MAYBE :
+		norm == KDGU_NORM_NFD  ? QC_NFD_NO : QC_NFKD_NO;
+
+	kdgu out = { .fmt = k->fmt, .flags = ASCII_FLAGS };
+	struct segment seg = { NULL, 0, 0 };
+	unsigned copied = 0, stable = 0, flags = ASCII_FLAGS;
+	bool dirty = false, bytewise = k->fmt == KDGU_FMT_UTF8
+		|| k->fmt == KDGU_FMT_ASCII;
+	int last = 0;
+
+	kdgu_iter it = iter_begin(k, 0);
+
+	while (iter_next(&it)) {
+		/* ASCII is "Yes" in every form and is always a starter. */
+		if (bytewise && it.c < 0x80) {
+			it.len = kernels.ascii(k->s + it.off, k->len - it.off);
+			stable = it.off + it.len - 1, last = 0;
+			continue;
+		}
 
-	decompose(k, compat);
+		const struct codepoint *cp = codepoint(it.c);
 
-	for (unsigned i = 0; i < k->len; kdgu_inc(k, &i)) {
-		/*
-		 * We decrement here to offset the increment that will
-		 * occur in the next iteration of the loop. This is
-		 * done so that when a successful composition occurs
-		 * the next pair will include the new composition code
-		 * point; this correctly composes longer sequences of
-		 * combining marks on a single starter code point.
-		 */
+		if (!(cp->qc & mask) && (!cp->ccc || cp->ccc >= last)) {
+			if (!cp->ccc) stable = it.off;
+			last = cp->ccc, flags &= point_flags(it.c);
+			continue;
+		}
 
-		if (compose_char(k, i) && !kdgu_dec(k, &i)) {
-			compose(k, compat);
-			break;
+		/* Run up to the next stable starter. */
+		for (uint32_t c; (c = iter_peek(&it)) != UINT32_MAX;) {
+			cp = codepoint(c);
+			if (!cp->ccc && !(cp->qc & mask)) break;
+			iter_next(&it);
 		}
+
+		unsigned end = it.off + it.len;
+		append_bytes(&out, k->s + copied, stable - copied);
+		if (!normalize_segment(k, &out, &seg, stable, end,
+		                       compat, comp)) {
+			free(seg.c), free(out.s);
+			return false;
+		}
+
+		dirty = true;
+		copied = stable = end, last = 0;
 	}
 
-	k->norm = compat ? KDGU_NORM_NFKC : KDGU_NORM_NFC;
+	free(seg.c);
+	if (!dirty) return k->flags = flags, true;
+
+	append_bytes(&out, k->s + copied, k->len - copied);
+	drop_index(k);
+	release(k);
+	k->s = out.s, k->len = out.len, k->alloc = out.alloc;
+	k->flags = flags & out.flags;
+
+	return true;
 }
 
 bool
 kdgu_normalize(kdgu *k, enum normalization norm)
 {
 	if (!k || !k->len) return false;
-	if (k->fmt == KDGU_FMT_ASCII) return true;
-
-	switch (norm) {
-	case KDGU_NORM_NONE:                      break;
-	case KDGU_NORM_NFD:  decompose(k, false); break;
-	case KDGU_NORM_NFC:  compose(k, false);   break;
-	case KDGU_NORM_NFKD: decompose(k, true);  break;
-	case KDGU_NORM_NFKC: compose(k, true);    break;
-	}
 
-	return true;
+	/* ASCII is in every normalization form. */
+	if (k->fmt == KDGU_FMT_ASCII || k->flags & KDGU_FLAG_ASCII)
+		return k->norm = norm, true;
+
+	if (norm == KDGU_NORM_NONE || k->norm == norm) return true;
+	if (!normalize(k, norm)) return false;
+
+	return k->norm = norm, true;
 }
 
 bool
@@ -977,7 +1637,7 @@ kdgu_cmp(const kdgu *k1, const kdgu *k2, bool insensitive, const char *locale)
 	unsigned l1 = kdgu_len(k1);
 	unsigned l2 = kdgu_len(k2);
 	return kdgu_ncmp(k1, k2, 0, 0, l1 < l2 ? l1 : l2, insensitive, locale)
-		&& (insensitive ? true : kdgu_len(k1) == kdgu_len(k2));
+		&& (insensitive ? true : l1 == l2);
 }
 
 bool
@@ -1025,6 +1685,28 @@ kdgu_ncmp(const kdgu *k1,
 	int c = 0;
 	struct locale L = parse_locale(locale);
 
+	/*
+	 * ASCII strings without any CR LF pairs have one grapheme per
+	 * byte and fold like `tolower()', except under the Turkic
+	 * dotted and dotless i rules.
+	 */
+	if (n > 0 && BYTEWISE(k1) && BYTEWISE(k2)
+	    && i < k1->len && j < k2->len
+	    && (!insensitive || (L.lang != LANG_TUR && L.lang != LANG_AZE))) {
+		unsigned m = k1->len - i < k2->len - j
+			? k1->len - i : k2->len - j;
+		if ((unsigned)n < m) m = n;
+
+		if (!memchr(k1->s + i, '\r', m)) {
+			if ((unsigned)n > m) return false;
+			if (!insensitive) return !memcmp(k1->s + i, k2->s + j, m);
+			for (unsigned z = 0; z < m; z++)
+				if (tolower(k1->s[i + z]) != tolower(k2->s[j + z]))
+					return false;
+			return true;
+		}
+	}
+
 	do {
 		uint32_t c1 = fold(kdgu_decode(k1, i), L);
 		uint32_t c2 = fold(kdgu_decode(k2, j), L);
@@ -1132,21 +1814,11 @@ kdgu_debugprint2(const kdgu *k, FILE *f)
 	fprintf(f, "{%u} <", kdgu_len(k));
 	unsigned i = 0;
 
-	do {
-		uint32_t c1 = kdgu_decode(k, i);
-		if (c1 == UINT32_MAX) break;
-
-		kdgu_inc(k, &i);
-		uint32_t c2 = kdgu_decode(k, i);
-
-		fprintf(f, "U+%02"PRIX32, c1);
-		if (c2 == UINT32_MAX) break;
-
-		if (grapheme_break(codepoint(c1)->bound,
-		                   codepoint(c2)->bound))
-			fprintf(f, " | ");
-		else fputc(' ', f);
-	} while (true);
+	while (i < k->len) {
+		fprintf(f, "U+%02"PRIX32, kdgu_decode(k, i));
+		if (!kdgu_inc(k, &i) || i >= k->len) break;
+		fprintf(f, grapheme_boundary(k, i) ? " | " : " ");
+	}
 
 	fputc('>', f);
 }
@@ -1173,9 +1845,11 @@ kdgu_chomp(kdgu *k)
 void
 kdgu_delete(kdgu *k, size_t a, size_t b)
 {
-	if (b > k->len || b <= a) return;
+	if (b > k->len || b <= a || !own(k)) return;
+	drop_index(k);
 	memmove(k->s + a, k->s + b, k->len - b);
 	k->len -= b - a;
+	if (!keeps_norm(k, a)) k->norm = KDGU_NORM_NONE;
 }
 
 static uint32_t cp1252[] = {
@@ -1252,50 +1926,156 @@ uint32_t
 kdgu_decode(const kdgu *k, unsigned idx)
 {
 	if (!k->len || idx >= k->len) return UINT32_MAX;
-	uint32_t c = 0;
 
 	switch (k->fmt) {
-	case KDGU_FMT_CP1252:
-		return cp1252[k->s[idx]];
+	case KDGU_FMT_CP1252: return cp1252[k->s[idx]];
+	case KDGU_FMT_EBCDIC: return ebcdic[k->s[idx]];
+	default: return kdgu_decode_inline(k, idx);
+	}
+}
 
-	case KDGU_FMT_EBCDIC:
-		return ebcdic[k->s[idx]];
+/*
+ * The decoders behind kdgu_iter. Each one decodes the code point at
+ * the start of `s', which has `n' bytes left in it, and returns its
+ * size. The string has already been validated, so they trust what
+ * they read, but a unit cut off at the end of a view still decodes
+ * to the replacement character without reading past `n'.
+ */
 
-	case KDGU_FMT_ASCII:
-		return (uint32_t)k->s[idx];
+static unsigned
+step_cp1252(const uint8_t *s, unsigned n, uint32_t *c)
+{
+	(void)n;
+	return *c = cp1252[*s], 1;
+}
 
-	case KDGU_FMT_UTF8: {
-		unsigned len = utf8chrlen(k->s + idx,
-		                          k->len - idx);
+static unsigned
+step_ebcdic(const uint8_t *s, unsigned n, uint32_t *c)
+{
+	(void)n;
+	return *c = ebcdic[*s], 1;
+}
 
-		c = (k->s[idx] & ((1 << (8 - len)) - 1))
-			<< (len - 1) * 6;
-		for (unsigned i = 1; i < len; i++)
-			c |= (k->s[idx + i] & 0x3F)
-				<< (len - i - 1) * 6;
-	} break;
+static unsigned
+step_ascii(const uint8_t *s, unsigned n, uint32_t *c)
+{
+	(void)n;
+	return *c = *s, 1;
+}
 
-	case KDGU_FMT_UTF16BE:
-	case KDGU_FMT_UTF16LE:
-	case KDGU_FMT_UTF16: {
-		uint16_t d = READUTF16(GETENDIAN(k->fmt), k->s + idx);
-		if (d <= 0xD7FF || d >= 0xE000) return d;
-
-		/* It's a surrogate upper byte. */
-		uint16_t e = READUTF16(GETENDIAN(k->fmt),
-		                       k->s + idx + 2);
-		c = (d - 0xD800) * 0x400 + e - 0xDC00 + 0x10000;
-	} break;
+static unsigned
+step_utf8(const uint8_t *s, unsigned n, uint32_t *c)
+{
+	if (*s < 0x80) return *c = *s, 1;
 
-	case KDGU_FMT_UTF32BE:
-	case KDGU_FMT_UTF32LE:
-	case KDGU_FMT_UTF32:
-		return READUTF32(GETENDIAN(k->fmt), k->s + idx);
+	unsigned len = *s < 0xE0 ? 2 : *s < 0xF0 ? 3 : 4;
+	if (len > n) len = n;
+
+	*c = *s & (0x7F >> len);
+	for (unsigned i = 1; i < len; i++)
+		*c = *c << 6 | (s[i] & 0x3F);
+
+	return len;
+}
+
+static inline unsigned
+step_utf16(const uint8_t *s, unsigned n, uint32_t *c, int endian)
+{
+	if (n < 2) return *c = KDGU_REPLACEMENT, n;
+
+	uint16_t d = READUTF16(endian, s);
+	if (!UTF16HIGH_SURROGATE(d) || n < 4) return *c = d, 2;
+
+	uint16_t e = READUTF16(endian, s + 2);
+	*c = (d - 0xD800) * 0x400 + e - 0xDC00 + 0x10000;
+
+	return 4;
+}
+
+static inline unsigned
+step_utf32(const uint8_t *s, unsigned n, uint32_t *c, int endian)
+{
+	if (n < 4) return *c = KDGU_REPLACEMENT, n;
+	return *c = READUTF32(endian, s), 4;
+}
+
+/* Specializes one of the decoders above for a byte order. */
+#define ENDIAN_STEP(NAME, BASE, ENDIAN)	  \
+	static unsigned \
+	NAME(const uint8_t *s, unsigned n, uint32_t *c) \
+	{ \
+		return BASE(s, n, c, ENDIAN); \
 	}
 
+ENDIAN_STEP(step_utf16be, step_utf16, KDGU_ENDIAN_BIG)
+ENDIAN_STEP(step_utf16le, step_utf16, KDGU_ENDIAN_LITTLE)
+ENDIAN_STEP(step_utf32be, step_utf32, KDGU_ENDIAN_BIG)
+ENDIAN_STEP(step_utf32le, step_utf32, KDGU_ENDIAN_LITTLE)
+
+static unsigned (*const step[])(const uint8_t *, unsigned, uint32_t *) = {
+	[KDGU_FMT_CP1252]  = step_cp1252,
+	[KDGU_FMT_EBCDIC]  = step_ebcdic,
+	[KDGU_FMT_ASCII]   = step_ascii,
+	[KDGU_FMT_UTF8]    = step_utf8,
+	[KDGU_FMT_UTF16]   = step_utf16be,
+	[KDGU_FMT_UTF16BE] = step_utf16be,
+	[KDGU_FMT_UTF16LE] = step_utf16le,
+	[KDGU_FMT_UTF32]   = step_utf32be,
+	[KDGU_FMT_UTF32LE] = step_utf32le,
+	[KDGU_FMT_UTF32BE] = step_utf32be
+};
+
+static inline kdgu_iter
+iter_begin(const kdgu *k, unsigned idx)
+{
+	return (kdgu_iter){ k, idx, 0, 0, k ? step[k->fmt] : NULL };
+}
+
+static inline bool
+iter_next(kdgu_iter *it)
+{
+	it->off += it->len;
+
+	if (!it->k || it->off >= it->k->len)
+		return it->len = 0, false;
+
+	it->len = it->step(it->k->s + it->off,
+	                   it->k->len - it->off,
+	                   &it->c);
+	return true;
+}
+
+static inline uint32_t
+iter_peek(const kdgu_iter *it)
+{
+	unsigned off = it->off + it->len;
+	uint32_t c;
+
+	if (!it->k || off >= it->k->len) return UINT32_MAX;
+	it->step(it->k->s + off, it->k->len - off, &c);
+
 	return c;
 }
 
+kdgu_iter
+kdgu_iterbegin(const kdgu *k, unsigned idx)
+{
+	return iter_begin(k, idx);
+}
+
+bool
+kdgu_iternext(kdgu_iter *it)
+{
+	return iter_next(it);
+}
+
+/* Returns the code point after the current one without moving. */
+uint32_t
+kdgu_iterpeek(const kdgu_iter *it)
+{
+	return iter_peek(it);
+}
+
 /* TODO: Make sure NO_CONVERSION errors are consistent. */
 struct error
 kdgu_encode(uint32_t c, uint8_t *buf, unsigned *len,
@@ -1371,18 +2151,8 @@ kdgu_chrsize(const kdgu *k, unsigned idx)
 bool
 kdgu_chrbound(const kdgu *k, unsigned idx)
 {
-	uint32_t c = kdgu_decode(k, idx);
 	if (!kdgu_inc(k, &idx)) return true;
-	if (grapheme_break(codepoint(c)->bound,
-			   codepoint(kdgu_decode(k, idx))->bound)) {
-		kdgu_dec(k, &idx);
-		return true;
-	} else {
-		kdgu_dec(k, &idx);
-		return false;
-	}
-
-	return false;
+	return grapheme_boundary(k, idx);
 }
 
 bool
@@ -1398,6 +2168,66 @@ kdgu_substr(const kdgu *k, unsigned a, unsigned b)
 	return kdgu_new(k->fmt, k->s + a, b - a);
 }
 
+/* Whether `idx' falls between two code points of `k'. */
+static bool
+point_boundary(const kdgu *k, unsigned idx)
+{
+	if (!idx || idx >= k->len) return idx <= k->len;
+
+	switch (k->fmt) {
+	case KDGU_FMT_UTF8:
+		return !UTF8CONT(k->s[idx]);
+
+	case KDGU_FMT_UTF16:
+	case KDGU_FMT_UTF16BE:
+	case KDGU_FMT_UTF16LE:
+		return idx % 2 == 0
+			&& !(UTF16LOW_SURROGATE(READUTF16(GETENDIAN(k->fmt),
+			                                  k->s + idx))
+			     && UTF16HIGH_SURROGATE(READUTF16(GETENDIAN(k->fmt),
+			                                      k->s + idx - 2)));
+
+	case KDGU_FMT_UTF32:
+	case KDGU_FMT_UTF32BE:
+	case KDGU_FMT_UTF32LE:
+		return idx % 4 == 0;
+
+	default:
+		return true;
+	}
+}
+
+/*
+ * Like kdgu_substr(), but the result borrows the bytes of `k' instead
+ * of copying and revalidating them, so it's only good for as long as
+ * `k' is left alone. Both ends have to fall between code points.
+ */
+kdgu *
+kdgu_subview(const kdgu *k, unsigned a, unsigned b)
+{
+	if (!k || b < a || b > k->len
+	    || !point_boundary(k, a) || !point_boundary(k, b))
+		return NULL;
+
+	kdgu *r = malloc(sizeof *r);
+	if (!r) return NULL;
+
+	memset(r, 0, sizeof *r);
+	r->fmt = k->fmt, r->norm = k->norm, r->flags = k->flags;
+	r->s = k->s + a, r->len = b - a, r->view = r->heap = true;
+
+	return r;
+}
+
+kdgu *
+kdgu_chrsubstr(const kdgu *k, unsigned a, unsigned b)
+{
+	if (!k || b < a) return NULL;
+	unsigned i, j;
+	if (!chroffset(k, a, &i) || !chroffset(k, b, &j)) return NULL;
+	return kdgu_substr(k, i, j);
+}
+
 bool
 kdgu_chrappend(kdgu *k, uint32_t c)
 {
@@ -1409,8 +2239,8 @@ bool
 kdgu_append(kdgu *k1, const kdgu *k2)
 {
 	if (!k1 || !k2) return false;
-	for (unsigned i = 0; i < k2->len; kdgu_inc(k2, &i))
-		if (!insert_point(k1, k1->len, kdgu_decode(k2, i)))
+	for (kdgu_iter it = iter_begin(k2, 0); iter_next(&it);)
+		if (!insert_point(k1, k1->len, it.c))
 			return false;
 	return true;
 }
@@ -1419,20 +2249,44 @@ bool
 kdgu_setappend(kdgu *k1, const kdgu *k2)
 {
 	if (!k1 || !k2) return false;
-	for (unsigned i = 0; i < k2->len; kdgu_inc(k2, &i)) {
-		uint32_t c = kdgu_decode(k2, i);
-		if (kdgu_contains(k1, c)) continue;
-		if (!insert_point(k1, k1->len, c))
-			return false;
+
+	/* Rescanning `k1' for every character would be quadratic. */
+	kdgu_set *set = kdgu_setstr(k1);
+	if (!set) return false;
+
+	for (kdgu_iter it = iter_begin(k2, 0); iter_next(&it);) {
+		if (kdgu_sethas(set, it.c)) continue;
+		if (!insert_point(k1, k1->len, it.c)
+		    || !kdgu_setadd(set, it.c, it.c))
+			return kdgu_setfree(set), false;
 	}
+
+	kdgu_setfree(set);
 	return true;
 }
 
 bool
 kdgu_contains(const kdgu *k, uint32_t c)
 {
-	for (unsigned i = 0; i < k->len; kdgu_next(k, &i))
-		if (kdgu_chrcmp(k, i, c))
+	if (BYTEWISE(k)) {
+		if (c >= 0x80 || !k->len) return false;
+
+		/* The LF of a CR LF pair doesn't start a grapheme. */
+		for (const uint8_t *p = k->s;
+		     (p = memchr(p, c, k->len - (p - k->s)));
+		     p++)
+			if (kdgu_chrbound(k, p - k->s)
+			    && (c != '\n' || p == k->s || p[-1] != '\r'))
+				return true;
+
+		return false;
+	}
+
+	/* A match has to be a whole grapheme on its own. */
+	for (kdgu_iter it = iter_begin(k, 0); iter_next(&it);)
+		if (it.c == c
+		    && grapheme_boundary(k, it.off)
+		    && grapheme_boundary(k, it.off + it.len))
 			return true;
 	return false;
 }
@@ -1449,14 +2303,14 @@ kdgu_codepoint(uint32_t c)
 	return codepoint(c);
 }
 
-const char *
-kdgu_getname(uint32_t c)
+/*
+ * Writes the name of `c' into `buf', which must hold at least
+ * KDGU_NAME_MAX bytes. Returns `buf', or NULL if `c' has no name.
+ */
+char *
+kdgu_getname(uint32_t c, char *buf)
 {
-	if (c > 0x10FFFF) return NULL;
-	for (int i = 0; i < num_names; i++)
-		if (c == names[i].c)
-			return names[i].name;
-	return NULL;
+	return lookup_name(c, buf) ? buf : NULL;
 }
 
 static kdgu *
@@ -1479,14 +2333,25 @@ fuzzify(const kdgu *k)
 uint32_t
 kdgu_getcode(const kdgu *k)
 {
-	for (int i = 0; i < num_names; i++)
-		if (kdgu_fuzzy(k, &KDGU(names[i].name)))
-			return names[i].c;
+	char key[KDGU_NAME_MAX];
+	unsigned len = 0, pos = 0;
+
+	/*
+	 * Names are ASCII, so anything else can't match; the rest is
+	 * put in the loose form the index is keyed on.
+	 */
+	while (pos < k->len) {
+		uint32_t c = kdgu_decode(k, pos);
+		if (c > 0x7F || len + 1 >= sizeof key) break;
+		if (c != '-' && c != '_' && c != ' ') key[len++] = tolower(c);
+		if (!kdgu_inc(k, &pos)) break;
+	}
 
-	for (int i = 0; i < num_name_aliases; i++)
-		for (int j = 0; j < name_aliases[i].num; j++)
-			if (kdgu_fuzzy(k, &KDGU(name_aliases[i].name[j])))
-				return name_aliases[i].c;
+	if (pos >= k->len) {
+		key[len] = 0;
+		uint32_t c = lookup_code(key);
+		if (c != UINT32_MAX) return c;
+	}
 
 	kdgu *r = fuzzify(k), *str = NULL;
 	enum category cat = 0;
@@ -1518,7 +2383,7 @@ kdgu_getcode(const kdgu *k)
 		}
 
 		if (n <= 0x10FFFF && n >= 0 && idx == r->len
-		    && codepoint(n)->category == cat)
+		    && cp_category(codepoint(n)) == cat)
 			return n;
 	}
 
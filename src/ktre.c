@@ -2,8 +2,10 @@
 #include <limits.h>
 #include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ktre.h"
+#include "kdgu_inline.h"
 
 #define SPACE  " \t\n\r\f\v"
 #define DIGIT  "0123456789"
@@ -15,6 +17,8 @@
 
 static void print_node(const ktre *re, struct node *n);
 static void error(ktre *re, enum ktre_error err, int loc, const char *fmt, ...);
+static kdgu *filter(ktre_ctx *x, const kdgu *subject,
+                    const kdgu *replacement, const kdgu *indicator);
 
 static void
 dbgf(const ktre *re, const kdgu *str, unsigned idx)
@@ -129,7 +133,10 @@ struct instr {
 			int32_t a, b;
 		};
 		uint32_t c;
-		kdgu *str;
+		struct {        /* Strings and classes. */
+			kdgu *str;
+			kdgu_set *set;
+		};
 		struct {        /* Alternation. */
 			unsigned num;
 			kdgu **list;
@@ -139,6 +146,19 @@ struct instr {
 	int loc;
 };
 
+/*
+ * An unanchored program starts with the instructions for a `.*?' of
+ * its own. The branch at PREFIX_LOOP goes on to the pattern or into
+ * the MANY at PREFIX_BODY, and the branch after that does the same
+ * again. The pattern starts at PREFIX_END.
+ */
+enum {
+	PREFIX_LOOP,
+	PREFIX_BODY,
+	PREFIX_BACK,
+	PREFIX_END
+};
+
 static void
 grow_code(ktre *re, int n)
 {
@@ -194,11 +214,28 @@ emit_str(ktre *re, int instr, kdgu *str, int loc)
 
 	re->c[re->ip].op = instr;
 	re->c[re->ip].str = str;
+	re->c[re->ip].set = NULL;
 	re->c[re->ip].loc = loc;
 
 	re->ip++;
 }
 
+/* Classes are matched against a set built from their string. */
+static void
+emit_class(ktre *re, int instr, kdgu *str, int loc)
+{
+	kdgu_set *set = kdgu_setstr(str);
+
+	if (!set) {
+		error(re, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
+		return;
+	}
+
+	emit_str(re, instr, str, loc);
+	if (re->c) re->c[re->ip - 1].set = set;
+	else kdgu_setfree(set);
+}
+
 static void
 emit_alt(ktre *re, int instr, kdgu **list, unsigned num, int loc)
 {
@@ -362,9 +399,9 @@ static struct node *parse(ktre *re);
 static struct node *term(ktre *re);
 
 static bool
-is_word(ktre *re, uint32_t c) {
+is_word(const ktre *re, uint32_t c) {
 	if (re->opt & KTRE_ECMA) return !!strchr(WORD, c);
-	enum category cat = codepoint(c)->category;
+	enum category cat = cp_category(codepoint(c));
 	return cat & CATEGORY_LL
 	    || cat & CATEGORY_LU
 	    || cat & CATEGORY_LT
@@ -375,17 +412,17 @@ is_word(ktre *re, uint32_t c) {
 }
 
 static bool
-is_digit(ktre *re, uint32_t c)
+is_digit(const ktre *re, uint32_t c)
 {
 	if (re->opt & KTRE_ECMA) return !!strchr(DIGIT, c);
-	return codepoint(c)->category & CATEGORY_ND;
+	return cp_category(codepoint(c)) & CATEGORY_ND;
 }
 
 static bool
-is_space(ktre *re, uint32_t c)
+is_space(const ktre *re, uint32_t c)
 {
 	if (re->opt & KTRE_ECMA) return !!strchr(SPACE, c);
-	enum category cat = codepoint(c)->category;
+	enum category cat = cp_category(codepoint(c));
 	return strchr(SPACE, c)
 		|| c == 0x85
 		|| cat & CATEGORY_ZL
@@ -393,6 +430,21 @@ is_space(ktre *re, uint32_t c)
 		|| cat & CATEGORY_ZS;
 }
 
+/*
+ * Whether `sp' is at the start of a line. A newline that ends the
+ * subject doesn't start another one.
+ */
+static bool
+at_bol(const kdgu *subject, int sp)
+{
+	if (!sp) return true;
+	if (sp >= (int)subject->len) return false;
+
+	unsigned idx = sp;
+	kdgu_dec_inline(subject, &idx);
+	return kdgu_chrcmp(subject, idx, '\n');
+}
+
 static inline uint32_t
 lc(uint32_t c)
 {
@@ -2246,8 +2298,8 @@ compile(ktre *re, struct node *n, bool rev)
 
 	case NODE_ALT:  emit_alt(re, INSTR_ALT, n->list, n->num, n->loc); break;
 	case NODE_STR:        emit_str(re, INSTR_STR,    n->str, n->loc); break;
-	case NODE_CLASS:      emit_str(re, INSTR_CLASS,  n->str, n->loc); break;
-	case NODE_NCLASS:     emit_str(re, INSTR_NCLASS, n->str, n->loc); break;
+	case NODE_CLASS:      emit_class(re, INSTR_CLASS,  n->str, n->loc); break;
+	case NODE_NCLASS:     emit_class(re, INSTR_NCLASS, n->str, n->loc); break;
 	case NODE_CATEGORY:   emit_c    (re, INSTR_CATEGORY, n->c,   n->loc); break;
 	case NODE_SCRIPT:     emit_c    (re, INSTR_SCRIPT,   n->c,   n->loc); break;
 	case NODE_SETOPT:     emit_c    (re, INSTR_SETOPT,   n->c,   n->loc); break;
@@ -2288,27 +2340,29 @@ print_compile_error(ktre *re)
 }
 
 static void
-print_finish(ktre *re,
+print_finish(const ktre_ctx *x,
 	     const kdgu *subject,
 	     const kdgu *regex,
 	     bool ret,
 	     int **vec,
 	     kdgu *replaced)
 {
+	const ktre *re = x->re;
+
 	if ((re->opt & KTRE_DEBUG) == 0) return;
-	if (!ret && !re->err) { DBG("\nno matches.\n"); return; }
-	if (re->err) {
+	if (!ret && !x->err) { DBG("\nno matches.\n"); return; }
+	if (x->err) {
 		DBG("\nfailed at runtime with error code %d: %s\n",
-		    re->err, re->err_str
-		    ? re->err_str
+		    x->err, x->err_str
+		    ? x->err_str
 		    : "no error message");
 		DBG("\t"), dbgf(re, regex, 0), DBG("\n\t");
-		for (int i = 0; i < re->loc; i++) DBG(" ");
+		for (int i = 0; i < x->loc; i++) DBG(" ");
 		DBG("^\n");
 		return;
 	}
 
-	for (unsigned i = 0; i < re->num_matches; i++) {
+	for (unsigned i = 0; i < x->num_matches; i++) {
 		DBG("\nmatch %d: `", i + 1);
 		kdgu *substr = kdgu_substr(subject, vec[i][0], vec[i][0] + vec[i][1]);
 		kdgu_print(substr, stderr), kdgu_free(substr);
@@ -2403,15 +2457,14 @@ optimize_node(const struct ktre *re, struct node *n)
 		if (!tmp) return n;
 		tmp->type = NODE_CLASS;
 		tmp->str = kdgu_new(re->s->fmt, NULL, 0);
+		kdgu_set *set = kdgu_setstr(n->a->str);
 
-		for (unsigned i = 0;
-		     i < n->b->str->len;
-		     kdgu_inc(n->b->str, &i)) {
-			uint32_t c = kdgu_decode(n->b->str, i);
-			if (kdgu_contains(n->a->str, c))
-				kdgu_chrappend(tmp->str, c);
-		}
+		for (kdgu_iter it = kdgu_iterbegin(n->b->str, 0);
+		     kdgu_iternext(&it);)
+			if (kdgu_sethas(set, it.c))
+				kdgu_chrappend(tmp->str, it.c);
 
+		kdgu_setfree(set);
 		free_node(n);
 		return tmp;
 	}
@@ -2470,6 +2523,315 @@ optimize_node(const struct ktre *re, struct node *n)
 	return n;
 }
 
+static bool
+needs_backtracking(int op)
+{
+	switch (op) {
+	case INSTR_BACKREF: case INSTR_CALL: case INSTR_RET:
+	case INSTR_TRY: case INSTR_CATCH:
+	case INSTR_PLA: case INSTR_PLA_WIN: case INSTR_NLA: case INSTR_NLA_FAIL:
+	case INSTR_PLB: case INSTR_PLB_WIN: case INSTR_NLB: case INSTR_NLB_FAIL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Fills in `to' with the instructions a thread at `ip' can go on to
+ * without reading anything, returning how many there are.
+ */
+static int
+next_without_reading(const ktre *re, int ip, int *to)
+{
+	const struct instr *in = &re->c[ip];
+
+	switch (in->op) {
+	case INSTR_JMP:
+		to[0] = in->c;
+		return 1;
+	case INSTR_BRANCH:
+		to[0] = in->a, to[1] = in->b;
+		return 2;
+	case INSTR_STR: case INSTR_TSTR:
+		if (kdgu_len(in->str)) return 0;
+		break;
+	case INSTR_ALT: {
+		unsigned i = 0;
+		while (i < in->num && kdgu_len(in->list[i])) i++;
+		if (i == in->num) return 0;
+	} break;
+	case INSTR_SAVE: case INSTR_SETOPT: case INSTR_SET_START:
+	case INSTR_PROG: case INSTR_BOL: case INSTR_EOL: case INSTR_BOS:
+	case INSTR_EOS: case INSTR_WB: case INSTR_NWB: case INSTR_NOT:
+		break;
+	default:
+		return 0;
+	}
+
+	to[0] = ip + 1;
+	return 1;
+}
+
+/*
+ * Gives each progress instruction that can come round to itself
+ * without reading anything a bit of its own in `re->loop'. Those are
+ * the loops whose empty iterations the progress instructions stop;
+ * the rest can't start twice at one position. Returns false if there
+ * are more than KTRE_MAX_LOOPS of them, in which case the rest are
+ * left without one.
+ */
+static bool
+find_loops(ktre *re)
+{
+	bool *seen = malloc(re->ip * sizeof *seen);
+	int *stack = malloc((re->ip * 2 + 2) * sizeof *stack);
+	re->loop = malloc((re->num_prog + 1) * sizeof *re->loop);
+	bool ok = true;
+
+	if (!seen || !stack || !re->loop) {
+		free(seen), free(stack), free(re->loop);
+		re->loop = NULL;
+		return false;
+	}
+
+	for (int p = 0; p < re->ip; p++) {
+		if (re->c[p].op != INSTR_PROG) continue;
+		re->loop[re->c[p].c] = -1;
+
+		int n = 0, to[2];
+		bool again = false;
+		memset(seen, 0, re->ip * sizeof *seen);
+
+		for (int j = next_without_reading(re, p, to); j--;)
+			stack[n++] = to[j];
+
+		while (n && !again) {
+			int ip = stack[--n];
+			if (seen[ip]) continue;
+			seen[ip] = true, again = ip == p;
+			for (int j = next_without_reading(re, ip, to); j--;)
+				if (!seen[to[j]]) stack[n++] = to[j];
+		}
+
+		if (!again) continue;
+		if (re->num_loops == KTRE_MAX_LOOPS) ok = false;
+		else re->loop[re->c[p].c] = re->num_loops++;
+	}
+
+	free(seen), free(stack);
+	return ok;
+}
+
+/* Whether the lazy DFA can follow `str' a byte at a time. */
+static bool
+plain(const kdgu *str)
+{
+	return (str->fmt == KDGU_FMT_UTF8 || str->fmt == KDGU_FMT_ASCII)
+		&& str->flags & KDGU_FLAG_ASCII
+		&& !memchr(str->s, '\r', str->len);
+}
+
+/*
+ * Whether the lazy DFA can look for matches of the program first. It
+ * keeps no options, so SETOPT is out, and it follows the strings of
+ * an ALT side by side, which only finds what the VMs do if no string
+ * starts with another.
+ */
+static bool
+dfa_can_run(const ktre *re)
+{
+	if (re->opt & KTRE_DEBUG) return false;
+
+	for (int i = 0; i < re->ip; i++) {
+		const struct instr *in = &re->c[i];
+
+		if (in->op == INSTR_SETOPT) return false;
+		if ((in->op == INSTR_STR || in->op == INSTR_TSTR) && !plain(in->str))
+			return false;
+		if (in->op != INSTR_ALT) continue;
+
+		for (unsigned j = 0; j < in->num; j++) {
+			const kdgu *a = in->list[j];
+			if (!plain(a) || !a->len) return false;
+
+			for (unsigned k = 0; k < in->num; k++) {
+				const kdgu *b = in->list[k];
+				if (j != k && b->len <= a->len
+				    && kdgu_ncmp(a, b, 0, 0, b->len,
+				                 re->opt & KTRE_INSENSITIVE, NULL))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Whether the instruction `in', which reads one character, takes `c'. */
+static bool
+reads(const ktre *re, const struct instr *in, uint32_t c, unsigned opt)
+{
+	switch (in->op) {
+	case INSTR_CLASS:
+		return kdgu_sethas(in->set, c)
+			|| (opt & KTRE_INSENSITIVE && kdgu_sethas(in->set, lc(c)));
+	case INSTR_NCLASS:
+		return !kdgu_sethas(in->set, c)
+			|| (opt & KTRE_INSENSITIVE && !kdgu_sethas(in->set, lc(c)));
+	case INSTR_ANY:      return opt & KTRE_MULTILINE || c != '\n';
+	case INSTR_MANY:     return true;
+	case INSTR_DIGIT:    return is_digit(re, c);
+	case INSTR_WORD:     return is_word(re, c);
+	case INSTR_SPACE:    return is_space(re, c);
+	case INSTR_NDIGIT:   return !is_digit(re, c);
+	case INSTR_NWORD:    return !is_word(re, c);
+	case INSTR_NSPACE:   return !is_space(re, c);
+	case INSTR_CATEGORY: return cp_category(kdgu_codepoint_inline(c)) & in->c;
+	case INSTR_SCRIPT:   return kdgu_codepoint_inline(c)->script == in->c;
+	case INSTR_RANGE:
+		return c >= (uint32_t)in->a && c <= (uint32_t)in->b;
+	default:
+		return false;
+	}
+}
+
+static void
+add_first(ktre *re, uint8_t c)
+{
+	re->first[c / 64] |= (uint64_t)1 << c % 64;
+}
+
+/*
+ * Adds the first bytes of the string `str' can start with. Insensitive
+ * matching folds characters outside of ASCII onto ones inside it and
+ * the other way around, so it only knows about ASCII letters.
+ */
+static bool
+add_first_str(ktre *re, const kdgu *str, bool insensitive)
+{
+	if (str->fmt != KDGU_FMT_UTF8 && str->fmt != KDGU_FMT_ASCII)
+		return false;
+
+	uint8_t c = str->s[0];
+	if (insensitive && c >= 0x80) return false;
+
+	add_first(re, c);
+	if (!insensitive) return true;
+
+	add_first(re, tolower(c)), add_first(re, toupper(c));
+	for (unsigned b = 0x80; b < 0x100; b++) add_first(re, b);
+
+	return true;
+}
+
+/*
+ * Works out which bytes an unanchored match can start with, by
+ * following the program from just after the `.*?' to every
+ * instruction that reads the first character. If that's a single
+ * string, every match starts with the string. A program that can
+ * match without reading anything has no first bytes.
+ */
+static void
+find_first(ktre *re)
+{
+	if (!(re->opt & KTRE_UNANCHORED) || re->opt & KTRE_DEBUG) return;
+
+	bool *seen = calloc(re->ip, sizeof *seen);
+	int *stack = malloc(re->ip * sizeof *stack), sp = 0;
+	unsigned opt = re->opt;
+
+	if (!seen || !stack) {
+		free(seen), free(stack);
+		return;
+	}
+
+	/* Options set partway through could be in effect anywhere. */
+	for (int i = 0; i < re->ip; i++)
+		if (re->c[i].op == INSTR_SETOPT)
+			opt |= KTRE_INSENSITIVE | KTRE_MULTILINE;
+
+	bool insensitive = opt & KTRE_INSENSITIVE, all = false;
+	const struct instr *only = NULL;
+	unsigned num_readers = 0;
+
+	seen[PREFIX_END] = true, stack[sp++] = PREFIX_END;
+
+#define FOLLOW(IP)						\
+	do {							\
+		int ip_ = (IP);					\
+		if (!seen[ip_]) seen[ip_] = true, stack[sp++] = ip_;	\
+	} while (0)
+
+	while (sp && !all) {
+		int ip = stack[--sp];
+		const struct instr *in = &re->c[ip];
+
+		switch (in->op) {
+		case INSTR_JMP: FOLLOW(in->c); break;
+		case INSTR_BRANCH:
+			FOLLOW(in->a);
+			FOLLOW(in->b);
+			break;
+		case INSTR_SAVE: case INSTR_SETOPT: case INSTR_SET_START:
+		case INSTR_PROG: case INSTR_BOL: case INSTR_BOS: case INSTR_WB:
+		case INSTR_NWB: case INSTR_TRY: case INSTR_CATCH:
+			FOLLOW(ip + 1);
+			break;
+		case INSTR_STR: case INSTR_TSTR:
+			if (!in->str->len) {
+				FOLLOW(ip + 1);
+				break;
+			}
+
+			if (!add_first_str(re, in->str, insensitive)) all = true;
+			only = in, num_readers++;
+			break;
+		case INSTR_ALT:
+			for (unsigned j = 0; j < in->num; j++) {
+				if (!in->list[j]->len) FOLLOW(ip + 1);
+				else if (!add_first_str(re, in->list[j], insensitive))
+					all = true;
+			}
+
+			num_readers++;
+			break;
+		case INSTR_CLASS: case INSTR_NCLASS: case INSTR_ANY:
+		case INSTR_MANY: case INSTR_DIGIT: case INSTR_WORD:
+		case INSTR_SPACE: case INSTR_NDIGIT: case INSTR_NWORD:
+		case INSTR_NSPACE: case INSTR_CATEGORY: case INSTR_SCRIPT:
+		case INSTR_RANGE:
+			for (unsigned b = 0; b < 0x80; b++)
+				if (reads(re, in, b, opt)) add_first(re, b);
+
+			/* A class of ASCII characters can't start with more. */
+			if (in->op != INSTR_CLASS || insensitive || !in->set->len
+			    || in->set->r[in->set->len - 1] > 0x80)
+				for (unsigned b = 0x80; b < 0x100; b++)
+					add_first(re, b);
+
+			num_readers++;
+			break;
+		default:
+			/* Including MATCH, EOL and EOS, which read nothing. */
+			all = true;
+		}
+	}
+
+#undef FOLLOW
+
+	free(seen), free(stack);
+
+	if (all || (re->first[0] & re->first[1] & re->first[2] & re->first[3])
+	    == UINT64_MAX) {
+		memset(re->first, 0, sizeof re->first);
+		return;
+	}
+
+	re->skip = true;
+	if (num_readers == 1 && only && !insensitive) re->prefix = only->str;
+}
+
 ktre *
 ktre_compile(const kdgu *pat, int opt)
 {
@@ -2480,7 +2842,6 @@ ktre_compile(const kdgu *pat, int opt)
 	if (opt & KTRE_GLOBAL) opt |= KTRE_UNANCHORED;
 
 	re->err_str = "no error";
-	re->max_tp  = -1;
 	re->popt    = opt;
 	re->opt     = opt;
 	re->s       = pat;
@@ -2500,6 +2861,7 @@ ktre_compile(const kdgu *pat, int opt)
 			case KTRE_CONTINUE   : DBG("\n\tCONTINUE");    break;
 			case KTRE_DEBUG      : DBG("\n\tDEBUG");       break;
 			case KTRE_ECMA       : DBG("\n\tECMA");        break;
+			case KTRE_LINEAR     : DBG("\n\tLINEAR");      break;
 			}
 		}
 		DBG("\n");
@@ -2569,9 +2931,11 @@ ktre_compile(const kdgu *pat, int opt)
 		 * the unanchored matching right into the bytecode by
 		 * manually emitting the instructions for `.*?`.
 		 */
-		emit_ab(re, INSTR_BRANCH, 3, 1, 0);
+		emit_ab(re, INSTR_BRANCH, PREFIX_END, PREFIX_BODY, 0);
 		emit(re, INSTR_MANY, 0);
-		emit_ab(re, INSTR_BRANCH, 3, 1, 0);
+		emit_ab(re, INSTR_BRANCH, PREFIX_END, PREFIX_BODY, 0);
+		assert(!re->c || (re->ip == PREFIX_END
+		                  && re->c[PREFIX_BODY].op == INSTR_MANY));
 	}
 
 	compile(re, re->n, false);
@@ -2588,23 +2952,96 @@ ktre_compile(const kdgu *pat, int opt)
 		}
 	}
 
+	/*
+	 * Anything that resumes a saved thread or needs a call stack
+	 * keeps the program on the backtracking VM. So do more loops
+	 * that can go round reading nothing than the breadth-first VM
+	 * keeps track of, unless /l asks otherwise, since it only stops
+	 * the empty iterations the backtracker does for the ones it has
+	 * a bit for.
+	 */
+	bool linear = true;
+	for (int i = 0; i < re->ip; i++)
+		if (needs_backtracking(re->c[i].op)) linear = false;
+
+	bool loops = find_loops(re);
+	re->pike = linear && re->loop && (loops || (opt & KTRE_LINEAR));
+	re->dfa = linear && dfa_can_run(re);
+	find_first(re);
+
+	if ((opt & KTRE_LINEAR) && !linear) {
+		error(re, KTRE_ERROR_INVALID_OPTIONS, 0,
+		      "invalid option configuration: /l needs a pattern without backtracking");
+
+		print_compile_error(re);
+		return re;
+	}
+
+	/*
+	 * Matching only reads the program, so the strings in it get
+	 * their grapheme indexes now instead of the first time they're
+	 * compared.
+	 */
+	for (int i = 0; i < re->ip; i++) {
+		if (re->c[i].op == INSTR_STR || re->c[i].op == INSTR_TSTR)
+			kdgu_len(re->c[i].str);
+		else if (re->c[i].op == INSTR_ALT)
+			for (unsigned j = 0; j < re->c[i].num; j++)
+				kdgu_len(re->c[i].list[j]);
+	}
+
 	if (opt & KTRE_DEBUG) print_instructions(re);
 
 	return re;
 }
 
+/*
+ * Returns a regex that shares the compiled program of `re' but has a
+ * context of its own. It has to be freed before `re' is.
+ */
 ktre *
 ktre_copy(ktre *re)
 {
 	ktre *ret = malloc(sizeof *ret);
-	memset(ret, 0, sizeof *ret);
-	ret->c = re->c;
-	re->copied = true;
+	if (!ret) return NULL;
+
+	memcpy(ret, re, sizeof *ret);
+	ret->num_matches = 0;
+	ret->err_str = NULL;
+	ret->ctx = NULL;
+	ret->copied = true;
+
 	return ret;
 }
 
-#define TP (re->tp)
-#define THREAD (re->t)
+ktre_ctx *
+ktre_ctx_new(const ktre *re)
+{
+	if (!re || !re->c) return NULL;
+
+	ktre_ctx *x = malloc(sizeof *x);
+	if (!x) return NULL;
+
+	memset(x, 0, sizeof *x);
+	x->re = re;
+	x->max_tp = -1;
+
+	return x;
+}
+
+static void
+runtime_error(ktre_ctx *x, enum ktre_error err, int loc, const char *msg)
+{
+	if (x->err) return;
+
+	x->err = err;
+	x->loc = loc;
+	x->err_str = malloc(KTRE_MAX_ERROR_LEN);
+	if (x->err_str) snprintf(x->err_str, KTRE_MAX_ERROR_LEN, "%s", msg);
+}
+
+#define TP (x->tp)
+#define THREAD (x->t)
 
 #define MAKE_THREAD_VARIABLE(f,p)					\
 	do {								\
@@ -2643,7 +3080,7 @@ ktre_copy(ktre *re)
 	} while (0)
 
 static void
-new_thread(ktre *re,
+new_thread(ktre_ctx *x,
 	   int sp,
 	   unsigned ip,
 	   unsigned opt,
@@ -2653,23 +3090,23 @@ new_thread(ktre *re,
 {
 	++TP;
 
-	if (TP >= re->thread_alloc) {
-		if (re->thread_alloc * 2 >= KTRE_MAX_THREAD) {
-			re->thread_alloc = KTRE_MAX_THREAD;
+	if (TP >= x->thread_alloc) {
+		if (x->thread_alloc * 2 >= KTRE_MAX_THREAD) {
+			x->thread_alloc = KTRE_MAX_THREAD;
 
 			/*
 			 * Account for the case where we're just about
 			 * to bump up against the thread limit.
 			 */
 			TP = (TP >= KTRE_MAX_THREAD) ? KTRE_MAX_THREAD - 1 : TP;
-		} else re->thread_alloc *= 2;
+		} else x->thread_alloc *= 2;
 
-		re->t = realloc(re->t, re->thread_alloc * sizeof *THREAD);
-		memset(&THREAD[TP], 0, (re->thread_alloc - TP) * sizeof *THREAD);
+		x->t = realloc(x->t, x->thread_alloc * sizeof *THREAD);
+		memset(&THREAD[TP], 0, (x->thread_alloc - TP) * sizeof *THREAD);
 	}
 
-	MAKE_STATIC_THREAD_VARIABLE(vec, re->num_groups * 2);
-	MAKE_STATIC_THREAD_VARIABLE(prog, re->num_prog);
+	MAKE_STATIC_THREAD_VARIABLE(vec, x->re->num_groups * 2);
+	MAKE_STATIC_THREAD_VARIABLE(prog, x->re->num_prog);
 	MAKE_THREAD_VARIABLE(frame, fp);
 	MAKE_THREAD_VARIABLE(las, la);
 	MAKE_THREAD_VARIABLE(exception, ep);
@@ -2679,15 +3116,92 @@ new_thread(ktre *re,
 	THREAD[TP].opt = opt;
 	if (TP - 1 > 0) THREAD[TP].rev = THREAD[TP - 1].rev;
 
-	re->max_tp = (TP > re->max_tp) ? TP : re->max_tp;
+	x->max_tp = (TP > x->max_tp) ? TP : x->max_tp;
+}
+
+/*
+ * Whether a match ending at `sp' can be taken. One that ends where an
+ * earlier one started would find the same text again.
+ */
+static bool
+is_new_match(const ktre_ctx *x, const kdgu *subject, int sp, unsigned opt)
+{
+	for (unsigned i = 0; i < x->num_matches; i++)
+		if (x->vec[i][0] == sp)
+			return false;
+
+	return (opt & KTRE_UNANCHORED) || sp == (int)subject->len;
+}
+
+/* Adds the groups `v' of a match that ends at `sp' to the results. */
+static bool
+add_match(ktre_ctx *x, const int *v, int sp, unsigned loc)
+{
+	size_t size = x->re->num_groups * 2 * sizeof **x->vec;
+	int **vec = realloc(x->vec, (x->num_matches + 1) * sizeof *vec);
+	x->cont = sp;
+
+	if (!vec) {
+		runtime_error(x, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
+		return false;
+	}
+
+	x->vec = vec;
+	x->vec[x->num_matches] = malloc(size);
+
+	if (!x->vec[x->num_matches]) {
+		runtime_error(x, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
+		return false;
+	}
+
+	memcpy(x->vec[x->num_matches++], v, size);
+	return true;
+}
+
+/*
+ * Returns the first place from `sp' where a match of `re' could
+ * start, or -1 if there isn't one.
+ */
+static int
+skip(const ktre *re, const kdgu *subject, int sp)
+{
+	if (subject->fmt != KDGU_FMT_UTF8 && subject->fmt != KDGU_FMT_ASCII)
+		return sp;
+
+	const uint8_t *s = subject->s, *p;
+	unsigned len = subject->len, i = sp;
+	if (i >= len) return -1;
+
+	if (re->prefix) {
+		p = memmem(s + sp, len - sp, re->prefix->s, re->prefix->len);
+	} else {
+		while (i < len && !(re->first[s[i] / 64] >> s[i] % 64 & 1))
+			i++;
+		p = i < len ? s + i : NULL;
+	}
+
+	if (!p) return -1;
+
+	/*
+	 * The VM has to start on a grapheme boundary. There's always one
+	 * between two ASCII characters unless the first is a CR, so it
+	 * starts at the last one of those.
+	 */
+	for (i = p - s; i > (unsigned)sp; i--)
+		if (s[i] < 0x80 && s[i - 1] < 0x80 && s[i - 1] != '\r')
+			break;
+
+	return i;
 }
 
+static int start(ktre_ctx *x, const kdgu *subject, int sp, int ***vec);
+
 #define FAIL do { --TP; return true; } while (0)
 #define PREV (kdgu_prev(subject, &THREAD[TP].sp) || --THREAD[TP].sp)
-#define NEXT (kdgu_next(subject, &THREAD[TP].sp) || ++THREAD[TP].sp)
+#define NEXT (kdgu_next_inline(subject, &THREAD[TP].sp) || ++THREAD[TP].sp)
 
 static inline bool
-execute_instr(ktre *re,
+execute_instr(ktre_ctx *x,
 	      unsigned ip,
 	      int sp,
 	      unsigned fp,
@@ -2700,6 +3214,8 @@ execute_instr(ktre *re,
 	      const kdgu *subject,
 	      int ***vec)
 {
+	const ktre *re = x->re;
+
 	if (re->opt & KTRE_DEBUG) {
 		DBG("\n| %4d | %4d | %4d | %4d | %4d | ", ip, sp, TP, fp, num_steps);
 		dbgf(re, subject, sp >= 0 ? sp : 0);
@@ -2711,7 +3227,7 @@ execute_instr(ktre *re,
 	}
 
 	if (sp > (int)subject->len || sp <= -2) FAIL;
-	uint32_t c = kdgu_decode(subject, sp);
+	uint32_t c = kdgu_decode_inline(subject, sp);
 
 	switch (re->c[ip].op) {
 	case INSTR_JMP: THREAD[TP].ip = re->c[ip].c; break;
@@ -2731,19 +3247,19 @@ execute_instr(ktre *re,
 		break;
 	case INSTR_CLASS:
 		THREAD[TP].ip++;
-		if (kdgu_contains(re->c[ip].str, c))
+		if (kdgu_sethas(re->c[ip].set, c))
 			rev ? PREV : NEXT;
 		else if (opt & KTRE_INSENSITIVE
-			 && kdgu_contains(re->c[ip].str, lc(c)))
+			 && kdgu_sethas(re->c[ip].set, lc(c)))
 			rev ? PREV : NEXT;
 		else FAIL;
 		break;
 	case INSTR_NCLASS:
 		THREAD[TP].ip++;
-		if (!kdgu_contains(re->c[ip].str, c))
+		if (!kdgu_sethas(re->c[ip].set, c))
 			rev ? PREV : NEXT;
 		else if (opt & KTRE_INSENSITIVE
-			 && !kdgu_contains(re->c[ip].str, lc(c)))
+			 && !kdgu_sethas(re->c[ip].set, lc(c)))
 			rev ? PREV : NEXT;
 		else FAIL;
 		break;
@@ -2785,14 +3301,12 @@ execute_instr(ktre *re,
 	case INSTR_NOT:
 		THREAD[TP].ip++;
 		if (kdgu_contains(re->c[ip].str, c)) FAIL;
-		kdgu_next(subject, &THREAD[TP].sp);
+		kdgu_next_inline(subject, &THREAD[TP].sp);
 		break;
-	case INSTR_BOL: {
-		unsigned idx = sp;
-		kdgu_dec(subject, &idx);
-		if (!(sp > 0 && kdgu_chrcmp(subject, idx, '\n')) && sp != 0) FAIL;
+	case INSTR_BOL:
+		if (!at_bol(subject, sp)) FAIL;
 		THREAD[TP].ip++;
-	} break;
+		break;
 	case INSTR_EOL:
 		if (!kdgu_chrcmp(subject, sp, '\n') && sp != (int)subject->len)
 			FAIL;
@@ -2812,14 +3326,14 @@ execute_instr(ktre *re,
 		THREAD[TP].ip++;
 		if (sp == 0 && is_word(re, c))
 			return true;
-		if (is_word(re, c) != is_word(re, kdgu_decode(subject, sp - 1)))
+		if (is_word(re, c) != is_word(re, kdgu_decode_inline(subject, sp - 1)))
 			return true;
 		FAIL;
 		break;
 	case INSTR_NWB:
 		THREAD[TP].ip++;
 		if (sp == 0 && !is_word(re, c)) return true;
-		if (is_word(re, c) == is_word(re, kdgu_decode(subject, sp - 1)))
+		if (is_word(re, c) == is_word(re, kdgu_decode_inline(subject, sp - 1)))
 			return true;
 		FAIL;
 		break;
@@ -2831,49 +3345,29 @@ execute_instr(ktre *re,
 	case INSTR_MANY:
 		THREAD[TP].ip++;
 		rev ? PREV : NEXT;
+
+		/* The `.*?' of an unanchored program goes straight there. */
+		if (ip == PREFIX_BODY && re->skip) {
+			if ((sp = skip(re, subject, THREAD[TP].sp)) < 0) FAIL;
+			THREAD[TP].sp = sp;
+		}
 		break;
 	case INSTR_BRANCH:
 		THREAD[TP].ip = re->c[ip].b;
-		new_thread(re, sp, re->c[ip].a, opt, fp, la, ep);
+		new_thread(x, sp, re->c[ip].a, opt, fp, la, ep);
 		break;
-	case INSTR_MATCH: {
-		unsigned n = 0;
-
-		for (unsigned i = 0; i < re->num_matches; i++)
-			if (re->vec[i][0] == sp)
-				n++;
-
-		if (n) FAIL;
-		if ((opt & KTRE_UNANCHORED) == 0 && !(sp >= 0 && sp == (int)subject->len))
-			FAIL;
-
-		re->vec = realloc(re->vec, (re->num_matches + 1) * sizeof *re->vec);
-		re->cont = sp;
-
-		if (!re->vec) {
-			error(re, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
-			return false;
-		}
-
-		re->vec[re->num_matches] = malloc(re->num_groups * 2 * sizeof *re->vec);
-		if (!re->vec[re->num_matches]) {
-			error(re, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
-			return false;
-		}
-
-		memcpy(re->vec[re->num_matches++],
-		       THREAD[TP].vec,
-		       re->num_groups * 2 * sizeof **re->vec);
-
-		if (vec) *vec = re->vec;
+	case INSTR_MATCH:
+		if (!is_new_match(x, subject, sp, opt)) FAIL;
+		if (!add_match(x, THREAD[TP].vec, sp, loc)) return false;
+		if (vec) *vec = x->vec;
 		if (!(opt & KTRE_GLOBAL)) return false;
+		if (sp > (int)subject->len || (sp = start(x, subject, sp, vec)) < 0)
+			return false;
 
 		TP = 0;
 		THREAD[TP].ip = 0;
 		THREAD[TP].sp = sp;
-
-		if (THREAD[TP].sp > subject->len) return false;
-	} break;
+		break;
 	case INSTR_SAVE:
 		THREAD[TP].ip++;
 		THREAD[TP].vec[re->c[ip].c] = re->c[ip].c % 2 == 0
@@ -2944,7 +3438,7 @@ execute_instr(ktre *re,
 		break;
 	case INSTR_PLB:
 		THREAD[TP].die = true;
-		new_thread(re, sp - 1, ip + 1, opt, fp, la, ep + 1);
+		new_thread(x, sp - 1, ip + 1, opt, fp, la, ep + 1);
 		THREAD[TP].exception[ep] = TP - 1;
 		THREAD[TP].rev = true;
 		break;
@@ -2956,7 +3450,7 @@ execute_instr(ktre *re,
 		break;
 	case INSTR_NLB:
 		THREAD[TP].ip = re->c[ip].c;
-		new_thread(re, sp - 1, ip + 1, opt, fp, la, ep + 1);
+		new_thread(x, sp - 1, ip + 1, opt, fp, la, ep + 1);
 		THREAD[TP].exception[ep] = TP - 1;
 		THREAD[TP].rev = true;
 		break;
@@ -2965,7 +3459,7 @@ execute_instr(ktre *re,
 		break;
 	case INSTR_PLA:
 		THREAD[TP].die = true;
-		new_thread(re, sp, ip + 1, opt, fp, la, ep + 1);
+		new_thread(x, sp, ip + 1, opt, fp, la, ep + 1);
 		THREAD[TP].exception[ep] = TP - 1;
 		break;
 	case INSTR_PLA_WIN:
@@ -2975,7 +3469,7 @@ execute_instr(ktre *re,
 		break;
 	case INSTR_NLA:
 		THREAD[TP].ip = re->c[ip].a;
-		new_thread(re, sp, ip + 1, opt, fp, la, ep + 1);
+		new_thread(x, sp, ip + 1, opt, fp, la, ep + 1);
 		THREAD[TP].exception[ep] = TP - 1;
 		break;
 	case INSTR_NLA_FAIL:
@@ -2983,22 +3477,22 @@ execute_instr(ktre *re,
 		break;
 	case INSTR_CATEGORY:
 		THREAD[TP].ip++;
-		rev ? kdgu_dec(subject, &THREAD[TP].sp) || --THREAD[TP].sp
-		    : kdgu_inc(subject, &THREAD[TP].sp) || ++THREAD[TP].sp;
-		if (codepoint(c)->category & re->c[ip].c) return true;
+		rev ? kdgu_dec_inline(subject, &THREAD[TP].sp) || --THREAD[TP].sp
+		    : kdgu_inc_inline(subject, &THREAD[TP].sp) || ++THREAD[TP].sp;
+		if (cp_category(kdgu_codepoint_inline(c)) & re->c[ip].c) return true;
 		FAIL;
 		break;
 	case INSTR_SCRIPT:
 		THREAD[TP].ip++;
-		rev ? kdgu_dec(subject, &THREAD[TP].sp) || --THREAD[TP].sp
-		    : kdgu_inc(subject, &THREAD[TP].sp) || ++THREAD[TP].sp;
-		if (codepoint(c)->script == re->c[ip].c) return true;
+		rev ? kdgu_dec_inline(subject, &THREAD[TP].sp) || --THREAD[TP].sp
+		    : kdgu_inc_inline(subject, &THREAD[TP].sp) || ++THREAD[TP].sp;
+		if (kdgu_codepoint_inline(c)->script == re->c[ip].c) return true;
 		FAIL;
 		break;
 	case INSTR_RANGE:
 		THREAD[TP].ip++;
-		rev ? kdgu_dec(subject, &THREAD[TP].sp) || --THREAD[TP].sp
-		    : kdgu_inc(subject, &THREAD[TP].sp) || ++THREAD[TP].sp;
+		rev ? kdgu_dec_inline(subject, &THREAD[TP].sp) || --THREAD[TP].sp
+		    : kdgu_inc_inline(subject, &THREAD[TP].sp) || ++THREAD[TP].sp;
 		if (c >= (uint32_t)re->c[ip].a
 		    && c <= (uint32_t)re->c[ip].b)
 			return true;
@@ -3010,94 +3504,928 @@ execute_instr(ktre *re,
 	}
 
 	if (TP >= KTRE_MAX_THREAD - 1) {
-		error(re, KTRE_ERROR_STACK_OVERFLOW, loc, "regex exceeded the maximum number of executable threads");
+		runtime_error(x, KTRE_ERROR_STACK_OVERFLOW, loc, "regex exceeded the maximum number of executable threads");
 		return false;
 	}
 
 	if (fp >= KTRE_MAX_CALL_DEPTH - 1) {
-		error(re, KTRE_ERROR_CALL_OVERFLOW, loc, "regex exceeded the maximum depth for subroutine calls");
+		runtime_error(x, KTRE_ERROR_CALL_OVERFLOW, loc, "regex exceeded the maximum depth for subroutine calls");
 		return false;
 	}
 
 	return true;
 }
 
-static bool
-run(ktre *re, const kdgu *subject, int ***vec)
+static void
+free_matches(ktre_ctx *x)
 {
-	*vec = NULL;
-	re->num_matches = 0;
-	TP = -1;
+	for (unsigned i = 0; i < x->num_matches; i++)
+		free(x->vec[i]);
 
-	if (!re->thread_alloc) {
-		re->thread_alloc = 25;
-		re->t = malloc(re->thread_alloc * sizeof *THREAD);
-		if (re->err) return false;
-		memset(re->t, 0, re->thread_alloc * sizeof *THREAD);
-	}
+	x->num_matches = 0;
+}
 
-	if (re->opt & KTRE_CONTINUE && re->cont >= (int)subject->len)
-		return false;
+/*
+ * The lazy DFA works out whether a program can match at all, without
+ * keeping any groups. Its states are sets of positions in the program,
+ * where every character of a string is a position of its own, and
+ * they're built the first time a character leads to them. Before
+ * either VM runs, the DFA reads the subject up to the end of the first
+ * match. If there isn't one, the VM never has to run. If there is,
+ * the VM can start at the last place where no thread from earlier on
+ * was still alive, since the match can't start before that.
+ *
+ * The DFA only steps over graphemes that are a single code point, in
+ * UTF-8 or ASCII subjects. Everywhere else it leaves the rest to the
+ * VM.
+ */
+
+enum {
+	DFA_START = 1 << 0, /* At the start of the subject. */
+	DFA_BOL   = 1 << 1, /* At the start of a line.      */
+	DFA_WORD  = 1 << 2  /* Just after a word character. */
+};
 
-	/* Push the initial thread. */
-	new_thread(re, re->opt & KTRE_CONTINUE ? re->cont : 0, 0, re->opt, 0, 0, 0);
+/* A transition that hasn't been made yet, and one the DFA can't make. */
+#define DFA_UNKNOWN -1
+#define DFA_GIVE_UP -2
 
-	unsigned num_steps = 0;
-	DBG("\n|   ip |   sp |   tp |   fp | step |");
+struct dfa {
+	/* Where each position is: an instruction and a string offset. */
+	struct dfa_pos {
+		int ip, alt, k;
+	} *pos;
+	int *first; /* The first position of each instruction. */
+	unsigned num_pos;
 
-	while (TP >= 0
-	       && execute_instr(re,
-				THREAD[TP].ip,
-				THREAD[TP].sp,
-				THREAD[TP].fp,
-				THREAD[TP].la,
-				THREAD[TP].ep,
-				THREAD[TP].opt,
-				re->c[THREAD[TP].ip].loc,
-				THREAD[TP].rev,
-				num_steps++,
-				subject,
-				vec));
+	/*
+	 * A transition is the next state shifted left one bit, with the
+	 * low bit set if a match ends before the character is read.
+	 */
+	struct dfa_state {
+		unsigned hash, flags, n, set;
+		bool idle;
+		int next[128], end;
+	} *s;
+	unsigned n, alloc, flushes;
+	int table[2 * KTRE_DFA_STATES];
+
+	unsigned *sets, num_sets, sets_alloc;
+	unsigned *mark, *seen, stamp;
+	unsigned *stack, *out;
+};
 
-	return !!re->num_matches;
+/* dfa_state() finds a state's slot in `table' by masking its hash. */
+_Static_assert((2 * KTRE_DFA_STATES & (2 * KTRE_DFA_STATES - 1)) == 0,
+               "KTRE_DFA_STATES has to be a power of two");
+
+static void
+dfa_free(struct dfa *d)
+{
+	if (!d) return;
+
+	free(d->pos), free(d->first), free(d->s), free(d->sets);
+	free(d->mark), free(d->seen), free(d->stack), free(d->out);
+	free(d);
 }
 
-void
-ktre_free(ktre *re)
+static struct dfa *
+dfa_new(const ktre *re)
 {
-	if (re->copied) return;
-	free_node(re->n);
-	if (re->err) free(re->err_str);
+	struct dfa *d = calloc(1, sizeof *d);
+	if (!d) return NULL;
 
-	if (re->c) {
-		for (int i = 0; i < re->ip; i++)
-			if (re->c[i].op == INSTR_TSTR)
-				kdgu_free(re->c[i].str);
+	for (int i = 0; i < re->ip; i++) {
+		const struct instr *in = &re->c[i];
 
-		free(re->c);
+		if ((in->op == INSTR_STR || in->op == INSTR_TSTR) && in->str->len)
+			d->num_pos += in->str->len - 1;
+		else if (in->op == INSTR_ALT)
+			for (unsigned j = 0; j < in->num; j++)
+				d->num_pos += in->list[j]->len;
+
+		d->num_pos++;
 	}
 
-	for (int i = 0; i <= re->max_tp; i++) {
-		free(THREAD[i].vec);
+	unsigned n = d->num_pos;
+	d->pos   = malloc(n * sizeof *d->pos);
+	d->first = malloc((re->ip + 1) * sizeof *d->first);
+	d->mark  = calloc(n, sizeof *d->mark);
+	d->seen  = calloc(n, sizeof *d->seen);
+	d->stack = malloc(n * sizeof *d->stack);
+	d->out   = malloc(n * sizeof *d->out);
+
+	if (!d->pos || !d->first || !d->mark || !d->seen || !d->stack || !d->out)
+		return dfa_free(d), NULL;
+
+	n = 0;
+
+	for (int i = 0; i < re->ip; i++) {
+		const struct instr *in = &re->c[i];
+		d->first[i] = n;
+		d->pos[n++] = (struct dfa_pos){ i, -1, 0 };
+
+		/* A string's first position is its first character. */
+		if ((in->op == INSTR_STR || in->op == INSTR_TSTR) && in->str->len)
+			for (unsigned k = 1; k < in->str->len; k++)
+				d->pos[n++] = (struct dfa_pos){ i, -1, k };
+
+		if (in->op != INSTR_ALT) continue;
+
+		for (unsigned j = 0; j < in->num; j++)
+			for (unsigned k = 0; k < in->list[j]->len; k++)
+				d->pos[n++] = (struct dfa_pos){ i, j, k };
+	}
+
+	d->first[re->ip] = 0;
+
+	return d;
+}
+
+static void
+dfa_flush(struct dfa *d)
+{
+	memset(d->table, 0, sizeof d->table);
+	d->n = d->num_sets = 0;
+	d->flushes++;
+}
+
+static int
+cmp_pos(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Returns the state for the `n' positions in `set' in the context
+ * `flags', adding it if it's new. When the cache is full it's emptied
+ * first, which `d->flushes' counts.
+ */
+static int
+dfa_state(const ktre *re, struct dfa *d, unsigned *set, unsigned n,
+          unsigned flags)
+{
+	qsort(set, n, sizeof *set, cmp_pos);
+
+	uint64_t h = 0xcbf29ce484222325 ^ flags;
+	for (unsigned i = 0; i < n; i++)
+		h = (h ^ set[i]) * 0x100000001b3;
+
+	unsigned mask = sizeof d->table / sizeof *d->table - 1, i = h & mask;
+
+	for (; d->table[i]; i = (i + 1) & mask) {
+		struct dfa_state *st = &d->s[d->table[i] - 1];
+		if (st->hash == (unsigned)h && st->flags == flags && st->n == n
+		    && !memcmp(d->sets + st->set, set, n * sizeof *set))
+			return d->table[i] - 1;
+	}
+
+	if (d->n == KTRE_DFA_STATES) {
+		dfa_flush(d);
+		i = h & mask;
+	}
+
+	if (d->n == d->alloc) {
+		unsigned a = d->alloc ? d->alloc * 2 : 16;
+		struct dfa_state *s = realloc(d->s, a * sizeof *s);
+		if (!s) return DFA_GIVE_UP;
+		d->s = s, d->alloc = a;
+	}
+
+	if (d->num_sets + n > d->sets_alloc) {
+		unsigned a = d->sets_alloc ? d->sets_alloc * 2 : 64;
+		while (a < d->num_sets + n) a *= 2;
+		unsigned *s = realloc(d->sets, a * sizeof *s);
+		if (!s) return DFA_GIVE_UP;
+		d->sets = s, d->sets_alloc = a;
+	}
+
+	struct dfa_state *st = &d->s[d->n];
+	st->hash = h, st->flags = flags, st->n = n, st->set = d->num_sets;
+	st->end = DFA_UNKNOWN;
+	for (int c = 0; c < 128; c++) st->next[c] = DFA_UNKNOWN;
+
+	/* Only the `.*?' that unanchored programs start with is alive. */
+	st->idle = re->opt & KTRE_UNANCHORED;
+	for (unsigned j = 0; j < n; j++)
+		if (d->pos[set[j]].ip >= PREFIX_END) st->idle = false;
+
+	memcpy(d->sets + d->num_sets, set, n * sizeof *set);
+	d->num_sets += n;
+	d->table[i] = ++d->n;
+
+	return d->n - 1;
+}
+
+/* Whether the string character `a' is the subject character `c'. */
+static bool
+same_char(uint8_t a, uint32_t c, bool insensitive)
+{
+	return a == c || (insensitive && c < 0x80 && tolower(a) == tolower(c));
+}
+
+/*
+ * Makes the transition of the state `s' on `c', or on the end of the
+ * subject if `end' is set, to a state in the context `flags'.
+ */
+static int
+dfa_make(const ktre *re, struct dfa *d, int s, uint32_t c, bool end,
+         unsigned flags)
+{
+	bool insensitive = re->opt & KTRE_INSENSITIVE, matched = false;
+	bool word = is_word(re, c);
+	unsigned sp = 0, n = 0, from = d->s[s].flags;
+
+	if (!++d->stamp) {
+		memset(d->mark, 0, d->num_pos * sizeof *d->mark);
+		memset(d->seen, 0, d->num_pos * sizeof *d->seen);
+		d->stamp = 1;
+	}
+
+#define PUSH(P)								\
+	do {								\
+		unsigned p_ = (P);					\
+		if (d->mark[p_] != d->stamp)				\
+			d->mark[p_] = d->stamp, d->stack[sp++] = p_;	\
+	} while (0)
+
+#define TAKE(P)								\
+	do {								\
+		unsigned p_ = (P);					\
+		if (d->seen[p_] != d->stamp)				\
+			d->seen[p_] = d->stamp, d->out[n++] = p_;	\
+	} while (0)
+
+	for (unsigned i = 0; i < d->s[s].n; i++)
+		PUSH(d->sets[d->s[s].set + i]);
+
+	while (sp) {
+		unsigned p = d->stack[--sp];
+		const struct dfa_pos *ps = &d->pos[p];
+		const struct instr *in = &re->c[ps->ip];
+		unsigned next = d->first[ps->ip + 1];
+
+		switch (in->op) {
+		case INSTR_JMP: PUSH(d->first[in->c]); break;
+		case INSTR_BRANCH:
+			PUSH(d->first[in->a]);
+			PUSH(d->first[in->b]);
+			break;
+		case INSTR_SAVE: case INSTR_SET_START: case INSTR_PROG:
+			PUSH(next);
+			break;
+		case INSTR_MATCH:
+			if (re->opt & KTRE_UNANCHORED || end) matched = true;
+			break;
+		case INSTR_BOS: if (from & DFA_START) PUSH(next); break;
+		case INSTR_BOL:
+			/* Nothing but an empty subject has a line at its end. */
+			if (from & DFA_BOL && (!end || from & DFA_START))
+				PUSH(next);
+			break;
+		case INSTR_EOS: if (end) PUSH(next);              break;
+		case INSTR_EOL:
+			if (end) PUSH(next);
+			else if (c == '\n') TAKE(next);
+			break;
+		case INSTR_WB:
+			if ((from & DFA_START && word) || word != !!(from & DFA_WORD))
+				PUSH(next);
+			break;
+		case INSTR_NWB:
+			if ((from & DFA_START && !word) || word == !!(from & DFA_WORD))
+				PUSH(next);
+			break;
+		case INSTR_NOT:
+			if (kdgu_contains(in->str, c)) break;
+			if (end) PUSH(next);
+			else TAKE(next);
+			break;
+		case INSTR_STR: case INSTR_TSTR:
+			if (!in->str->len) {
+				PUSH(next);
+				break;
+			}
+
+			if (end) break;
+			if (insensitive && c >= 0x80) return DFA_GIVE_UP;
+			if (!same_char(in->str->s[ps->k], c, insensitive)) break;
+			TAKE(ps->k + 1 < (int)in->str->len ? p + 1 : next);
+			break;
+		case INSTR_ALT:
+			if (ps->alt < 0) {
+				for (unsigned j = 0, q = p + 1; j < in->num; j++) {
+					PUSH(q);
+					q += in->list[j]->len;
+				}
+				break;
+			}
+
+			if (end) break;
+			if (insensitive && c >= 0x80) return DFA_GIVE_UP;
+			if (!same_char(in->list[ps->alt]->s[ps->k], c, insensitive))
+				break;
+			TAKE(ps->k + 1 < (int)in->list[ps->alt]->len ? p + 1 : next);
+			break;
+		default:
+			if (!end && reads(re, in, c, re->opt)) TAKE(next);
+		}
+	}
+
+#undef PUSH
+#undef TAKE
+
+	if (end) return matched;
+
+	int t = dfa_state(re, d, d->out, n, flags);
+	return t < 0 ? t : t << 1 | matched;
+}
+
+/* The context a state at `sp' starts in. */
+static unsigned
+dfa_context(const ktre *re, const kdgu *subject, unsigned sp)
+{
+	unsigned flags = 0;
+
+	if (!sp) flags |= DFA_START;
+	if (at_bol(subject, sp)) flags |= DFA_BOL;
+	if (is_word(re, kdgu_decode_inline(subject, sp - 1))) flags |= DFA_WORD;
+
+	return flags;
+}
+
+/*
+ * Reads `subject' from `sp' with the lazy DFA. Returns -1 if there's
+ * no match, or else where the VM should start looking for it. If it
+ * read as far as the end of a match, `found' is set too.
+ */
+static int
+dfa_scan(ktre_ctx *x, const kdgu *subject, int sp, bool *found)
+{
+	const ktre *re = x->re;
+
+	if (subject->fmt != KDGU_FMT_UTF8 && subject->fmt != KDGU_FMT_ASCII)
+		return sp;
+	if (!x->dfa && !(x->dfa = dfa_new(re))) return sp;
+
+	struct dfa *d = x->dfa;
+	const uint8_t *str = subject->s;
+	unsigned first = d->first[0], p = sp, len = subject->len, flushed = sp;
+	unsigned base = d->flushes, flushes = base;
+	int s = dfa_state(re, d, &first, 1, dfa_context(re, subject, sp));
+	int from = sp, t;
+
+	if (s < 0) return from;
+
+	while (p < len) {
+		uint8_t b = str[p];
+		uint32_t c = b;
+		unsigned n = 1;
+
+		/*
+		 * An ASCII character followed by another is always a
+		 * grapheme of its own, except in CR LF. Where a state goes
+		 * on one doesn't depend on anything else, so those are the
+		 * transitions that are kept.
+		 */
+		if (b < 0x80 && b != '\r' && (p + 1 == len || str[p + 1] < 0x80)) {
+			t = d->s[s].next[b];
+
+			if (t == DFA_UNKNOWN) {
+				unsigned flags = b == '\n' ? DFA_BOL
+					: is_word(re, b) ? DFA_WORD : 0;
+				unsigned f = d->flushes;
+				t = dfa_make(re, d, s, b, false, flags);
+				if (f == d->flushes && t >= 0) d->s[s].next[b] = t;
+			}
+		} else {
+			unsigned g = p, u = p;
+			kdgu_next_inline(subject, &g);
+			kdgu_inc_inline(subject, &u);
+			if (g != u || g == p) return from;
+
+			c = kdgu_decode_inline(subject, p), n = u - p;
+			t = dfa_make(re, d, s, c, false,
+			             dfa_context(re, subject, p + n));
+		}
+
+		if (t >= 0 && t & 1) *found = true;
+		if (t < 0 || t & 1) return from;
+
+		/*
+		 * Gives up on a subject that needs more states than fit in
+		 * the cache, when it has to be emptied again after only a
+		 * few characters a state.
+		 */
+		if (d->flushes != flushes) {
+			if (flushes != base && p - flushed < 4 * KTRE_DFA_STATES)
+				return from;
+			flushes = d->flushes, flushed = p;
+		}
+
+		s = t >> 1, p += n;
+		if (!d->s[s].n) return -1;
+		if (!d->s[s].idle) continue;
+
+		/* With only the `.*?' left it can skip ahead too. */
+		from = p;
+		if (!re->skip || (t = skip(re, subject, p)) == (int)p) continue;
+		if (t < 0) return -1;
+
+		p = from = t;
+		s = dfa_state(re, d, &first, 1, dfa_context(re, subject, p));
+		if (s < 0) return from;
+	}
+
+	if (d->s[s].end == DFA_UNKNOWN)
+		d->s[s].end = dfa_make(re, d, s, UINT32_MAX, true, 0);
+
+	*found = d->s[s].end;
+	return d->s[s].end ? from : -1;
+}
+
+/*
+ * Returns where a VM should start looking for a match from `sp', or
+ * -1 if it doesn't have to. A `vec' of NULL means nothing reads the
+ * matches afterwards, only whether there is one, so when the DFA
+ * finds one the match is added without any groups and -2 is returned
+ * instead. Only ktre_match() runs like that; the others keep their
+ * results where ktre_getvec() and the context can get at them.
+ */
+static int
+start(ktre_ctx *x, const kdgu *subject, int sp, int ***vec)
+{
+	const ktre *re = x->re;
+	bool found = false;
+
+	if (re->skip && (sp = skip(re, subject, sp)) < 0) return -1;
+	if (re->dfa && (sp = dfa_scan(x, subject, sp, &found)) < 0) return -1;
+	if (!found || vec || re->opt & (KTRE_GLOBAL | KTRE_CONTINUE)) return sp;
+
+	int none[KTRE_MAX_GROUPS * 2];
+	memset(none, -1, sizeof none);
+	add_match(x, none, sp, re->c[re->ip - 1].loc);
+
+	return -2;
+}
+
+/*
+ * The breadth-first VM runs programs that never have to resume a
+ * saved thread. Instead of following one thread until it fails, it
+ * steps every thread over the subject together and drops a thread
+ * that reaches an instruction another has already reached at the
+ * same position having started the same loops there, since it can't
+ * do anything the first one can't. That bounds the work at each
+ * position by the length of the program times the combinations of
+ * loops. The threads are kept in order of priority, so the match it
+ * finds is the one the backtracking VM would have.
+ */
+
+/* The mark of the instruction `ip' for threads that started `loops'. */
+#define MARK(ip,loops) (x->mark[(loops) * x->re->ip + (ip)])
+
+static bool
+pike_push(ktre_ctx *x, struct pike *l, unsigned ip, int sp, unsigned opt,
+          unsigned loops, const int *vec)
+{
+	unsigned ncap = x->re->num_groups * 2;
+
+	if (l->n == l->alloc) {
+		unsigned n = l->alloc ? l->alloc * 2 : 16;
+		struct pike_thread *t = realloc(l->t, n * sizeof *t);
+		if (t) l->t = t;
+		int *v = realloc(l->vec, n * ncap * sizeof *v);
+		if (v) l->vec = v;
+
+		if (!t || !v) {
+			runtime_error(x, KTRE_ERROR_OUT_OF_MEMORY,
+			              x->re->c[ip].loc, "out of memory");
+			return false;
+		}
+
+		l->alloc = n;
+	}
+
+	l->t[l->n] = (struct pike_thread){ ip, opt, loops, sp };
+	memcpy(l->vec + l->n++ * ncap, vec, ncap * sizeof *vec);
+
+	return true;
+}
+
+/*
+ * Runs the instruction at `ip' that reads the subject on a thread at
+ * `sp', returning where the thread is left or -1 if it fails.
+ */
+static int
+pike_step(const ktre *re, const kdgu *subject, unsigned ip, int sp,
+          unsigned opt)
+{
+	const struct instr *in = &re->c[ip];
+	uint32_t c = kdgu_decode_inline(subject, sp);
+	unsigned idx = sp;
+
+	switch (in->op) {
+	case INSTR_STR: case INSTR_TSTR: {
+		unsigned len = kdgu_len(in->str);
+		if (!kdgu_ncmp(subject, in->str, sp, 0, len,
+		               opt & KTRE_INSENSITIVE, NULL))
+			return -1;
+		kdgu_move(subject, &idx, len);
+		return idx;
+	}
+	case INSTR_ALT:
+		for (unsigned i = 0; i < in->num; i++) {
+			unsigned len = kdgu_len(in->list[i]);
+			if (!kdgu_ncmp(subject, in->list[i], sp, 0, len,
+			               opt & KTRE_INSENSITIVE, NULL))
+				continue;
+			kdgu_move(subject, &idx, len);
+			return idx;
+		}
+		return -1;
+	case INSTR_NOT:
+		if (kdgu_contains(in->str, c)) return -1;
+		kdgu_next_inline(subject, &idx);
+		return idx;
+	case INSTR_BOL: return at_bol(subject, sp) ? sp : -1;
+	case INSTR_EOL:
+		if (!kdgu_chrcmp(subject, sp, '\n'))
+			return sp == (int)subject->len ? sp : -1;
+		break;
+	case INSTR_BOS: return sp ? -1 : sp;
+	case INSTR_EOS: return sp == (int)subject->len ? sp : -1;
+	case INSTR_WB:
+		if (sp == 0 && is_word(re, c)) return sp;
+		if (is_word(re, c) != is_word(re, kdgu_decode_inline(subject, sp - 1)))
+			return sp;
+		return -1;
+	case INSTR_NWB:
+		if (sp == 0 && !is_word(re, c)) return sp;
+		if (is_word(re, c) == is_word(re, kdgu_decode_inline(subject, sp - 1)))
+			return sp;
+		return -1;
+	case INSTR_CATEGORY: case INSTR_SCRIPT: case INSTR_RANGE:
+		/* These read a code point instead of a grapheme. */
+		if (!reads(re, in, c, opt)) return -1;
+		if (!kdgu_inc_inline(subject, &idx)) idx++;
+		return idx;
+	default:
+		if (!reads(re, in, c, opt)) return -1;
+	}
+
+	if (!kdgu_next_inline(subject, &idx)) idx++;
+	return idx;
+}
+
+/*
+ * Follows the thread `t' of `x->now', which is at `sp', through the
+ * instructions that don't read the subject. The threads that get past
+ * one that does are left in `x->later'. Returns true if it matched,
+ * in which case the threads after it are dropped.
+ */
+static bool
+pike_follow(ktre_ctx *x, const kdgu *subject, unsigned t, int sp,
+            int *end, unsigned *mopt)
+{
+	const ktre *re = x->re;
+	unsigned ncap = re->num_groups * 2;
+	int *v = x->pvec;
+
+	x->alt.n = 0;
+	if (!pike_push(x, &x->alt, x->now.t[t].ip, sp, x->now.t[t].opt,
+	               x->now.t[t].loops, x->now.vec + t * ncap))
+		return false;
+
+	while (x->alt.n) {
+		unsigned ip = x->alt.t[--x->alt.n].ip;
+		unsigned opt = x->alt.t[x->alt.n].opt;
+		unsigned loops = x->alt.t[x->alt.n].loops;
+		memcpy(v, x->alt.vec + x->alt.n * ncap, ncap * sizeof *v);
+
+		while (MARK(ip, loops) != sp) {
+			const struct instr *in = &re->c[ip];
+			MARK(ip, loops) = sp;
+
+			switch (in->op) {
+			case INSTR_JMP:
+				ip = in->c;
+				continue;
+			case INSTR_BRANCH:
+				if (!pike_push(x, &x->alt, in->b, sp, opt, loops, v))
+					return false;
+				ip = in->a;
+				continue;
+			case INSTR_SAVE:
+				v[in->c] = in->c % 2 == 0 ? sp : sp - v[in->c - 1];
+				ip++;
+				continue;
+			case INSTR_SET_START:
+				v[0] = sp;
+				ip++;
+				continue;
+			case INSTR_SETOPT:
+				opt = in->c;
+				ip++;
+				continue;
+			case INSTR_PROG: {
+				/* Like the backtracker, don't start a loop twice here. */
+				int bit = re->loop[in->c];
+				if (bit >= 0 && loops >> bit & 1) break;
+				if (bit >= 0) loops |= 1u << bit;
+				ip++;
+				continue;
+			}
+			case INSTR_MATCH:
+				if (!is_new_match(x, subject, sp, opt)) break;
+				memcpy(x->best, v, ncap * sizeof *v);
+				*end = sp, *mopt = opt;
+				return true;
+			default: {
+				int to = pike_step(re, subject, ip, sp, opt);
+				if (to < 0 || to > (int)subject->len) break;
+				if (ip++ == PREFIX_BODY && re->skip
+				    && (to = skip(re, subject, to)) < 0)
+					break;
+				if (to == sp) continue;
+				if (!pike_push(x, &x->later, ip, to, opt, 0, v))
+					return false;
+			}
+			}
+
+			break;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Looks for the first match from `sp' on, returning where it ends or
+ * -1 if there isn't one. Its groups are left in `x->best'.
+ */
+static int
+pike_search(ktre_ctx *x, const kdgu *subject, int sp, unsigned *opt)
+{
+	const ktre *re = x->re;
+	unsigned ncap = re->num_groups * 2;
+	int end = -1;
+
+	for (int i = 0; i < re->ip << re->num_loops; i++) x->mark[i] = -1;
+	memset(x->pvec, -1, ncap * sizeof *x->pvec);
+
+	x->now.n = 0;
+	if (!pike_push(x, &x->now, 0, sp, re->opt, 0, x->pvec)) return -1;
+
+	while (x->now.n && !x->err) {
+		/* The threads furthest behind go first. */
+		int at = INT_MAX;
+		for (unsigned i = 0; i < x->now.n; i++)
+			if (x->now.t[i].sp < at) at = x->now.t[i].sp;
+
+		x->later.n = 0;
+
+		for (unsigned i = 0; i < x->now.n && !x->err; i++) {
+			const struct pike_thread *t = &x->now.t[i];
+
+			if (t->sp != at) {
+				pike_push(x, &x->later, t->ip, t->sp, t->opt,
+				          t->loops, x->now.vec + i * ncap);
+				continue;
+			}
+
+			if (pike_follow(x, subject, i, at, &end, opt)) break;
+		}
+
+		struct pike tmp = x->now;
+		x->now = x->later;
+		x->later = tmp;
+	}
+
+	return x->err ? -1 : end;
+}
+
+static bool
+pike(ktre_ctx *x, const kdgu *subject, int ***vec, int sp)
+{
+	const ktre *re = x->re;
+	unsigned ncap = re->num_groups * 2, loc = re->c[re->ip - 1].loc;
+
+	if (!x->mark) {
+		x->mark = malloc((re->ip << re->num_loops) * sizeof *x->mark);
+		x->pvec = malloc(ncap * sizeof *x->pvec);
+		x->best = malloc(ncap * sizeof *x->best);
+
+		if (!x->mark || !x->pvec || !x->best) {
+			free(x->mark), free(x->pvec), free(x->best);
+			x->mark = x->pvec = x->best = NULL;
+			runtime_error(x, KTRE_ERROR_OUT_OF_MEMORY, loc, "out of memory");
+			return false;
+		}
+	}
+
+	unsigned opt = re->opt;
+	int end;
+
+	while ((sp = start(x, subject, sp, vec)) >= 0
+	       && (end = pike_search(x, subject, sp, &opt)) >= 0) {
+		if (!add_match(x, x->best, end, loc)) break;
+		if (vec) *vec = x->vec;
+		if (!(opt & KTRE_GLOBAL)) break;
+		sp = end;
+	}
+
+	return !!x->num_matches;
+}
+
+#undef MARK
+
+static bool
+run(ktre_ctx *x, const kdgu *subject, int ***vec)
+{
+	const ktre *re = x->re;
+
+	if (vec) *vec = NULL;
+	free_matches(x);
+	TP = -1;
+
+	if (x->err) {
+		free(x->err_str);
+		x->err = KTRE_ERROR_NO_ERROR;
+		x->err_str = NULL;
+	}
+
+	if (re->opt & KTRE_CONTINUE && x->cont >= (int)subject->len)
+		return false;
+
+	int sp = re->opt & KTRE_CONTINUE ? x->cont : 0;
+	if (re->pike) return pike(x, subject, vec, sp);
+
+	/* A pattern that was refused /l doesn't fall back. */
+	if (re->opt & KTRE_LINEAR) return false;
+	if ((sp = start(x, subject, sp, vec)) < 0) return !!x->num_matches;
+
+	if (!x->thread_alloc) {
+		x->t = malloc(25 * sizeof *THREAD);
+		if (!x->t) return false;
+		x->thread_alloc = 25;
+		memset(x->t, 0, x->thread_alloc * sizeof *THREAD);
+	} else if (THREAD[0].prog) {
+		/* Nothing from the last subject is left in the first thread. */
+		memset(THREAD[0].prog, -1, re->num_prog * sizeof *THREAD[0].prog);
+		memset(THREAD[0].vec, -1, re->num_groups * 2 * sizeof *THREAD[0].vec);
+	}
+
+	/* Push the initial thread. */
+	new_thread(x, sp, 0, re->opt, 0, 0, 0);
+
+	unsigned num_steps = 0;
+	DBG("\n|   ip |   sp |   tp |   fp | step |");
+
+	while (TP >= 0
+	       && execute_instr(x,
+				THREAD[TP].ip,
+				THREAD[TP].sp,
+				THREAD[TP].fp,
+				THREAD[TP].la,
+				THREAD[TP].ep,
+				THREAD[TP].opt,
+				re->c[THREAD[TP].ip].loc,
+				THREAD[TP].rev,
+				num_steps++,
+				subject,
+				vec));
+
+	return !!x->num_matches;
+}
+
+void
+ktre_ctx_free(ktre_ctx *x)
+{
+	if (!x) return;
+
+	for (int i = 0; i <= x->max_tp; i++) {
+		free(THREAD[i].vec);
 		free(THREAD[i].prog);
 		free(THREAD[i].frame);
 		free(THREAD[i].las);
 		free(THREAD[i].exception);
 	}
 
-	if (re->vec) {
-		for (unsigned i = 0; i < re->num_matches; i++)
-			free((re->vec)[i]);
+	struct pike *l[] = { &x->now, &x->later, &x->alt };
+	for (unsigned i = 0; i < sizeof l / sizeof *l; i++)
+		free(l[i]->t), free(l[i]->vec);
+
+	free_matches(x);
+	free(x->vec);
+	free(x->err_str);
+	free(x->t);
+	free(x->mark);
+	free(x->pvec);
+	free(x->best);
+	dfa_free(x->dfa);
+	free(x);
+}
 
-		free(re->vec);
+/*
+ * Runs the regex of `x' on `subject'. The matches stay in `x' until
+ * the next time it's run.
+ */
+_Bool
+ktre_ctx_exec(ktre_ctx *x, const kdgu *subject, int ***vec)
+{
+	if (!x || !subject) return false;
+	const ktre *re = x->re;
+
+	if (re->opt & KTRE_DEBUG) {
+		DBG("subject: ");
+		dbgf(re, subject, 0);
+	}
+
+	int **v = NULL;
+	_Bool ret = run(x, subject, vec ? vec : &v);
+	print_finish(x, subject, re->s, ret, x->vec, NULL);
+
+	return ret;
+}
+
+/*
+ * Returns the context that `re' runs in when it isn't given one,
+ * making it the first time.
+ */
+static ktre_ctx *
+own_ctx(ktre *re)
+{
+	if (!re->ctx) re->ctx = ktre_ctx_new(re);
+	return re->ctx;
+}
+
+/* Returns a copy of the match vectors of `x' for the caller to keep. */
+static int **
+getvec(const ktre_ctx *x)
+{
+	unsigned n = x ? x->num_matches : 0;
+	int **vec = malloc(n * sizeof *vec);
+
+	for (unsigned i = 0; i < n; i++) {
+		vec[i] = malloc(x->re->num_groups * 2 * sizeof **vec);
+		memcpy(vec[i], x->vec[i], x->re->num_groups * 2 * sizeof **vec);
 	}
 
+	return vec;
+}
+
+/* Copies the results of the last run into the public fields of `re'. */
+static void
+publish(ktre *re)
+{
+	ktre_ctx *x = re->ctx;
+	re->num_matches = x->num_matches;
+	if (!x->err) return;
+
+	/* Like error(), the first error is the one that's kept. */
+	if (!re->err) {
+		re->err = x->err;
+		re->err_str = x->err_str;
+		re->loc = x->loc;
+	} else {
+		free(x->err_str);
+	}
+
+	x->err = KTRE_ERROR_NO_ERROR;
+	x->err_str = NULL;
+}
+
+void
+ktre_free(ktre *re)
+{
+	ktre_ctx_free(re->ctx);
+	if (re->err) free(re->err_str);
+	if (re->copied) {
+		free(re);
+		return;
+	}
+
+	free_node(re->n);
+
+	if (re->c) {
+		for (int i = 0; i < re->ip; i++)
+			if (re->c[i].op == INSTR_TSTR)
+				kdgu_free(re->c[i].str);
+			else if (re->c[i].op == INSTR_CLASS
+			         || re->c[i].op == INSTR_NCLASS)
+				kdgu_setfree(re->c[i].set);
+
+		free(re->c);
+	}
+
+	free(re->loop);
+
 	for (int i = 0; i < re->gp; i++)
 		if (re->group[i].name)
 			kdgu_free(re->group[i].name);
 
 	free(re->group);
-	free(re->t);
 	free(re);
 
 	return;
@@ -3106,46 +4434,277 @@ ktre_free(ktre *re)
 _Bool
 ktre_exec(ktre *re, const kdgu *subject, int ***vec)
 {
-	if (re->opt & KTRE_DEBUG) {
-		DBG("subject: ");
-		dbgf(re, subject, 0);
-	}
-
 	if (re->err) {
 		if (re->err_str) free(re->err_str);
 		re->err = KTRE_ERROR_NO_ERROR;
+		re->err_str = NULL;
 	}
 
-	int **v = NULL;
-	_Bool ret = false;
+	ktre_ctx *x = own_ctx(re);
+	if (!x) return false;
 
-	if (re->thread_alloc)
-		memset(re->t[0].prog, -1, re->num_prog * sizeof *re->t[0].prog);
+	_Bool ret = ktre_ctx_exec(x, subject, vec);
+	publish(re);
 
-	if (vec) ret = run(re, subject, vec);
-	else     ret = run(re, subject, &v);
+	return ret;
+}
 
-	if (vec) print_finish(re, subject, re->s, ret, *vec, NULL);
-	else     print_finish(re, subject, re->s, ret, v, NULL);
+/*
+ * ktre_match() and ktre_replace() keep the programs they compile in a
+ * cache. It's split into shards with a lock and an LRU list each, so
+ * threads looking up different patterns rarely wait for each other.
+ * An entry counts the calls using it, and one that's evicted while
+ * it's in use is freed by the last of them to finish.
+ */
+struct cached {
+	uint64_t hash;
+	kdgu *pat;
+	int opt;
+	ktre *re;
+	unsigned refs;
+	bool evicted;
+	struct cached *prev, *next;
 
-	return ret;
+	/*
+	 * The context the last run finished with, kept so the next one
+	 * starts with the DFA states it built.
+	 */
+	ktre_ctx *spare;
+};
+
+static struct shard {
+	pthread_mutex_t lock;
+	struct cached *head, *tail; /* Most and least recently used. */
+	unsigned len;
+	unsigned long hits, misses, evictions;
+} cache[KTRE_CACHE_SHARDS];
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void
+cache_init(void)
+{
+	for (int i = 0; i < KTRE_CACHE_SHARDS; i++)
+		pthread_mutex_init(&cache[i].lock, NULL);
+}
+
+static uint64_t
+hash_pattern(const kdgu *pat, int opt)
+{
+	uint64_t h = 0xCBF29CE484222325;
+
+	for (unsigned i = 0; i < pat->len; i++)
+		h = (h ^ pat->s[i]) * 0x100000001B3;
+
+	h = (h ^ pat->fmt) * 0x100000001B3;
+	return (h ^ (unsigned)opt) * 0x100000001B3;
+}
+
+static bool
+same_pattern(const struct cached *e, uint64_t h, const kdgu *pat, int opt)
+{
+	return e->hash == h && e->opt == opt
+		&& e->pat->fmt == pat->fmt && e->pat->len == pat->len
+		&& !memcmp(e->pat->s, pat->s, pat->len);
+}
+
+static void
+free_cached(struct cached *e)
+{
+	ktre_ctx_free(e->spare);
+	ktre_free(e->re);
+	kdgu_free(e->pat);
+	free(e);
+}
+
+static void
+unlink_cached(struct shard *sh, struct cached *e)
+{
+	if (e->prev) e->prev->next = e->next; else sh->head = e->next;
+	if (e->next) e->next->prev = e->prev; else sh->tail = e->prev;
+	e->prev = e->next = NULL;
+	sh->len--;
+}
+
+static void
+push_cached(struct shard *sh, struct cached *e)
+{
+	e->prev = NULL, e->next = sh->head;
+	if (sh->head) sh->head->prev = e; else sh->tail = e;
+	sh->head = e;
+	sh->len++;
+}
+
+/*
+ * Takes an entry out of its shard. Returns it if nothing's using it
+ * and it can be freed straight away.
+ */
+static struct cached *
+evict(struct shard *sh, struct cached *e)
+{
+	unlink_cached(sh, e);
+	sh->evictions++;
+	e->evicted = true;
+	return e->refs ? NULL : e;
+}
+
+/* Finds the program for `pat', compiling it if it isn't cached. */
+static struct cached *
+acquire(const kdgu *pat, int opt)
+{
+	pthread_once(&cache_once, cache_init);
+
+	uint64_t h = hash_pattern(pat, opt);
+	struct shard *sh = &cache[h % KTRE_CACHE_SHARDS];
+	struct cached *e;
+
+	pthread_mutex_lock(&sh->lock);
+
+	for (e = sh->head; e; e = e->next) {
+		if (!same_pattern(e, h, pat, opt)) continue;
+		unlink_cached(sh, e), push_cached(sh, e);
+		e->refs++, sh->hits++;
+		pthread_mutex_unlock(&sh->lock);
+		return e;
+	}
+
+	sh->misses++;
+	pthread_mutex_unlock(&sh->lock);
+
+	/* Compiling can take a while, so it's done without the lock. */
+	e = malloc(sizeof *e);
+	if (!e) return NULL;
+	memset(e, 0, sizeof *e);
+
+	e->hash = h, e->opt = opt, e->refs = 1;
+	e->pat = kdgu_copy(pat);
+	e->re = e->pat ? ktre_compile(e->pat, opt) : NULL;
+
+	if (!e->re) {
+		kdgu_free(e->pat), free(e);
+		return NULL;
+	}
+
+	/* Debugging output is printed while compiling. */
+	if (opt & KTRE_DEBUG || KTRE_CACHE_SIZE < KTRE_CACHE_SHARDS)
+		return e->evicted = true, e;
+
+	struct cached *victim = NULL, *found = NULL;
+	pthread_mutex_lock(&sh->lock);
+
+	/* Another thread may have compiled it in the meantime. */
+	for (found = sh->head; found; found = found->next)
+		if (same_pattern(found, h, pat, opt)) break;
+
+	if (found) {
+		found->refs++;
+	} else {
+		push_cached(sh, e);
+		if (sh->len > KTRE_CACHE_SIZE / KTRE_CACHE_SHARDS)
+			victim = evict(sh, sh->tail);
+	}
+
+	pthread_mutex_unlock(&sh->lock);
+
+	if (victim) free_cached(victim);
+	if (found) free_cached(e);
+
+	return found ? found : e;
+}
+
+/* Takes the context the last run of `e' left, or makes a new one. */
+static ktre_ctx *
+take_ctx(struct cached *e)
+{
+	struct shard *sh = &cache[e->hash % KTRE_CACHE_SHARDS];
+	if (e->re->err) return NULL;
+
+	pthread_mutex_lock(&sh->lock);
+	ktre_ctx *x = e->spare;
+	e->spare = NULL;
+	pthread_mutex_unlock(&sh->lock);
+
+	if (!x) return ktre_ctx_new(e->re);
+
+	x->cont = 0;
+	return x;
+}
+
+/* Lets go of `e', leaving `x' with it for the next run if there's room. */
+static void
+release(struct cached *e, ktre_ctx *x)
+{
+	struct shard *sh = &cache[e->hash % KTRE_CACHE_SHARDS];
+
+	pthread_mutex_lock(&sh->lock);
+	bool dead = !--e->refs && e->evicted;
+	if (x && !e->spare && !e->evicted) e->spare = x, x = NULL;
+	pthread_mutex_unlock(&sh->lock);
+
+	ktre_ctx_free(x);
+	if (dead) free_cached(e);
+}
+
+void
+ktre_cache_stats(struct ktre_cache_stats *st)
+{
+	pthread_once(&cache_once, cache_init);
+	memset(st, 0, sizeof *st);
+
+	for (int i = 0; i < KTRE_CACHE_SHARDS; i++) {
+		pthread_mutex_lock(&cache[i].lock);
+		st->hits += cache[i].hits;
+		st->misses += cache[i].misses;
+		st->evictions += cache[i].evictions;
+		st->size += cache[i].len;
+		pthread_mutex_unlock(&cache[i].lock);
+	}
+}
+
+/* Empties the cache. Entries that are in use go once they're done. */
+void
+ktre_cache_clear(void)
+{
+	pthread_once(&cache_once, cache_init);
+
+	for (int i = 0; i < KTRE_CACHE_SHARDS; i++) {
+		struct shard *sh = &cache[i];
+		struct cached *dead = NULL;
+
+		pthread_mutex_lock(&sh->lock);
+
+		while (sh->tail) {
+			struct cached *e = evict(sh, sh->tail);
+			if (e) e->next = dead, dead = e;
+		}
+
+		pthread_mutex_unlock(&sh->lock);
+
+		while (dead) {
+			struct cached *e = dead;
+			dead = dead->next;
+			free_cached(e);
+		}
+	}
 }
 
 _Bool
 ktre_match(const kdgu *subject, const kdgu *pat, int opt, int ***vec)
 {
-	ktre *re = ktre_compile(pat, opt);
+	if (!subject || !pat) return false;
 
-	if (re->err) {
-		ktre_free(re);
-		return false;
-	}
+	struct cached *e = acquire(pat, opt);
+	if (!e) return false;
+
+	ktre_ctx *x = take_ctx(e);
+	if (!x) return release(e, NULL), false;
+
+	bool ret = run(x, subject, vec);
+	print_finish(x, subject, pat, ret, x->vec, NULL);
+	if (vec) *vec = getvec(x);
+
+	release(e, x);
 
-	int **v = NULL;
-	bool ret = run(re, subject, vec ? vec : &v);
-	print_finish(re, subject, pat, ret, vec ? *vec : v, NULL);
-	if (vec) *vec = ktre_getvec(re);
-	ktre_free(re);
 	return ret;
 }
 
@@ -3156,16 +4715,17 @@ ktre_replace(const kdgu *subject,
 	     const kdgu *indicator,
 	     int opt)
 {
-	ktre *re = ktre_compile(pat, opt);
+	if (!subject || !pat) return NULL;
 
-	if (!re->err) {
-		kdgu *ret = ktre_filter(re, subject, replacement, indicator);
-		ktre_free(re);
-		return ret;
-	}
+	struct cached *e = acquire(pat, opt);
+	if (!e) return NULL;
+
+	ktre_ctx *x = take_ctx(e);
+	kdgu *ret = x ? filter(x, subject, replacement, indicator) : NULL;
 
-	ktre_free(re);
-	return NULL;
+	release(e, x);
+
+	return ret;
 }
 
 static void
@@ -3175,15 +4735,27 @@ smartcopy(kdgu *dest,
 	  unsigned n,
 	  bool u, bool uch, bool l, bool lch)
 {
-	for (unsigned i = j; i < j + n; kdgu_next(src, &i)) {
-		kdgu *chr = kdgu_getchr(src, i);
+	for (kdgu_chriter it = kdgu_chrbegin(src, j);
+	     kdgu_chrnext(&it) && it.off < j + n;) {
+		bool first = it.off == j;
+
+		/* Only a change of case needs a copy of the grapheme. */
+		if (!u && !l && !(first && (uch || lch))) {
+			kdgu_append(dest, &(kdgu){
+				0, it.len, src->s + it.off, NULL,
+				src->norm, src->fmt, NULL, src->flags, true, false, false
+			});
+			continue;
+		}
+
+		kdgu *chr = kdgu_getchr(src, it.off);
 
-		if (i == j && uch) {
+		if (first && uch) {
 			kdgu_uc(chr), kdgu_append(dest, chr), kdgu_free(chr);
 			continue;
 		}
 
-		if (i == j && lch) {
+		if (first && lch) {
 			kdgu_lc(chr), kdgu_append(dest, chr), kdgu_free(chr);
 			continue;
 		}
@@ -3195,28 +4767,30 @@ smartcopy(kdgu *dest,
 	}
 }
 
-kdgu *
-ktre_filter(ktre *re,
-	    const kdgu *subject,
-	    const kdgu *replacement,
-	    const kdgu *indicator)
+static kdgu *
+filter(ktre_ctx *x,
+       const kdgu *subject,
+       const kdgu *replacement,
+       const kdgu *indicator)
 {
+	const ktre *re = x->re;
 	DBG("\nsubject: "), dbgf(re, subject, 0);
 
 	int **vec = NULL;
-	if (!run(re, subject, &vec) || re->err)
-		return print_finish(re, subject, re->s, false, vec, NULL), NULL;
+	bool ok = run(x, subject, &vec);
+	print_finish(x, subject, re->s, ok, vec, NULL);
+	if (!ok || x->err) return NULL;
 
 	kdgu *ret = NULL;
 
-	for (unsigned i = 0; i < re->num_matches; i++) {
+	for (unsigned i = 0; i < x->num_matches; i++) {
 		bool u   = false, l   = false;
 		bool uch = false, lch = false;
 
 		if (i > 0) {
-			kdgu *substr = kdgu_substr(subject,
-						   vec[i - 1][0] + vec[i - 1][1],
-						   vec[i][0]);
+			kdgu *substr = kdgu_subview(subject,
+						    vec[i - 1][0] + vec[i - 1][1],
+						    vec[i][0]);
 			kdgu_append(ret, substr), kdgu_free(substr);
 		} else
 			ret = kdgu_new(subject->fmt, subject->s, vec[i][0]);
@@ -3280,17 +4854,35 @@ ktre_filter(ktre *re,
 		}
 	}
 
-	int end = vec[re->num_matches - 1][0]
-		+ vec[re->num_matches - 1][1];
-	kdgu *substr = kdgu_substr(subject, end, subject->len);
-	kdgu_append(ret, substr);
-	print_finish(re, subject, re->s, ret, vec, ret);
+	int end = vec[x->num_matches - 1][0]
+		+ vec[x->num_matches - 1][1];
+	kdgu *substr = kdgu_subview(subject, end, subject->len);
+	kdgu_append(ret, substr), kdgu_free(substr);
+	if (re->opt & KTRE_DEBUG)
+		DBG("\nreplace: `"), kdgu_print(ret, stderr), DBG("`\n");
 
 	return ret;
 }
 
-kdgu **
-ktre_split(ktre *re, const kdgu *subject, int *len)
+kdgu *
+ktre_filter(ktre *re,
+	    const kdgu *subject,
+	    const kdgu *replacement,
+	    const kdgu *indicator)
+{
+	ktre_ctx *x = own_ctx(re);
+	if (!x) return NULL;
+
+	kdgu *ret = filter(x, subject, replacement, indicator);
+	publish(re);
+
+	return ret;
+}
+
+/* `slice' decides whether the pieces are copies or views. */
+static kdgu **
+split(ktre *re, const kdgu *subject, int *len,
+      kdgu *(*slice)(const kdgu *, unsigned, unsigned))
 {
 	int **vec = NULL;
 	DBG("\nsubject: "), dbgf(re, subject, 0);
@@ -3299,42 +4891,54 @@ ktre_split(ktre *re, const kdgu *subject, int *len)
 	kdgu **r = NULL;
 	unsigned j = 0;
 
-	if (!run(re, subject, &vec) || re->err) {
-		print_finish(re, subject, re->s, false, vec, NULL);
+	ktre_ctx *x = own_ctx(re);
+	bool ok = x && run(x, subject, &vec);
+	if (x) print_finish(x, subject, re->s, ok, vec, NULL), publish(re);
+
+	if (!ok || re->err) {
 		*len = 1;
 		r = malloc(sizeof *r);
-		*r = kdgu_copy(subject);
+		*r = slice(subject, 0, subject->len);
 		return r;
 	}
 
 	for (unsigned i = 0; i < re->num_matches; i++) {
 		if (vec[i][0] == 0 || vec[i][0] == (int)subject->len) continue;
 		r = realloc(r, (*len + 1) * sizeof *r);
-		r[*len] = kdgu_new(subject->fmt, subject->s + j, vec[i][0] - j);
+		r[*len] = slice(subject, j, vec[i][0]);
 		j = vec[i][0] + vec[i][1];
 		(*len)++;
 	}
 
 	if (subject->len >= j) {
 		r = realloc(r, (*len + 1) * sizeof *r);
-		r[*len] = kdgu_new(subject->fmt, subject->s + j, subject->len - j);
+		r[*len] = slice(subject, j, subject->len);
 		(*len)++;
 	}
 
 	return r;
 }
 
-int **
-ktre_getvec(const ktre *re)
+kdgu **
+ktre_split(ktre *re, const kdgu *subject, int *len)
 {
-	int **vec = malloc(re->num_matches * sizeof *re->vec);
+	return split(re, subject, len, kdgu_substr);
+}
 
-	for (unsigned i = 0; i < re->num_matches; i++) {
-		vec[i] = malloc(re->num_groups * 2 * sizeof **re->vec);
-		memcpy(vec[i], re->vec[i], re->num_groups * 2 * sizeof **re->vec);
-	}
+/*
+ * Like ktre_split(), but the pieces are views of `subject' and are
+ * only good for as long as it is.
+ */
+kdgu **
+ktre_splitview(ktre *re, const kdgu *subject, int *len)
+{
+	return split(re, subject, len, kdgu_subview);
+}
 
-	return vec;
+int **
+ktre_getvec(const ktre *re)
+{
+	return getvec(re->ctx);
 }
 
 kdgu *
@@ -3342,3 +4946,9 @@ ktre_getgroup(int **const vec, int match, int group, const kdgu *subject)
 {
 	return kdgu_substr(subject, vec[match][group * 2], vec[match][group * 2] + vec[match][group * 2 + 1]);
 }
+
+kdgu *
+ktre_getgroupview(int **const vec, int match, int group, const kdgu *subject)
+{
+	return kdgu_subview(subject, vec[match][group * 2], vec[match][group * 2] + vec[match][group * 2 + 1]);
+}
@@ -0,0 +1,302 @@
+#include <string.h>
+
+#include "kdgu.h"
+#include "unicode_data.h"
+
+/* One past the last code point; every list ends at or below it. */
+#define SET_END 0x110000
+
+/*
+ * The result of combining two sets is picked out of `op' by whether a
+ * code point is in the first set (bit one of the index) and in the
+ * second (bit zero).
+ */
+enum {
+	SET_UNION      = 0xE,
+	SET_INTERSECT  = 0x8,
+	SET_DIFFERENCE = 0x4,
+	SET_COMPLEMENT = 0x3
+};
+
+static bool
+push(kdgu_set *s, uint32_t c)
+{
+	if (s->len == s->alloc) {
+		unsigned n = s->alloc ? s->alloc * 2 : 8;
+		uint32_t *p = realloc(s->r, n * sizeof *p);
+		if (!p) return false;
+		s->r = p, s->alloc = n;
+	}
+
+	s->r[s->len++] = c;
+	return true;
+}
+
+/* Fills in the bitmap from the list. */
+static void
+sync(kdgu_set *s)
+{
+	memset(s->bits, 0, sizeof s->bits);
+
+	for (unsigned i = 0; i < s->len && s->r[i] < 0x100; i += 2) {
+		uint32_t end = s->r[i + 1] < 0x100 ? s->r[i + 1] : 0x100;
+		for (uint32_t c = s->r[i]; c < end; c++)
+			s->bits[c / 64] |= (uint64_t)1 << c % 64;
+	}
+}
+
+/*
+ * Merges the list `r' of `n' boundaries into `s' a run at a time,
+ * keeping whatever `op' says to keep.
+ */
+static bool
+combine(kdgu_set *s, const uint32_t *r, unsigned n, int op)
+{
+	kdgu_set out = { .len = 0 };
+	unsigned i = 0, j = 0;
+	bool in = op & 1;
+
+	if (in && !push(&out, 0)) return false;
+
+	for (;;) {
+		uint32_t a = i < s->len ? s->r[i] : SET_END;
+		uint32_t b = j < n ? r[j] : SET_END;
+		uint32_t c = a < b ? a : b;
+		if (c >= SET_END) break;
+
+		if (a == c) i++;
+		if (b == c) j++;
+
+		bool now = op >> ((i & 1) << 1 | (j & 1)) & 1;
+		if (now == in) continue;
+		in = now;
+
+		/* A complement that starts at 0 takes back the first 0. */
+		if (out.len && out.r[out.len - 1] == c) out.len--;
+		else if (!push(&out, c)) return free(out.r), false;
+	}
+
+	if (in && !push(&out, SET_END)) return free(out.r), false;
+
+	free(s->r);
+	s->r = out.r, s->len = out.len, s->alloc = out.alloc;
+	sync(s);
+
+	return true;
+}
+
+kdgu_set *
+kdgu_setnew(void)
+{
+	kdgu_set *s = malloc(sizeof *s);
+	if (!s) return NULL;
+	memset(s, 0, sizeof *s);
+	return s;
+}
+
+kdgu_set *
+kdgu_setcopy(const kdgu_set *s)
+{
+	if (!s) return NULL;
+
+	kdgu_set *r = kdgu_setnew();
+	if (!r) return NULL;
+	memcpy(r->bits, s->bits, sizeof r->bits);
+	if (!s->len) return r;
+
+	r->r = malloc(s->len * sizeof *r->r);
+	if (!r->r) return free(r), NULL;
+	memcpy(r->r, s->r, s->len * sizeof *r->r);
+	r->len = r->alloc = s->len;
+
+	return r;
+}
+
+kdgu_set *
+kdgu_setrange(uint32_t a, uint32_t b)
+{
+	kdgu_set *s = kdgu_setnew();
+	if (!s) return NULL;
+	if (!kdgu_setadd(s, a, b)) return kdgu_setfree(s), NULL;
+	return s;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Takes the graphemes of `k' that are a single code point, the same
+ * characters kdgu_contains() would find.
+ */
+kdgu_set *
+kdgu_setstr(const kdgu *k)
+{
+	kdgu_set *s = kdgu_setnew();
+	if (!s || !k) return s;
+
+	uint32_t *c = malloc(k->len * sizeof *c);
+	unsigned n = 0;
+	if (!c && k->len) return kdgu_setfree(s), NULL;
+
+	for (kdgu_chriter g = kdgu_chrbegin(k, 0); kdgu_chrnext(&g);) {
+		kdgu_iter it = kdgu_iterbegin(k, g.off);
+		if (kdgu_iternext(&it) && it.len == g.len && it.c < SET_END)
+			c[n++] = it.c;
+	}
+
+	qsort(c, n, sizeof *c, cmp);
+
+	/* Sorted, the code points go straight into the list. */
+	for (unsigned i = 0; i < n; i++) {
+		if (s->len && s->r[s->len - 1] == c[i]) {
+			s->r[s->len - 1]++;
+			continue;
+		}
+
+		if (s->len && s->r[s->len - 1] > c[i]) continue;
+
+		if (!push(s, c[i]) || !push(s, c[i] + 1)) {
+			free(c);
+			return kdgu_setfree(s), NULL;
+		}
+	}
+
+	free(c);
+	sync(s);
+
+	return s;
+}
+
+/*
+ * Builds a set from a property of `struct codepoint'. A block of 256
+ * code points that shares its stage two entries with the one before
+ * it has the same properties, so it's only looked at again if the
+ * block before it wasn't all in or all out of the set.
+ */
+static kdgu_set *
+property(bool (*has)(const struct codepoint *, unsigned), unsigned arg)
+{
+	kdgu_set *s = kdgu_setnew();
+	if (!s) return NULL;
+
+	bool in = false, mixed = true;
+
+	for (uint32_t c = 0; c < SET_END; c++) {
+		if (c % 256 == 0 && c >= 0x200 && !mixed
+		    && stage1[c / 256] == stage1[c / 256 - 1]) {
+			c += 255;
+			continue;
+		}
+
+		if (c % 256 == 0) mixed = false;
+		if (has(lookup_codepoint(c), arg) == in) continue;
+
+		if (!push(s, c)) return kdgu_setfree(s), NULL;
+		in = !in;
+		if (c % 256) mixed = true;
+	}
+
+	if (in && !push(s, SET_END)) return kdgu_setfree(s), NULL;
+	sync(s);
+
+	return s;
+}
+
+static bool
+has_category(const struct codepoint *cp, unsigned cat)
+{
+	return cp_category(cp) & cat;
+}
+
+static bool
+has_script(const struct codepoint *cp, unsigned script)
+{
+	return cp->script == script;
+}
+
+/* Takes every code point in any of the categories in `cat'. */
+kdgu_set *
+kdgu_setcategory(uint32_t cat)
+{
+	return property(has_category, cat);
+}
+
+kdgu_set *
+kdgu_setscript(enum script script)
+{
+	return property(has_script, script);
+}
+
+bool
+kdgu_setadd(kdgu_set *s, uint32_t a, uint32_t b)
+{
+	if (!s || a > b || a >= SET_END) return false;
+	if (b >= SET_END) b = SET_END - 1;
+
+	/* Adding to the end of the list is the common case. */
+	if (!s->len || s->r[s->len - 1] < a) {
+		if (!push(s, a) || !push(s, b + 1)) return false;
+		if (a < 0x100) sync(s);
+		return true;
+	}
+
+	return combine(s, (uint32_t []){ a, b + 1 }, 2, SET_UNION);
+}
+
+bool
+kdgu_setunion(kdgu_set *s, const kdgu_set *t)
+{
+	if (!s || !t) return false;
+	return combine(s, t->r, t->len, SET_UNION);
+}
+
+bool
+kdgu_setintersect(kdgu_set *s, const kdgu_set *t)
+{
+	if (!s || !t) return false;
+	return combine(s, t->r, t->len, SET_INTERSECT);
+}
+
+bool
+kdgu_setdiff(kdgu_set *s, const kdgu_set *t)
+{
+	if (!s || !t) return false;
+	return combine(s, t->r, t->len, SET_DIFFERENCE);
+}
+
+bool
+kdgu_setcomplement(kdgu_set *s)
+{
+	if (!s) return false;
+	return combine(s, NULL, 0, SET_COMPLEMENT);
+}
+
+bool
+kdgu_sethas(const kdgu_set *s, uint32_t c)
+{
+	if (!s) return false;
+	if (c < 0x100) return s->bits[c / 64] >> c % 64 & 1;
+
+	/* It's in the set if an odd number of boundaries are <= c. */
+	unsigned lo = 0, hi = s->len;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (s->r[mid] <= c) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo & 1;
+}
+
+void
+kdgu_setfree(kdgu_set *s)
+{
+	if (!s) return;
+	free(s->r);
+	free(s);
+}
@@ -0,0 +1,639 @@
+#include <string.h>
+
+#include "kdgu.h"
+#include "simd.h"
+#include "unicode.h"
+#include "utf8.h"
+#include "utf32.h"
+
+#if defined __GNUC__ && defined __x86_64__
+#define X86
+#include <immintrin.h>
+#define SSE __attribute__((target("sse4.2")))
+#define AVX __attribute__((target("avx2")))
+#endif
+
+/*
+ * The scalar kernels work everywhere. They only bother with the
+ * cases that are cheap to spot a word at a time and leave the rest to
+ * the per-code point loops in transcode.c.
+ */
+
+static size_t
+ascii_scalar(const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, s + i, 8);
+		if (w & UINT64_C(0x8080808080808080)) break;
+	}
+
+	while (i < len && s[i] < 0x80) i++;
+	return i;
+}
+
+static size_t
+utf8_wide_scalar(uint8_t *d, size_t *j,
+                 const uint8_t *s, size_t len, int width, int endian)
+{
+	size_t n = ascii_scalar(s, len);
+	uint8_t *p = d + *j;
+
+	/* The high bytes of every unit are zero. */
+	memset(p, 0, n * width);
+	for (size_t i = 0; i < n; i++)
+		p[i * width + (endian == KDGU_ENDIAN_LITTLE
+		               ? 0 : width - 1)] = s[i];
+
+	*j += n * width;
+	return n;
+}
+
+static size_t
+none(uint8_t *d, size_t *j, const uint8_t *s, size_t len, int a, int b)
+{
+	(void)d, (void)j, (void)s, (void)len, (void)a, (void)b;
+	return 0;
+}
+
+static size_t
+swap16_scalar(uint8_t *d, const uint8_t *s, size_t len)
+{
+	len &= ~(size_t)1;
+	for (size_t i = 0; i < len; i += 2)
+		d[i] = s[i + 1], d[i + 1] = s[i];
+	return len;
+}
+
+static size_t
+swap32_scalar(uint8_t *d, const uint8_t *s, size_t len)
+{
+	len &= ~(size_t)3;
+	for (size_t i = 0; i < len; i += 4) {
+		d[i]     = s[i + 3];
+		d[i + 1] = s[i + 2];
+		d[i + 2] = s[i + 1];
+		d[i + 3] = s[i];
+	}
+	return len;
+}
+
+static size_t
+utf16_plain_scalar(const uint8_t *s, size_t len, int endian)
+{
+	size_t i = 0, hi = endian == KDGU_ENDIAN_LITTLE;
+	while (i + 2 <= len && (s[i + hi] & 0xF8) != 0xD8) i += 2;
+	return i;
+}
+
+static size_t
+utf32_plain_scalar(const uint8_t *s, size_t len, int endian)
+{
+	size_t i = 0;
+	while (i + 4 <= len && !is_noncharacter(READUTF32(endian, s + i)))
+		i += 4;
+	return i;
+}
+
+/*
+ * A byte b below 0x80 is in [lo, hi] when b + 0x80 - lo has its top
+ * bit set and b + 0x7F - hi doesn't. Neither sum can carry into the
+ * next byte, so eight bytes are checked at once.
+ */
+static size_t
+ascii_case_scalar(uint8_t *d, const uint8_t *s, size_t len, int upper)
+{
+	const uint64_t ones = UINT64_C(0x0101010101010101);
+	uint8_t lo = upper ? 'a' : 'A', hi = upper ? 'z' : 'Z';
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, s + i, 8);
+		if (w & ones * 0x80) break;
+
+		uint64_t m = (w + ones * (0x80 - lo)) ^ (w + ones * (0x7F - hi));
+		w ^= (m & ones * 0x80) >> 2;
+		memcpy(d + i, &w, 8);
+	}
+
+	for (; i < len && s[i] < 0x80; i++)
+		d[i] = s[i] ^ (s[i] >= lo && s[i] <= hi) << 5;
+
+	return i;
+}
+
+struct kernels kernels = {
+	ascii_scalar,
+	utf8_wide_scalar,
+	none,
+	none,
+	none,
+	none,
+	swap16_scalar,
+	swap32_scalar,
+	utf16_plain_scalar,
+	utf32_plain_scalar,
+	ascii_case_scalar
+};
+
+#ifdef X86
+
+/*
+ * SSE4.2 kernels. Everything here works on 16 bytes at a time and
+ * gives up on the first block it doesn't have a special case for.
+ */
+
+SSE static inline __m128i
+swab16(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+SSE static inline __m128i
+swab32(__m128i v)
+{
+	return _mm_shuffle_epi8(v, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+	                                         11, 10, 9, 8,
+	                                         15, 14, 13, 12));
+}
+
+/* Stores the eight 16-bit lanes of `v' as UTF-16 or UTF-32. */
+SSE static inline void
+store_units(uint8_t *d, __m128i v, int width, int endian)
+{
+	if (width == 2) {
+		if (endian == KDGU_ENDIAN_BIG) v = swab16(v);
+		_mm_storeu_si128((__m128i *)d, v);
+		return;
+	}
+
+	__m128i lo = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+	__m128i hi = _mm_unpackhi_epi16(v, _mm_setzero_si128());
+
+	if (endian == KDGU_ENDIAN_BIG)
+		lo = swab32(lo), hi = swab32(hi);
+
+	_mm_storeu_si128((__m128i *)d, lo);
+	_mm_storeu_si128((__m128i *)(d + 16), hi);
+}
+
+SSE static size_t
+ascii_sse(const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		unsigned m = _mm_movemask_epi8(v);
+		if (m) return i + __builtin_ctz(m);
+	}
+
+	return i + ascii_scalar(s + i, len - i);
+}
+
+/*
+ * Handles blocks of ASCII, blocks of eight two-byte sequences and
+ * blocks of four three-byte sequences. Anything malformed in any way
+ * is left for `next_utf8()' to turn down.
+ */
+SSE static size_t
+utf8_wide_sse(uint8_t *d, size_t *j,
+              const uint8_t *s, size_t len, int width, int endian)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		unsigned m = _mm_movemask_epi8(v);
+
+		/*
+		 * Widen the whole block even if only a prefix of it is
+		 * ASCII; there's room for it and the rest is rewritten
+		 * by whatever comes next.
+		 */
+		if ((m & 1) == 0) {
+			unsigned n = m ? (unsigned)__builtin_ctz(m) : 16;
+			store_units(d + *j, _mm_unpacklo_epi8(v, zero),
+			            width, endian);
+			store_units(d + *j + 8 * width,
+			            _mm_unpackhi_epi8(v, zero),
+			            width, endian);
+			i += n, *j += n * width;
+			continue;
+		}
+
+		unsigned cont = _mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xC0)),
+			               _mm_set1_epi8((char)0x80)));
+
+		if (cont == 0xAAAA
+		    && (i + 16 == len || !UTF8CONT(s[i + 16]))) {
+			unsigned lead = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xE0)),
+				               _mm_set1_epi8((char)0xC0)));
+			unsigned over = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(0x1E)),
+				               zero));
+			if (((lead & ~over) & 0x5555) != 0x5555) break;
+
+			/* Each 16-bit lane holds a lead and its continuation. */
+			__m128i c = _mm_or_si128(
+				_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x1F)), 6),
+				_mm_and_si128(_mm_srli_epi16(v, 8), _mm_set1_epi16(0x3F)));
+
+			store_units(d + *j, c, width, endian);
+			i += 16, *j += 8 * width;
+			continue;
+		}
+
+		if ((cont & 0x1FFF) == 0x0DB6) {
+			unsigned lead = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xF0)),
+				               _mm_set1_epi8((char)0xE0)));
+			if ((lead & 0x249) != 0x249) break;
+
+			/* Give every sequence a 32-bit lane of its own. */
+			__m128i t = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, -1,
+			                                              3, 4, 5, -1,
+			                                              6, 7, 8, -1,
+			                                              9, 10, 11, -1));
+			__m128i c = _mm_or_si128(
+				_mm_slli_epi32(_mm_and_si128(t, _mm_set1_epi32(0x0F)), 12),
+				_mm_or_si128(
+					_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(t, 8),
+					                             _mm_set1_epi32(0x3F)), 6),
+					_mm_and_si128(_mm_srli_epi32(t, 16),
+					              _mm_set1_epi32(0x3F))));
+
+			store_units(d + *j, _mm_packus_epi32(c, zero),
+			            width, endian);
+			i += 12, *j += 4 * width;
+			continue;
+		}
+
+		break;
+	}
+
+	return i;
+}
+
+SSE static size_t
+utf16_utf8_sse(uint8_t *d, size_t *j,
+               const uint8_t *s, size_t len, int endian, int unused)
+{
+	size_t i = 0;
+	(void)unused;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (endian == KDGU_ENDIAN_BIG) v = swab16(v);
+		if (!_mm_testz_si128(v, _mm_set1_epi16((short)0xFF80))) break;
+		_mm_storel_epi64((__m128i *)(d + *j), _mm_packus_epi16(v, v));
+		*j += 8;
+	}
+
+	return i;
+}
+
+SSE static size_t
+utf16_utf32_sse(uint8_t *d, size_t *j,
+                const uint8_t *s, size_t len, int from, int to)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (from == KDGU_ENDIAN_BIG) v = swab16(v);
+
+		__m128i sur = _mm_cmpeq_epi16(
+			_mm_and_si128(v, _mm_set1_epi16((short)0xF800)),
+			_mm_set1_epi16((short)0xD800));
+		if (_mm_movemask_epi8(sur)) break;
+
+		store_units(d + *j, v, 4, to);
+		*j += 32;
+	}
+
+	return i;
+}
+
+SSE static size_t
+utf32_utf8_sse(uint8_t *d, size_t *j,
+               const uint8_t *s, size_t len, int endian, int unused)
+{
+	size_t i = 0;
+	(void)unused;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (endian == KDGU_ENDIAN_BIG) v = swab32(v);
+		if (!_mm_testz_si128(v, _mm_set1_epi32(~0x7F))) break;
+
+		v = _mm_packus_epi32(v, v);
+		uint32_t w = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+		memcpy(d + *j, &w, 4);
+		*j += 4;
+	}
+
+	return i;
+}
+
+SSE static size_t
+utf32_utf16_sse(uint8_t *d, size_t *j,
+                const uint8_t *s, size_t len, int from, int to)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (from == KDGU_ENDIAN_BIG) v = swab32(v);
+
+		/* Only the BMP outside of the surrogates. */
+		__m128i sur = _mm_cmpeq_epi32(
+			_mm_and_si128(v, _mm_set1_epi32(0xFFFFF800)),
+			_mm_set1_epi32(0xD800));
+		if (!_mm_testz_si128(v, _mm_set1_epi32(0xFFFF0000))
+		    || _mm_movemask_epi8(sur))
+			break;
+
+		v = _mm_packus_epi32(v, v);
+		if (to == KDGU_ENDIAN_BIG) v = swab16(v);
+		_mm_storel_epi64((__m128i *)(d + *j), v);
+		*j += 8;
+	}
+
+	return i;
+}
+
+SSE static size_t
+swap16_sse(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *)(d + i),
+		                 swab16(_mm_loadu_si128((const __m128i *)(s + i))));
+
+	return i + swap16_scalar(d + i, s + i, len - i);
+}
+
+SSE static size_t
+swap32_sse(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *)(d + i),
+		                 swab32(_mm_loadu_si128((const __m128i *)(s + i))));
+
+	return i + swap32_scalar(d + i, s + i, len - i);
+}
+
+SSE static size_t
+utf16_plain_sse(const uint8_t *s, size_t len, int endian)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (endian != KDGU_ENDIAN_LITTLE) v = swab16(v);
+
+		__m128i sur = _mm_cmpeq_epi16(
+			_mm_and_si128(v, _mm_set1_epi16((short)0xF800)),
+			_mm_set1_epi16((short)0xD800));
+		if (_mm_movemask_epi8(sur)) break;
+	}
+
+	return i + utf16_plain_scalar(s + i, len - i, endian);
+}
+
+/*
+ * This flags a few more code points than `is_noncharacter()' does
+ * (all of U+FDC0..U+FDFF, and the last two of every 64K block even
+ * past U+10FFFF); the scalar loop sorts them out.
+ */
+SSE static size_t
+utf32_plain_sse(const uint8_t *s, size_t len, int endian)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (endian != KDGU_ENDIAN_LITTLE) v = swab32(v);
+
+		__m128i a = _mm_cmpeq_epi32(
+			_mm_and_si128(v, _mm_set1_epi32(0xFFFE)),
+			_mm_set1_epi32(0xFFFE));
+		__m128i b = _mm_cmpeq_epi32(
+			_mm_and_si128(v, _mm_set1_epi32(0xFFFFFFC0)),
+			_mm_set1_epi32(0xFDC0));
+		if (_mm_movemask_epi8(_mm_or_si128(a, b))) break;
+	}
+
+	return i + utf32_plain_scalar(s + i, len - i, endian);
+}
+
+SSE static size_t
+ascii_case_sse(uint8_t *d, const uint8_t *s, size_t len, int upper)
+{
+	__m128i lo = _mm_set1_epi8(upper ? 'a' - 1 : 'A' - 1);
+	__m128i hi = _mm_set1_epi8(upper ? 'z' + 1 : 'Z' + 1);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (_mm_movemask_epi8(v)) break;
+
+		__m128i m = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+		                          _mm_cmplt_epi8(v, hi));
+		v = _mm_xor_si128(v, _mm_and_si128(m, _mm_set1_epi8(0x20)));
+		_mm_storeu_si128((__m128i *)(d + i), v);
+	}
+
+	return i + ascii_case_scalar(d + i, s + i, len - i, upper);
+}
+
+static const struct kernels sse_kernels = {
+	ascii_sse,
+	utf8_wide_sse,
+	utf16_utf8_sse,
+	utf16_utf32_sse,
+	utf32_utf8_sse,
+	utf32_utf16_sse,
+	swap16_sse,
+	swap32_sse,
+	utf16_plain_sse,
+	utf32_plain_sse,
+	ascii_case_sse
+};
+
+/*
+ * AVX2 kernels. The ASCII paths and the byte swaps are twice as wide
+ * as their SSE counterparts; the multibyte UTF-8 blocks and the
+ * UTF-16 <-> UTF-32 paths just use the SSE kernels.
+ */
+
+AVX static inline __m256i
+swab16_avx(__m256i v)
+{
+	return _mm256_or_si256(_mm256_slli_epi16(v, 8),
+	                       _mm256_srli_epi16(v, 8));
+}
+
+AVX static inline __m256i
+swab32_avx(__m256i v)
+{
+	return _mm256_shuffle_epi8(v, _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+	                                               11, 10, 9, 8,
+	                                               15, 14, 13, 12,
+	                                               3, 2, 1, 0, 7, 6, 5, 4,
+	                                               11, 10, 9, 8,
+	                                               15, 14, 13, 12));
+}
+
+AVX static size_t
+ascii_avx(const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		unsigned m = _mm256_movemask_epi8(v);
+		if (m) return i + __builtin_ctz(m);
+	}
+
+	return i + ascii_sse(s + i, len - i);
+}
+
+AVX static size_t
+utf8_wide_avx(uint8_t *d, size_t *j,
+              const uint8_t *s, size_t len, int width, int endian)
+{
+	size_t i = 0;
+
+	for (;;) {
+		for (; i + 32 <= len; i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+			if (_mm256_movemask_epi8(v)) break;
+
+			/* Every store writes 32 bytes of code units. */
+			for (unsigned k = 0; k < 32; k += 32 / width) {
+				__m256i u;
+
+				if (width == 2) {
+					u = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(s + i + k)));
+					if (endian == KDGU_ENDIAN_BIG) u = swab16_avx(u);
+				} else {
+					u = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(s + i + k)));
+					if (endian == KDGU_ENDIAN_BIG) u = swab32_avx(u);
+				}
+
+				_mm256_storeu_si256((__m256i *)(d + *j), u);
+				*j += 32;
+			}
+		}
+
+		size_t n = utf8_wide_sse(d, j, s + i, len - i, width, endian);
+		if (!n) break;
+		i += n;
+	}
+
+	return i;
+}
+
+AVX static size_t
+utf16_utf8_avx(uint8_t *d, size_t *j,
+               const uint8_t *s, size_t len, int endian, int unused)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		if (endian == KDGU_ENDIAN_BIG) v = swab16_avx(v);
+		if (!_mm256_testz_si256(v, _mm256_set1_epi16((short)0xFF80)))
+			break;
+
+		_mm_storeu_si128((__m128i *)(d + *j),
+		                 _mm_packus_epi16(_mm256_castsi256_si128(v),
+		                                  _mm256_extracti128_si256(v, 1)));
+		*j += 16;
+	}
+
+	return i + utf16_utf8_sse(d, j, s + i, len - i, endian, unused);
+}
+
+AVX static size_t
+swap16_avx(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i *)(d + i),
+		                    swab16_avx(_mm256_loadu_si256((const __m256i *)(s + i))));
+
+	return i + swap16_sse(d + i, s + i, len - i);
+}
+
+AVX static size_t
+swap32_avx(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i *)(d + i),
+		                    swab32_avx(_mm256_loadu_si256((const __m256i *)(s + i))));
+
+	return i + swap32_sse(d + i, s + i, len - i);
+}
+
+AVX static size_t
+ascii_case_avx(uint8_t *d, const uint8_t *s, size_t len, int upper)
+{
+	__m256i lo = _mm256_set1_epi8(upper ? 'a' - 1 : 'A' - 1);
+	__m256i hi = _mm256_set1_epi8(upper ? 'z' + 1 : 'Z' + 1);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		if (_mm256_movemask_epi8(v)) break;
+
+		__m256i m = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+		                             _mm256_cmpgt_epi8(hi, v));
+		v = _mm256_xor_si256(v, _mm256_and_si256(m,
+		                                         _mm256_set1_epi8(0x20)));
+		_mm256_storeu_si256((__m256i *)(d + i), v);
+	}
+
+	return i + ascii_case_sse(d + i, s + i, len - i, upper);
+}
+
+static const struct kernels avx_kernels = {
+	ascii_avx,
+	utf8_wide_avx,
+	utf16_utf8_avx,
+	utf16_utf32_sse,
+	utf32_utf8_sse,
+	utf32_utf16_sse,
+	swap16_avx,
+	swap32_avx,
+	utf16_plain_sse,
+	utf32_plain_sse,
+	ascii_case_avx
+};
+
+__attribute__((constructor)) static void
+select_kernels(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		kernels = avx_kernels;
+	else if (__builtin_cpu_supports("sse4.2"))
+		kernels = sse_kernels;
+}
+
+#endif
@@ -0,0 +1,307 @@
+#include <string.h>
+
+#include "kdgu.h"
+#include "transcode.h"
+#include "simd.h"
+#include "unicode.h"
+#include "utf8.h"
+#include "utf16.h"
+#include "utf32.h"
+
+/*
+ * Every decoder reads one code point from `s' at `*i' and every
+ * encoder writes one to `d' at `*j'; they return false without
+ * touching anything when they can't. The endianness is a constant in
+ * every caller, so each of the transcoders below ends up with its own
+ * straight-line copy of the pair it uses.
+ */
+
+static inline bool
+next_utf8(const uint8_t *s, size_t len, size_t *i, uint32_t *c)
+{
+	uint8_t b = s[*i];
+
+	if (b < 0x80) {
+		*c = b, (*i)++;
+		return true;
+	}
+
+	/*
+	 * Anything that isn't well-formed goes to `kdgu_decode()' so
+	 * that it's read the same way everywhere.
+	 */
+	if (b < 0xC2 || b > 0xF4) return false;
+	unsigned l = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : 2;
+	if (*i + l > len) return false;
+	if (*i + l < len && UTF8CONT(s[*i + l])) return false;
+
+	*c = b & (0x7F >> l);
+	for (unsigned k = 1; k < l; k++) {
+		if (!UTF8CONT(s[*i + k])) return false;
+		*c = *c << 6 | (s[*i + k] & 0x3F);
+	}
+
+	*i += l;
+	return true;
+}
+
+static inline bool
+next_utf16(const uint8_t *s, size_t len, size_t *i, uint32_t *c,
+           int endian)
+{
+	if (*i + 2 > len) return false;
+	uint16_t d = READUTF16(endian, s + *i);
+
+	if (!UTF16HIGH_SURROGATE(d) && !UTF16LOW_SURROGATE(d)) {
+		*c = d, *i += 2;
+		return true;
+	}
+
+	if (!UTF16HIGH_SURROGATE(d) || *i + 4 > len) return false;
+	uint16_t e = READUTF16(endian, s + *i + 2);
+	if (!UTF16LOW_SURROGATE(e)) return false;
+
+	*c = (d - 0xD800) * 0x400 + e - 0xDC00 + 0x10000;
+	*i += 4;
+	return true;
+}
+
+static inline bool
+next_utf32(const uint8_t *s, size_t len, size_t *i, uint32_t *c,
+           int endian)
+{
+	if (*i + 4 > len) return false;
+	uint32_t d = READUTF32(endian, s + *i);
+	if (d > 0x10FFFF || (d >= 0xD800 && d <= 0xDFFF)) return false;
+	*c = d, *i += 4;
+	return true;
+}
+
+static inline bool
+put_utf8(uint8_t *d, size_t *j, uint32_t c)
+{
+	if (c > 0x10FFFF) return false;
+
+	if (c < 0x80) {
+		d[(*j)++] = c;
+	} else if (c < 0x800) {
+		d[(*j)++] = 0xC0 | c >> 6;
+		d[(*j)++] = 0x80 | (c & 0x3F);
+	} else if (c < 0x10000) {
+		d[(*j)++] = 0xE0 | c >> 12;
+		d[(*j)++] = 0x80 | (c >> 6 & 0x3F);
+		d[(*j)++] = 0x80 | (c & 0x3F);
+	} else {
+		d[(*j)++] = 0xF0 | c >> 18;
+		d[(*j)++] = 0x80 | (c >> 12 & 0x3F);
+		d[(*j)++] = 0x80 | (c >> 6 & 0x3F);
+		d[(*j)++] = 0x80 | (c & 0x3F);
+	}
+
+	return true;
+}
+
+static inline void
+put16(uint8_t *d, uint16_t c, int endian)
+{
+	if (endian == KDGU_ENDIAN_LITTLE) {
+		d[0] = c & 0xFF, d[1] = c >> 8;
+	} else {
+		d[0] = c >> 8, d[1] = c & 0xFF;
+	}
+}
+
+static inline bool
+put_utf16(uint8_t *d, size_t *j, uint32_t c, int endian)
+{
+	if (c < 0x10000) {
+		put16(d + *j, c, endian), *j += 2;
+		return true;
+	}
+
+	/* `utf16encode()' refuses these, so we leave them to it. */
+	if (c > 0x10FFFF || is_noncharacter(c)) return false;
+
+	c -= 0x10000;
+	put16(d + *j, 0xD800 + (c >> 10), endian);
+	put16(d + *j + 2, 0xDC00 + (c & 0x3FF), endian);
+	*j += 4;
+
+	return true;
+}
+
+static inline bool
+put_utf32(uint8_t *d, size_t *j, uint32_t c, int endian)
+{
+	if (endian == KDGU_ENDIAN_LITTLE) {
+		d[*j]     = c & 0xFF;
+		d[*j + 1] = c >> 8 & 0xFF;
+		d[*j + 2] = c >> 16 & 0xFF;
+		d[*j + 3] = c >> 24;
+	} else {
+		d[*j]     = c >> 24;
+		d[*j + 1] = c >> 16 & 0xFF;
+		d[*j + 2] = c >> 8 & 0xFF;
+		d[*j + 3] = c & 0xFF;
+	}
+
+	*j += 4;
+	return true;
+}
+
+#define next_utf16le(S,L,I,C) next_utf16(S, L, I, C, KDGU_ENDIAN_LITTLE)
+#define next_utf16be(S,L,I,C) next_utf16(S, L, I, C, KDGU_ENDIAN_BIG)
+#define next_utf32le(S,L,I,C) next_utf32(S, L, I, C, KDGU_ENDIAN_LITTLE)
+#define next_utf32be(S,L,I,C) next_utf32(S, L, I, C, KDGU_ENDIAN_BIG)
+#define put_utf16le(D,J,C) put_utf16(D, J, C, KDGU_ENDIAN_LITTLE)
+#define put_utf16be(D,J,C) put_utf16(D, J, C, KDGU_ENDIAN_BIG)
+#define put_utf32le(D,J,C) put_utf32(D, J, C, KDGU_ENDIAN_LITTLE)
+#define put_utf32be(D,J,C) put_utf32(D, J, C, KDGU_ENDIAN_BIG)
+
+/*
+ * The bulk kernel gets first go at the input. Whatever it stops at
+ * is converted a code point at a time until we're a block further on,
+ * and then the kernel gets another try.
+ */
+#define TRANSCODER(X,Y,BULK,A,B)	  \
+	static size_t \
+	X##_to_##Y(uint8_t *dst, size_t *n, \
+	           const uint8_t *s, size_t len) \
+	{ \
+		size_t i = 0, j = 0; \
+		while (i < len) { \
+			i += kernels.BULK(dst, &j, s + i, len - i, A, B); \
+			for (size_t end = i + 16; i < len && i < end;) { \
+				size_t now = i; \
+				uint32_t c; \
+				if (!next_##X(s, len, &i, &c) \
+				    || !put_##Y(dst, &j, c)) { \
+					i = now; \
+					goto done; \
+				} \
+			} \
+		} \
+	done: \
+		return *n = j, i; \
+	}
+
+#define LE KDGU_ENDIAN_LITTLE
+#define BE KDGU_ENDIAN_BIG
+
+TRANSCODER(utf8, utf16le, utf8_wide, 2, LE)
+TRANSCODER(utf8, utf16be, utf8_wide, 2, BE)
+TRANSCODER(utf8, utf32le, utf8_wide, 4, LE)
+TRANSCODER(utf8, utf32be, utf8_wide, 4, BE)
+TRANSCODER(utf16le, utf8, utf16_utf8, LE, 0)
+TRANSCODER(utf16le, utf32le, utf16_utf32, LE, LE)
+TRANSCODER(utf16le, utf32be, utf16_utf32, LE, BE)
+TRANSCODER(utf16be, utf8, utf16_utf8, BE, 0)
+TRANSCODER(utf16be, utf32le, utf16_utf32, BE, LE)
+TRANSCODER(utf16be, utf32be, utf16_utf32, BE, BE)
+TRANSCODER(utf32le, utf8, utf32_utf8, LE, 0)
+TRANSCODER(utf32le, utf16le, utf32_utf16, LE, LE)
+TRANSCODER(utf32le, utf16be, utf32_utf16, LE, BE)
+TRANSCODER(utf32be, utf8, utf32_utf8, BE, 0)
+TRANSCODER(utf32be, utf16le, utf32_utf16, BE, LE)
+TRANSCODER(utf32be, utf16be, utf32_utf16, BE, BE)
+
+/*
+ * Changing the byte order doesn't need to look at the code points at
+ * all, so lone surrogates and the like are carried over as they are.
+ */
+
+static size_t
+swap16(uint8_t *dst, size_t *n, const uint8_t *s, size_t len)
+{
+	return *n = kernels.swap16(dst, s, len);
+}
+
+static size_t
+swap32(uint8_t *dst, size_t *n, const uint8_t *s, size_t len)
+{
+	return *n = kernels.swap32(dst, s, len);
+}
+
+enum {
+	UTF8,
+	UTF16LE,
+	UTF16BE,
+	UTF32LE,
+	UTF32BE,
+	NONE
+};
+
+static int
+kind(enum fmt fmt)
+{
+	switch (fmt) {
+	case KDGU_FMT_UTF8:    return UTF8;
+	case KDGU_FMT_UTF16LE: return UTF16LE;
+	case KDGU_FMT_UTF16BE:
+	case KDGU_FMT_UTF16:   return UTF16BE;
+	case KDGU_FMT_UTF32LE: return UTF32LE;
+	case KDGU_FMT_UTF32BE:
+	case KDGU_FMT_UTF32:   return UTF32BE;
+	default:               return NONE;
+	}
+}
+
+static transcoder *transcoders[5][5] = {
+	[UTF8] = {
+		[UTF16LE] = utf8_to_utf16le,
+		[UTF16BE] = utf8_to_utf16be,
+		[UTF32LE] = utf8_to_utf32le,
+		[UTF32BE] = utf8_to_utf32be
+	},
+	[UTF16LE] = {
+		[UTF8]    = utf16le_to_utf8,
+		[UTF16BE] = swap16,
+		[UTF32LE] = utf16le_to_utf32le,
+		[UTF32BE] = utf16le_to_utf32be
+	},
+	[UTF16BE] = {
+		[UTF8]    = utf16be_to_utf8,
+		[UTF16LE] = swap16,
+		[UTF32LE] = utf16be_to_utf32le,
+		[UTF32BE] = utf16be_to_utf32be
+	},
+	[UTF32LE] = {
+		[UTF8]    = utf32le_to_utf8,
+		[UTF16LE] = utf32le_to_utf16le,
+		[UTF16BE] = utf32le_to_utf16be,
+		[UTF32BE] = swap32
+	},
+	[UTF32BE] = {
+		[UTF8]    = utf32be_to_utf8,
+		[UTF16LE] = utf32be_to_utf16le,
+		[UTF16BE] = utf32be_to_utf16be,
+		[UTF32LE] = swap32
+	}
+};
+
+transcoder *
+get_transcoder(enum fmt from, enum fmt to)
+{
+	int a = kind(from), b = kind(to);
+	if (a == NONE || b == NONE) return NULL;
+	return transcoders[a][b];
+}
+
+/*
+ * Returns an upper bound on the size of `len' bytes of `from' once
+ * they've been converted to `to', assuming the worst possible code
+ * point for every code unit.
+ */
+size_t
+transcode_bound(enum fmt from, enum fmt to, size_t len)
+{
+	size_t unit = from >= KDGU_FMT_UTF32 ? 4
+		: from >= KDGU_FMT_UTF16 ? 2 : 1;
+	size_t units = (len + unit - 1) / unit;
+
+	if (to >= KDGU_FMT_UTF32) return units * 4;
+	if (to >= KDGU_FMT_UTF16) return units * (unit == 4 ? 4 : 2);
+	if (to == KDGU_FMT_UTF8) return units * (unit == 4 ? 4 : 3);
+
+	return units;
+}
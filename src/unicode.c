@@ -8,8 +8,7 @@
 bool
 is_noncharacter(uint32_t c)
 {
-	if (c >= 0xFDD0 && c <= 0xFDEF) return true;
-	for (uint32_t i = 0x0FFFE; i <= 0x10FFFE; i += 0x10000)
-		if (c == i || c == i + 1) return true;
-	return false;
+	/* The last two code points of every plane. */
+	return (c >= 0xFDD0 && c <= 0xFDEF)
+		|| ((c & 0xFFFE) == 0xFFFE && c <= 0x10FFFF);
 }
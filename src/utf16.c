@@ -4,6 +4,7 @@
 #include "utf16.h"
 #include "error.h"
 #include "unicode.h"
+#include "simd.h"
 
 struct error
 utf16encode(uint32_t c, uint8_t *buf, unsigned *len,
@@ -29,10 +30,10 @@ utf16encode(uint32_t c, uint8_t *buf, unsigned *len,
 	if (UTF16HIGH_SURROGATE(high)) {
 		*len = 4;
 		if (endian == KDGU_ENDIAN_LITTLE) {
-			buf[0] = low & 0xFF;
-			buf[1] = (low >> 8) & 0xFF;
-			buf[2] = high & 0xFF;
-			buf[3] = (high >> 8) & 0xFF;
+			buf[0] = high & 0xFF;
+			buf[1] = (high >> 8) & 0xFF;
+			buf[2] = low & 0xFF;
+			buf[3] = (low >> 8) & 0xFF;
 		} else {
 			buf[0] = (high >> 8) & 0xFF;
 			buf[1] = high & 0xFF;
@@ -77,23 +78,30 @@ utf16validatechar(const uint8_t *s, uint8_t *r, unsigned *i,
 
 	/* It's in the surrogate pair range. */
 	uint16_t c2 = READUTF16(endian, s + *i + 2);
-	*i += 4;
 
+	/*
+	 * The replacement has to be a whole code unit and the unit
+	 * after the lone surrogate still has to be looked at.
+	 */
 	if (!UTF16LOW_SURROGATE(c2)) {
-		r[(*idx)++] = KDGU_REPLACEMENT;
+		unsigned len;
+		utf16encode(KDGU_REPLACEMENT, r + *idx, &len, 0, endian);
+		*idx += len, *i += 2;
 		return ERR(ERR_UTF16_MISSING_SURROGATE, *i);
 	}
 
+	*i += 4;
+
 	if (endian == KDGU_ENDIAN_LITTLE) {
 		r[*idx]     = c & 0xFF;
 		r[*idx + 1] = (c & 0xFF00) >> 8;
 		r[*idx + 2] = c2 & 0xFF;
 		r[*idx + 3] = (c2 & 0xFF00) >> 8;
 	} else {
-		r[*idx + 3] = c & 0xFF;
-		r[*idx + 2] = (c & 0xFF00) >> 8;
-		r[*idx + 1] = c2 & 0xFF;
-		r[*idx + 0] = (c2 & 0xFF00) >> 8;
+		r[*idx + 0] = (c & 0xFF00) >> 8;
+		r[*idx + 1] = c & 0xFF;
+		r[*idx + 2] = (c2 & 0xFF00) >> 8;
+		r[*idx + 3] = c2 & 0xFF;
 	}
 
 	*idx += 4;
@@ -101,15 +109,74 @@ utf16validatechar(const uint8_t *s, uint8_t *r, unsigned *i,
 	return err;
 }
 
+/*
+ * Returns the number of bytes at the start of `s' that
+ * utf16validate() would copy through unchanged.
+ */
+size_t
+utf16run(const uint8_t *s, size_t l, int endian)
+{
+	size_t i = 0;
+
+	while ((i += kernels.utf16_plain(s + i, l - i, endian)) + 2 <= l) {
+		/* A low surrogate on its own is let through. */
+		if (!UTF16HIGH_SURROGATE(READUTF16(endian, s + i))) {
+			i += 2;
+			continue;
+		}
+
+		if (i + 4 > l
+		    || !UTF16LOW_SURROGATE(READUTF16(endian, s + i + 2)))
+			break;
+
+		i += 4;
+	}
+
+	return i;
+}
+
+/*
+ * Validates the code units of `s' that start before `end', reading as
+ * far as `*l' to see whether a high surrogate is followed by a low
+ * one. It's for validating a stream a piece at a time.
+ */
 uint8_t *
-utf16validate(kdgu *k, const uint8_t *s, size_t *l, int endian)
+utf16validatepart(kdgu *k, const uint8_t *s, size_t *l, size_t end,
+		  int endian)
 {
-	uint8_t *r = malloc(*l);
+	uint8_t *r = malloc(*l ? *l : 1);
 	if (!r) return NULL;
 
 	unsigned idx = 0;
 	size_t buflen = *l;
 
+	for (unsigned i = 0; i < end;) {
+		/* Code units outside the surrogates are copied as is. */
+		size_t run = kernels.utf16_plain(s + i, end - i, endian);
+		memcpy(r + idx, s + i, run);
+		i += run, idx += run;
+		if (i >= end) break;
+
+		struct error err = utf16validatechar(s,
+						     r,
+						     &i,
+						     &idx,
+						     buflen,
+						     endian);
+		if (!err.kind) continue;
+		if (!pusherror(k, err)) {
+			free(r);
+			return NULL;
+		}
+	}
+
+	*l = idx;
+	return r;
+}
+
+uint8_t *
+utf16validate(kdgu *k, const uint8_t *s, size_t *l, int endian)
+{
 	/*
 	 * Page 41 table 2-4 indicates that the BOM should not appear
 	 * in in the UTF-16BE or UTF-16LE encodings. Simply ignoring
@@ -117,37 +184,24 @@ utf16validate(kdgu *k, const uint8_t *s, size_t *l, int endian)
 	 * zero width space in utf16validatechar.
 	 */
 
-	if (!endian && buflen >= 2) {
+	if (!endian && *l >= 2) {
 		/* Check the BOM. */
 		uint16_t c = (uint8_t)s[1] << 8 | (uint8_t)s[0];
 
 		if (c == (uint16_t)0xFFFE) {
 			endian = KDGU_ENDIAN_LITTLE;
 			s += 2;
-			buflen -= 2;
+			*l -= 2;
 		} else if (c == (uint16_t)0xFEFF) {
 			endian = KDGU_ENDIAN_BIG;
 			s += 2;
-			buflen -= 2;
+			*l -= 2;
 		}
 	}
 
-	for (unsigned i = 0; i < buflen;) {
-		struct error err = utf16validatechar(s,
-						     r,
-						     &i,
-						     &idx,
-						     buflen,
-						     endian);
-		if (!err.kind) continue;
-		if (!pusherror(k, err)) {
-			free(r);
-			return NULL;
-		}
-	}
+	uint8_t *r = utf16validatepart(k, s, l, *l, endian);
 
-	*l = idx;
-	if (k->fmt == KDGU_FMT_UTF16 && endian == KDGU_ENDIAN_LITTLE)
+	if (r && k->fmt == KDGU_FMT_UTF16 && endian == KDGU_ENDIAN_LITTLE)
 		k->fmt = KDGU_FMT_UTF16LE;
 
 	return r;
@@ -5,6 +5,7 @@
 #include "utf32.h"
 #include "error.h"
 #include "unicode.h"
+#include "simd.h"
 
 static struct error
 utf32validatechar(const uint8_t *s, uint8_t *r, unsigned *i,
@@ -54,6 +55,11 @@ utf32validate(kdgu *k, const uint8_t *s, size_t *l, int endian)
 	}
 
 	for (unsigned i = 0; i < buflen;) {
+		size_t run = kernels.utf32_plain(s + i, buflen - i, endian);
+		memcpy(r + idx, s + i, run);
+		i += run, idx += run;
+		if (i >= buflen) break;
+
 		struct error err = utf32validatechar(s,
 						     r,
 						     &i,
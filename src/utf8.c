@@ -5,6 +5,7 @@
 #include "error.h"
 #include "utf8.h"
 #include "unicode.h"
+#include "simd.h"
 
 uint32_t
 utf8decode(const uint8_t *s, unsigned l)
@@ -210,34 +211,129 @@ utf8validatechar(const uint8_t *s,
 	return err;
 }
 
+/*
+ * The length of the well-formed sequence introduced by each byte,
+ * from table 3-7 again. Zero means that the byte never starts a
+ * well-formed sequence.
+ */
+static const uint8_t seqlen[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * Returns the number of bytes at the start of `s' that make up
+ * well-formed sequences that aren't noncharacters, which is exactly
+ * what `utf8validatechar()' would copy through unchanged. `ascii' is
+ * cleared if any of them aren't ASCII.
+ */
+size_t
+utf8run(const uint8_t *s, size_t l, bool *ascii)
+{
+	size_t i = 0;
+
+	while ((i += kernels.ascii(s + i, l - i)) < l) {
+		unsigned len = seqlen[s[i]];
+		uint8_t lo = 0x80, hi = 0xBF;
+
+		*ascii = false;
+		if (!len || i + len > l) break;
+
+		switch (s[i]) {
+		case 0xE0: lo = 0xA0; break;
+		case 0xED: hi = 0x9F; break;
+		case 0xF0: lo = 0x90; break;
+		case 0xF4: hi = 0x8F; break;
+		}
+
+		if (s[i + 1] < lo || s[i + 1] > hi) break;
+		if (len > 2 && !UTF8CONT(s[i + 2])) break;
+		if (len > 3 && !UTF8CONT(s[i + 3])) break;
+		if (len > 2 && is_noncharacter(utf8decode(s + i, len)))
+			break;
+
+		i += len;
+	}
+
+	return i;
+}
+
+/*
+ * Validates the sequences of `s' that start before `end', reading as
+ * far as `*l' to finish the ones that run past it. A failed sequence
+ * takes the continuation bytes after it along, so `skip' says on the
+ * way in whether the ones at the start of `s' belong to a sequence
+ * that failed before, and on the way out whether the ones at the end
+ * do. Both of them are for validating a stream a piece at a time.
+ */
 uint8_t *
-utf8validate(kdgu *k, const uint8_t *s, size_t *l)
+utf8validatepart(kdgu *k, const uint8_t *s, size_t *l, size_t end,
+		 bool *skip)
 {
-	uint8_t *r = malloc(*l);
+	uint8_t *r = malloc(*l ? *l : 1);
 	if (!r) return NULL;
 
-	unsigned idx = 0;
+	unsigned idx = 0, i = 0;
+	size_t len = *l;
+	bool ascii = true, skipping = skip && *skip;
 
-	/* Check for the UTF-8 BOM from 2.13 (Unicode Signature). */
-	if (*l >= 3
-	    && s[0] == (uint8_t)0xEF
-	    && s[1] == (uint8_t)0xBB
-	    && s[2] == (uint8_t)0xBF)
-		s += 3;
+	if (skipping)
+		while (i < end && UTF8CONT(s[i])) i++;
+
+	/*
+	 * Well-formed runs are copied in bulk; only the sequences
+	 * around errors go through `utf8validatechar()'.
+	 */
+	while (i < end) {
+		size_t run = utf8run(s + i, end - i, &ascii);
+		memcpy(r + idx, s + i, run);
+		i += run, idx += run;
+		if (run) skipping = false;
+		if (i >= end) break;
 
-	for (unsigned i = 0; i < *l;) {
 		struct error err = utf8validatechar(s,
 						    r,
 						    &i,
 						    &idx,
-						    l);
+						    &len);
+		skipping = err.kind
+			&& err.kind != ERR_UTF8_STRAY_CONTINUATION_BYTE;
 		if (!err.kind) continue;
 		if (!pusherror(k, err)) {
-			free(r), free(r);
+			free(r);
 			return NULL;
 		}
 	}
 
+	if (skip) *skip = skipping && i == len;
+	if (ascii) k->flags |= KDGU_FLAG_ASCII;
 	*l = idx;
 	return r;
 }
+
+uint8_t *
+utf8validate(kdgu *k, const uint8_t *s, size_t *l)
+{
+	/* Check for the UTF-8 BOM from 2.13 (Unicode Signature). */
+	if (*l >= 3
+	    && s[0] == (uint8_t)0xEF
+	    && s[1] == (uint8_t)0xBB
+	    && s[2] == (uint8_t)0xBF)
+		s += 3, *l -= 3;
+
+	return utf8validatepart(k, s, l, *l, NULL);
+}
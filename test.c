@@ -108,7 +108,7 @@ test_decomp_type(uint32_t c, unsigned expect)
 	assert(cp->decomp_type == expect);
 
 	uint32_t buf[100];
-	unsigned len = write_sequence(buf, codepoint(c)->decomp);
+	unsigned len = write_sequence(buf, cp_mapping(codepoint(c))->decomp);
 	printbuf(buf, len);
 }
 
@@ -148,7 +148,7 @@ print_upper(uint32_t c)
 	uputchar(0x34F), uputchar(c);
 	printf(")   uppercasing:          - ");
 	uint32_t buf[100];
-	unsigned len = write_sequence(buf, codepoint(c)->upper);
+	unsigned len = write_sequence(buf, cp_mapping(codepoint(c))->upper);
 	printbuf(buf, len);
 }
 
@@ -0,0 +1,116 @@
+#include <assert.h>
+
+#include "kdgu.h"
+
+struct out {
+	uint8_t s[256];
+	unsigned len, nerr, total;
+	struct error err[64];
+};
+
+static void
+collect(struct out *o, kdgu *k)
+{
+	assert(k);
+	memcpy(o->s + o->len, k->s, k->len);
+	o->len += k->len;
+
+	for (unsigned i = 0; k->errlist && i < k->errlist->num; i++)
+		o->err[o->nerr++] = *kdgu_geterror(k, i);
+	if (k->errlist) o->total += k->errlist->total;
+
+	kdgu_free(k);
+}
+
+/* Decodes `s' in pieces cut at `cut', or a byte at a time if it's 0. */
+static void
+decode(struct out *o, enum fmt from, enum fmt to, const uint8_t *s,
+       unsigned len, unsigned cut, enum errpolicy policy)
+{
+	kdgu_decoder *d = kdgu_decoder_new_policy(from, to, policy, 4);
+	memset(o, 0, sizeof *o);
+
+	if (cut) {
+		collect(o, kdgu_decoder_push(d, s, cut, false));
+		collect(o, kdgu_decoder_push(d, s + cut, len - cut, true));
+	} else {
+		for (unsigned i = 0; i < len; i++)
+			collect(o, kdgu_decoder_push(d, s + i, 1, false));
+		collect(o, kdgu_decoder_push(d, NULL, 0, true));
+	}
+
+	kdgu_decoder_free(d);
+}
+
+static bool
+same(const struct out *a, const struct out *b)
+{
+	if (a->len != b->len || memcmp(a->s, b->s, a->len)) return false;
+	if (a->nerr != b->nerr || a->total != b->total) return false;
+
+	for (unsigned i = 0; i < a->nerr; i++)
+		if (a->err[i].kind != b->err[i].kind
+		    || a->err[i].loc != b->err[i].loc)
+			return false;
+
+	return true;
+}
+
+/*
+ * Checks that however the stream is cut up, what comes out is what
+ * comes out of decoding it in one piece.
+ */
+static void
+check(enum fmt from, enum fmt to, const char *s, unsigned len)
+{
+	const uint8_t *u = (const uint8_t *)s;
+	struct out whole, part;
+
+	decode(&whole, from, to, u, len, len, KDGU_ERRORS_ALL);
+
+	for (unsigned cut = 0; cut < len; cut++) {
+		decode(&part, from, to, u, len, cut, KDGU_ERRORS_ALL);
+		assert(same(&whole, &part));
+	}
+}
+
+int
+main(void)
+{
+	check(KDGU_FMT_UTF8, KDGU_FMT_UTF8, "h\xC3\xA9llo \xE2\x82\xAC \xF0\x9F\x98\x80!", 16);
+	check(KDGU_FMT_UTF8, KDGU_FMT_UTF8, "\xEF\xBB\xBF" "ab", 5);
+	check(KDGU_FMT_UTF8, KDGU_FMT_UTF16LE, "a\xFF" "b\xC3" "c\x80\x80" "d\xE2\x82", 11);
+	check(KDGU_FMT_UTF8, KDGU_FMT_UTF32BE, "\xF0\x9F\x98" "x\xF0\x9F\x98\x80", 8);
+	check(KDGU_FMT_UTF16, KDGU_FMT_UTF8, "\xFF\xFE" "a\0=\xD8\0\xDE" "b\0", 10);
+	check(KDGU_FMT_UTF16BE, KDGU_FMT_UTF8, "\xD8\x3D\xDE\x00\0a\xDC\x00\0b", 10);
+	check(KDGU_FMT_UTF16BE, KDGU_FMT_UTF8, "\0a\xD8\x3D", 4);
+	check(KDGU_FMT_UTF32LE, KDGU_FMT_UTF8, "a\0\0\0\0\xF6\x01\0b\0\0", 11);
+
+	/* The offsets of errors count from the start of the stream. */
+	struct out o;
+	const uint8_t bad[] = "abc\xFF" "def\xFE" "g";
+	decode(&o, KDGU_FMT_UTF8, KDGU_FMT_UTF8, bad, 9, 0, KDGU_ERRORS_ALL);
+	assert(o.nerr == 2 && o.err[0].loc == 3 && o.err[1].loc == 7);
+
+	/* So do those of characters that can't be converted. */
+	const uint8_t wide[] = "abc\xC3\xA9" "de\xE2\x82\xAC";
+	decode(&o, KDGU_FMT_UTF8, KDGU_FMT_ASCII, wide, 10, 4, KDGU_ERRORS_ALL);
+	assert(o.nerr == 2 && o.len == 7);
+	assert(o.err[0].kind == ERR_NO_CONVERSION && o.err[0].loc == 3);
+	assert(o.err[1].kind == ERR_NO_CONVERSION && o.err[1].loc == 7);
+
+	/* The decoder's policy bounds what each string keeps. */
+	uint8_t junk[100];
+	memset(junk, 0xFF, sizeof junk);
+
+	decode(&o, KDGU_FMT_UTF8, KDGU_FMT_UTF8, junk, 100, 50, KDGU_ERRORS_COUNT);
+	assert(o.nerr == 0 && o.total == 100);
+	decode(&o, KDGU_FMT_UTF8, KDGU_FMT_UTF8, junk, 100, 50, KDGU_ERRORS_FIRST);
+	assert(o.nerr == 2 && o.err[0].loc == 0 && o.err[1].loc == 50);
+	decode(&o, KDGU_FMT_UTF8, KDGU_FMT_UTF8, junk, 100, 50, KDGU_ERRORS_LAST);
+	assert(o.nerr == 8 && o.err[3].loc == 49 && o.err[7].loc == 99);
+	decode(&o, KDGU_FMT_UTF8, KDGU_FMT_UTF8, junk, 100, 50, KDGU_ERRORS_RUNS);
+	assert(o.nerr == 2 && o.err[0].run == 50 && o.err[1].loc == 50);
+
+	return 0;
+}
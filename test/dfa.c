@@ -0,0 +1,67 @@
+#include "regex_check.h"
+
+/* Whether the lazy DFA reads the subject before the VM does. */
+static bool
+dfa(const ktre *re)
+{
+	return re->dfa;
+}
+
+int
+main(void)
+{
+	const char *pat[] = {
+		"abc", "a(b|c)*d", "^ab", "b$", "^$", "\\bfoo\\b", "\\Bo",
+		"x*", "(a|xb)(c|bcd)", "[a-c]+d", "foo|bar|baz", "^\\w+$",
+		"(?:\\s|^)b", "a.c", "\\d\\d", "(a|b)*a[ab]{2}",
+	};
+
+	/* Non-ASCII and CR LF send the DFA back to the VM. */
+	const char *subject[] = {
+		"", "abc", "abbcd", "xab\nab", "ab\nb", "a foo b", "foobar",
+		"xxx", "abcd", "zzabcabd", "baz", "\xC3\xA9" "abc", "ab\r\nb",
+		"a\xC3\xA9" "c", "a12", "bbaab", "b b", "abab\n",
+	};
+
+	int opt[] = {
+		0, KTRE_UNANCHORED, KTRE_GLOBAL, KTRE_UNANCHORED | KTRE_MULTILINE,
+		KTRE_UNANCHORED | KTRE_INSENSITIVE,
+	};
+
+	CHECK_ALL(pat, subject, opt, dfa);
+
+	/*
+	 * A run that isn't handed a vector still keeps its matches for
+	 * ktre_getvec(), so the DFA can't answer it without the VM.
+	 */
+	ktre *re = ktre_compile(&KDGU("b(c)"), KTRE_UNANCHORED);
+	assert(re->dfa && ktre_exec(re, &KDGU("aabcd"), NULL));
+
+	int **vec = ktre_getvec(re);
+	assert(re->num_matches == 1);
+	assert(vec[0][0] == 2 && vec[0][1] == 2 && vec[0][2] == 3 && vec[0][3] == 1);
+
+	kdgu *group = ktre_getgroup(vec, 0, 1, &KDGU("aabcd"));
+	assert(group && group->len == 1 && group->s[0] == 'c');
+
+	kdgu_free(group);
+	free(vec[0]), free(vec);
+	ktre_free(re);
+
+	/*
+	 * Far more states than the cache holds, so it's emptied over
+	 * and over until the DFA gives up.
+	 */
+	char s[4097];
+	unsigned r = 1;
+	for (unsigned i = 0; i < sizeof s - 1; i++) {
+		r = r * 1103515245 + 12345;
+		s[i] = r >> 16 & 1 ? 'a' : 'b';
+	}
+	s[sizeof s - 1] = 0;
+
+	check_same("(a|b)*a[ab]{12}c", s, KTRE_UNANCHORED, dfa);
+	check_same("a[ab]{12}$", s, KTRE_UNANCHORED, dfa);
+
+	return 0;
+}
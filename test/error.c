@@ -0,0 +1,81 @@
+#include <assert.h>
+
+#include "kdgu.h"
+
+/*
+ * Twenty bad bytes at even offsets: 0xFF is never valid and 0x80 is a
+ * stray continuation byte, in runs of five.
+ */
+static uint8_t text[40];
+
+static kdgu *
+make(enum errpolicy policy, unsigned max)
+{
+	kdgu *k = kdgu_new_policy(KDGU_FMT_UTF8, text, sizeof text, policy, max);
+	assert(k && k->errlist && k->errlist->total == 20);
+	return k;
+}
+
+static struct error all[20];
+
+int
+main(void)
+{
+	for (unsigned i = 0; i < sizeof text; i += 2)
+		text[i] = i / 10 % 2 ? 0x80 : 0xFF, text[i + 1] = 'a';
+
+	kdgu *k = make(KDGU_ERRORS_ALL, 0);
+	assert(k->errlist->num == 20);
+	for (unsigned i = 0; i < 20; i++) {
+		all[i] = *kdgu_geterror(k, i);
+		assert(!i || all[i].loc > all[i - 1].loc);
+	}
+	assert(!kdgu_geterror(k, 20));
+	kdgu_free(k);
+
+	k = make(KDGU_ERRORS_COUNT, 0);
+	assert(k->errlist->num == 0 && !kdgu_geterror(k, 0));
+	kdgu_free(k);
+
+	k = make(KDGU_ERRORS_FIRST, 0);
+	assert(k->errlist->num == 1 && kdgu_geterror(k, 0)->loc == all[0].loc);
+	assert(k->errlist->alloc == 1);
+	kdgu_free(k);
+
+	/* The ring gives the last errors back oldest first. */
+	k = make(KDGU_ERRORS_LAST, 3);
+	assert(k->errlist->num == 3 && k->errlist->alloc == 3);
+	for (unsigned i = 0; i < 3; i++)
+		assert(kdgu_geterror(k, i)->loc == all[17 + i].loc);
+	kdgu_free(k);
+
+	k = make(KDGU_ERRORS_LAST, 0);
+	assert(k->errlist->num == 0);
+	kdgu_free(k);
+
+	/* Errors of the same kind in a row become one. */
+	assert(all[4].kind == all[0].kind && all[5].kind != all[0].kind);
+	k = make(KDGU_ERRORS_RUNS, 0);
+	assert(k->errlist->num == 4);
+	for (unsigned i = 0; i < 4; i++) {
+		const struct error *e = kdgu_geterror(k, i);
+		assert(e->loc == all[i * 5].loc && e->run == 5);
+		assert(e->kind == all[i * 5].kind);
+	}
+
+	/* Changing the policy starts over. */
+	assert(kdgu_errpolicy(k, KDGU_ERRORS_FIRST, 0));
+	assert(k->errlist->num == 0 && k->errlist->total == 0);
+	kdgu_free(k);
+
+	/* Under the default the list grows without losing anything. */
+	uint8_t big[3000];
+	memset(big, 0xFF, sizeof big);
+	k = kdgu_new(KDGU_FMT_UTF8, big, sizeof big);
+	assert(k && k->errlist->num == 3000 && k->errlist->total == 3000);
+	assert(k->errlist->alloc < 6000);
+	assert(kdgu_geterror(k, 2999)->loc == 2999);
+	kdgu_free(k);
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <stdarg.h>
+
+#include "kdgu.h"
+
+/* Checks that kdgu_prev() retraces the boundaries kdgu_next() finds. */
+static void
+check_walk(const kdgu *k)
+{
+	unsigned bound[64], n = 0, idx = 0;
+
+	do bound[n++] = idx; while (kdgu_next(k, &idx));
+	assert(idx == k->len && bound[n - 1] <= k->len);
+	if (bound[n - 1] != k->len) bound[n++] = k->len;
+
+	idx = k->len;
+	for (unsigned i = n - 1; i > 0; i--) {
+		assert(kdgu_prev(k, &idx) == bound[i] - bound[i - 1]);
+		assert(idx == bound[i - 1]);
+	}
+
+	assert(!kdgu_prev(k, &idx) && idx == 0);
+}
+
+/* Runs `pat' globally and checks where its matches start. */
+static void
+check_starts(const char *pat, const char *subject, unsigned n, ...)
+{
+	int **vec;
+	ktre *re = ktre_compile(&KDGU(pat), KTRE_GLOBAL);
+	assert(!re->err);
+
+	bool found = ktre_exec(re, &KDGU(subject), &vec);
+	assert(found == !!n && re->num_matches == n);
+
+	va_list ap;
+	va_start(ap, n);
+	for (unsigned i = 0; i < n; i++)
+		assert(vec[i][0] == va_arg(ap, int));
+	va_end(ap);
+
+	ktre_free(re);
+}
+
+int
+main(void)
+{
+	check_walk(&KDGU("abc"));
+	check_walk(&KDGU("e\U00000301x\r\n\U0001F1FA\U0001F1F8!"));
+	check_walk(&KDGU("\U0001F469\U0000200D\U0001F469\U0000200D\U0001F467"));
+
+	/* Stepping back from the end lands on the last code point. */
+	unsigned idx = 5;
+	assert(kdgu_dec(&KDGU("ab\xC3\xA9"), &(unsigned){4}) == 2);
+	assert(kdgu_prev(&KDGU("abe\xCC\x81"), &idx) == 3 && idx == 2);
+	assert(!kdgu_dec(&KDGU("ab"), &(unsigned){0}));
+
+	/*
+	 * A newline at the end doesn't start a line, in the
+	 * breadth-first VM, the backtracker (which the lookahead
+	 * forces) and the lazy DFA alike.
+	 */
+	check_starts("^", "ab\n", 1, 0);
+	check_starts("^(?=)", "ab\n", 1, 0);
+	check_starts("^", "a\n\n", 2, 0, 2);
+	check_starts("^(?=)", "a\n\n", 2, 0, 2);
+	check_starts("^$", "ab\n", 0);
+	check_starts("^$", "\n", 1, 0);
+	check_starts("^b", "a\nb", 1, 2);
+
+	assert(!ktre_match(&KDGU("ab\n"), &KDGU("\n^"), 0, NULL));
+	assert(!ktre_match(&KDGU("ab\n"), &KDGU("\n^"), KTRE_UNANCHORED, NULL));
+	assert(ktre_match(&KDGU(""), &KDGU("^$"), 0, NULL));
+
+	return 0;
+}
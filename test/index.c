@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <pthread.h>
+
+#include "kdgu.h"
+
+/* Finds the `n'th grapheme by walking from the start. */
+static unsigned
+scan(const kdgu *k, unsigned n)
+{
+	unsigned idx = 0;
+	while (n--) assert(kdgu_next(k, &idx));
+	return idx;
+}
+
+static void
+check_offsets(const kdgu *k)
+{
+	unsigned len = kdgu_len(k);
+
+	for (unsigned n = 0; n < len; n++) {
+		unsigned idx;
+		assert(kdgu_nth(k, &idx, n));
+		assert(idx == scan(k, n));
+	}
+
+	assert(!kdgu_nth(k, &(unsigned){0}, len));
+}
+
+static kdgu *
+make_subject(void)
+{
+	kdgu *k = kdgu_news("");
+
+	for (unsigned i = 0; i < 300; i++) {
+		kdgu_chrappend(k, 'a' + i % 26);
+		if (i % 7 == 0) kdgu_chrappend(k, 0x301);
+		if (i % 11 == 0) kdgu_chrappend(k, 0x1F600);
+	}
+
+	return k;
+}
+
+static void *
+reader(void *arg)
+{
+	check_offsets(arg);
+	return NULL;
+}
+
+int
+main(void)
+{
+	kdgu *k = make_subject();
+	assert(k->len >= KDGU_INDEX_MIN);
+
+	check_offsets(k);
+	assert(k->index);
+
+	/* Every mutator has to drop the index it makes stale. */
+	kdgu_chrappend(k, 'z');
+	assert(!k->index);
+	check_offsets(k);
+
+	kdgu_delete(k, 0, kdgu_chrsize(k, 0));
+	assert(!k->index);
+	check_offsets(k);
+
+	kdgu_setchr(k, scan(k, 40), 0xE9);
+	assert(!k->index);
+	check_offsets(k);
+
+	kdgu_uc(k);
+	assert(!k->index);
+	check_offsets(k);
+
+	kdgu_reverse(k);
+	check_offsets(k);
+
+	kdgu_convert(k, KDGU_FMT_UTF16LE);
+	assert(!k->index);
+	check_offsets(k);
+
+	kdgu_free(k);
+
+	/* Readers that share a string race to build its index. */
+	for (int round = 0; round < 20; round++) {
+		pthread_t t[8];
+		k = make_subject();
+
+		for (int i = 0; i < 8; i++)
+			assert(!pthread_create(t + i, NULL, reader, k));
+		for (int i = 0; i < 8; i++)
+			pthread_join(t[i], NULL);
+
+		assert(k->index);
+		kdgu_free(k);
+	}
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include <assert.h>
+
+#include "kdgu.h"
+
+static const uint32_t text[] = {
+	'a', 0xE9, 0x20AC, 0x1F600, 0x10FFFD, 'z'
+};
+
+#define NTEXT (sizeof text / sizeof *text)
+
+/* Checks that every format's decoder reads back `text'. */
+static void
+check_format(enum fmt fmt)
+{
+	kdgu *k = kdgu_new(KDGU_FMT_UTF32LE, (const uint8_t *)text, sizeof text);
+	assert(k && kdgu_convert(k, fmt));
+
+	unsigned n = 0;
+	for (kdgu_iter it = kdgu_iterbegin(k, 0); kdgu_iternext(&it); n++) {
+		assert(n < NTEXT && it.c == text[n]);
+		assert(kdgu_decode(k, it.off) == it.c);
+		assert(kdgu_iterpeek(&it) == (n + 1 < NTEXT ? text[n + 1] : UINT32_MAX));
+	}
+
+	assert(n == NTEXT);
+	kdgu_free(k);
+}
+
+/*
+ * Decodes a string whose last unit is cut off, as a view over a
+ * truncated buffer can be. The buffer is exactly as long as the
+ * string, so reading past it shows up under a sanitizer.
+ */
+static void
+check_truncated(enum fmt fmt, const uint8_t *s, unsigned len, unsigned n,
+                uint32_t last)
+{
+	uint8_t *buf = malloc(len);
+	memcpy(buf, s, len);
+
+	kdgu k = { .fmt = fmt, .s = buf, .len = len, .view = true };
+	unsigned i = 0;
+	uint32_t c = 0;
+
+	for (kdgu_iter it = kdgu_iterbegin(&k, 0); kdgu_iternext(&it); i++) {
+		assert(it.off + it.len <= len);
+		assert(kdgu_decode(&k, it.off) == it.c);
+		c = it.c;
+	}
+
+	assert(i == n && c == last);
+	free(buf);
+}
+
+int
+main(void)
+{
+	enum fmt fmts[] = {
+		KDGU_FMT_UTF8, KDGU_FMT_UTF16BE, KDGU_FMT_UTF16LE,
+		KDGU_FMT_UTF32BE, KDGU_FMT_UTF32LE
+	};
+
+	for (unsigned i = 0; i < sizeof fmts / sizeof *fmts; i++)
+		check_format(fmts[i]);
+
+	check_truncated(KDGU_FMT_UTF16LE, (uint8_t []){ 'a', 0, 'b' }, 3, 2, '?');
+	check_truncated(KDGU_FMT_UTF16BE, (uint8_t []){ 0xD8, 0x3D, 0xDE }, 3, 2, '?');
+	check_truncated(KDGU_FMT_UTF32LE, (uint8_t []){ 'a', 0, 0, 0, 'b', 0 }, 6, 2, '?');
+	check_truncated(KDGU_FMT_UTF32BE, (uint8_t []){ 0, 0, 0, 'a', 0 }, 5, 2, '?');
+	check_truncated(KDGU_FMT_UTF32BE, (uint8_t []){ 0, 0, 0, 'a' }, 4, 1, 'a');
+
+	return 0;
+}
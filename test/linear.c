@@ -0,0 +1,61 @@
+#include "regex_check.h"
+
+static bool
+pike(const ktre *re)
+{
+	return re->pike;
+}
+
+/* Checks that `pat' finds the `x' after `n' a's, and nothing else. */
+static void
+check_long(const char *pat, unsigned n)
+{
+	char *s = malloc(n + 2);
+	memset(s, 'a', n);
+	s[n] = 'x', s[n + 1] = 0;
+
+	int **vec;
+	ktre *re = ktre_compile(&KDGU(pat), KTRE_UNANCHORED);
+	assert(re->pike && ktre_exec(re, &KDGU(s), &vec));
+	assert(re->num_matches == 1 && vec[0][0] == (int)n && vec[0][1] == 1);
+	for (int i = 2; i < re->num_groups * 2; i++) assert(vec[0][i] == -1);
+
+	ktre_free(re);
+	free(s);
+}
+
+int
+main(void)
+{
+	/*
+	 * A loop that can go round reading nothing stops after one
+	 * empty iteration in both VMs, and the groups it leaves are the
+	 * same.
+	 */
+	const char *pat[] = {
+		"(a*)*b|x", "(a|a?)+b|x", "(?:a|a?)+b|x",
+		"(a*)*", "(a*)+", "(a*b*)*", "((c|))+", "(((?:ba))*)+",
+		"(a|)*", "(|a)*", "(a?)*?b", "(a*?)*", "(a|ab|)*c",
+		"(\\b|a)*", "(^|a)*b", "(?:(a)|b|)*c", "((a?)(b?))*c",
+	};
+
+	const char *subject[] = {
+		"", "a", "b", "x", "ab", "aab", "aax", "ba", "abab",
+		"aac", "abc", "aabbc", "cab", "aaaaaaaax", "aaaaaaaab",
+	};
+
+	int opt[] = { 0, KTRE_UNANCHORED, KTRE_GLOBAL };
+
+	CHECK_ALL(pat, subject, opt, pike);
+
+	/*
+	 * These take the backtracker time exponential in the number
+	 * of a's before the x.
+	 */
+	for (unsigned i = 0; i < 3; i++) {
+		check_long(pat[i], 22);
+		check_long(pat[i], 10000);
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "kdgu.h"
+
+static char path[] = "/tmp/kdg-mmap-XXXXXX";
+
+static void
+write_file(const char *s, size_t len)
+{
+	FILE *f = fopen(path, "wb");
+	assert(f);
+	assert(fwrite(s, 1, len, f) == len);
+	fclose(f);
+}
+
+int
+main(void)
+{
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	/* Valid text is read straight out of the mapping. */
+	char text[1000];
+	for (unsigned i = 0; i < sizeof text; i++) text[i] = 'a' + i % 26;
+	write_file(text, sizeof text);
+
+	kdgu *k = kdgu_open_mmap(path, KDGU_FMT_UTF8);
+	assert(k && k->mapped && k->view && !k->errlist);
+	assert(k->len == sizeof text && !memcmp(k->s, text, k->len));
+
+	/* It's indexed like any other string. */
+	unsigned idx;
+	assert(kdgu_len(k) == sizeof text);
+	assert(k->index);
+	assert(kdgu_nth(k, &idx, 777) && idx == 777);
+
+	/* Changing it takes a copy and leaves the file alone. */
+	assert(kdgu_chrappend(k, 'Z'));
+	assert(!k->mapped && !k->view && !k->index);
+	assert(k->len == sizeof text + 1 && k->s[k->len - 1] == 'Z');
+	kdgu_free(k);
+
+	k = kdgu_open_mmap(path, KDGU_FMT_UTF8);
+	assert(k && k->len == sizeof text);
+	kdgu_free(k);
+
+	/* Text that needs repair is copied out, with its errors. */
+	write_file("ab\xFF" "cd", 5);
+	k = kdgu_open_mmap(path, KDGU_FMT_UTF8);
+	assert(k && !k->mapped && !k->view);
+	assert(k->errlist && k->errlist->num == 1);
+	assert(kdgu_geterror(k, 0)->loc == 2);
+	assert(kdgu_len(k) == 5 && kdgu_decode(k, 0) == 'a');
+	kdgu_free(k);
+
+	write_file("", 0);
+	k = kdgu_open_mmap(path, KDGU_FMT_UTF8);
+	assert(k && !k->len && !k->mapped);
+	kdgu_free(k);
+
+	unlink(path);
+	errno = 0;
+	assert(!kdgu_open_mmap(path, KDGU_FMT_UTF8) && errno == ENOENT);
+
+	/* Views of caller memory and of other strings get indexes too. */
+	kdgu *v = kdgu_view(KDGU_FMT_UTF8, (const uint8_t *)text, sizeof text);
+	assert(v && v->view);
+	assert(kdgu_nth(v, &idx, 500) && idx == 500 && v->index);
+
+	kdgu *s = kdgu_subview(v, 100, 900);
+	assert(s && kdgu_len(s) == 800 && s->index);
+	kdgu_free(s), kdgu_free(v);
+
+	/* A string made with KDGU() is never given one to leak. */
+	kdgu lit = KDGU("0123456789012345678901234567890123456789"
+	                "0123456789012345678901234567890123456789"
+	                "0123456789012345678901234567890123456789"
+	                "0123456789012345678901234567890123456789"
+	                "0123456789012345678901234567890123456789"
+	                "0123456789012345678901234567890123456789"
+	                "0123456789012345678901234567890123456789");
+	assert(kdgu_len(&lit) == 280 && !lit.index);
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+#include <assert.h>
+#include <string.h>
+
+#include "kdgu.h"
+
+/* Checks that `k' holds the UTF-8 `s'. */
+static void
+check(const kdgu *k, const char *s)
+{
+	assert(k->len == strlen(s) && !memcmp(k->s, s, k->len));
+}
+
+int
+main(void)
+{
+	/* A mark put after a letter has to be composed with it. */
+	kdgu *k = kdgu_news("caf\xC3\xA9 \xCE\xB1");
+	assert(k->norm == KDGU_NORM_NFC);
+	assert(kdgu_chrappend(k, 'e') && k->norm == KDGU_NORM_NFC);
+	assert(kdgu_chrappend(k, 0x301) && k->norm == KDGU_NORM_NONE);
+	assert(kdgu_normalize(k, KDGU_NORM_NFC));
+	check(k, "caf\xC3\xA9 \xCE\xB1\xC3\xA9");
+
+	/* So does one that a deletion leaves after another letter. */
+	kdgu_delete(k, 8, 10);
+	assert(k->norm == KDGU_NORM_NFC);
+	assert(kdgu_chrappend(k, 'e') && kdgu_chrappend(k, 0x301));
+	assert(kdgu_normalize(k, KDGU_NORM_NFD));
+	kdgu_delete(k, 9, 10);
+	assert(k->norm == KDGU_NORM_NONE);
+	assert(kdgu_normalize(k, KDGU_NORM_NFC));
+	check(k, "caf\xC3\xA9 \xCE\xAC");
+	kdgu_free(k);
+
+	/* Upper case can decompose what NFC had composed. */
+	k = kdgu_news("\xCE\x90");
+	assert(kdgu_uc(k) && k->norm == KDGU_NORM_NONE);
+	check(k, "\xCE\x99\xCC\x88\xCC\x81");
+	assert(kdgu_normalize(k, KDGU_NORM_NFC));
+	check(k, "\xCE\xAA\xCC\x81");
+	kdgu_free(k);
+
+	/* Nothing to change leaves the bytes and their form alone. */
+	k = kdgu_news("1 \xCE\xB1");
+	uint8_t *s = k->s;
+	assert(kdgu_lc(k) && k->s == s && k->norm == KDGU_NORM_NFC);
+	kdgu_free(k);
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef REGEX_CHECK_H
+#define REGEX_CHECK_H
+
+/*
+ * The comparison the regex tests share: a pattern on the engine under
+ * test against the same pattern on the backtracker, which a lookahead
+ * on the end forces and which never has the lazy DFA in front of it.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "kdgu.h"
+
+/* Whether `re' runs on the engine a test is about. */
+typedef bool (*regex_engine)(const ktre *re);
+
+static void
+same_vectors(const ktre *re, int **a, int **b)
+{
+	for (unsigned i = 0; i < re->num_matches; i++)
+		assert(!memcmp(a[i], b[i], re->num_groups * 2 * sizeof **a));
+}
+
+/*
+ * Checks that `pat' finds the same matches with the same groups on
+ * `engine' as on the backtracker, whether the caller asks for them or
+ * reads them with ktre_getvec() afterwards, and that ktre_match() can
+ * tell whether there's one without being asked for them.
+ */
+static void
+check_same(const char *pat, const char *subject, int opt,
+           regex_engine engine)
+{
+	char buf[128];
+	snprintf(buf, sizeof buf, "(?:%s)(?=)", pat);
+
+	ktre *a = ktre_compile(&KDGU(pat), opt);
+	ktre *b = ktre_compile(&KDGU(buf), opt);
+	assert(!a->err && !b->err && engine(a) && !b->pike && !b->dfa);
+
+	int **va, **vb;
+	bool found = ktre_exec(b, &KDGU(subject), &vb);
+	assert(found == ktre_match(&KDGU(subject), &KDGU(pat), opt, NULL));
+	assert(found == ktre_exec(a, &KDGU(subject), &va));
+	assert(!found || a->num_matches == b->num_matches);
+	if (found) same_vectors(a, va, vb);
+
+	assert(found == ktre_exec(a, &KDGU(subject), NULL));
+	assert(!found || a->num_matches == b->num_matches);
+
+	int **kept = ktre_getvec(a);
+	if (found) same_vectors(a, kept, vb);
+	for (unsigned i = 0; found && i < a->num_matches; i++) free(kept[i]);
+	free(kept);
+
+	ktre_free(a);
+	ktre_free(b);
+}
+
+/* Runs check_same() on every pattern, subject and option there is. */
+#define CHECK_ALL(PAT, SUBJECT, OPT, ENGINE)				\
+	do {								\
+		for (unsigned i_ = 0; i_ < sizeof PAT / sizeof *PAT; i_++) \
+		for (unsigned j_ = 0; j_ < sizeof SUBJECT / sizeof *SUBJECT; j_++) \
+		for (unsigned k_ = 0; k_ < sizeof OPT / sizeof *OPT; k_++) \
+			check_same(PAT[i_], SUBJECT[j_], OPT[k_], ENGINE); \
+	} while (0)
+
+#endif
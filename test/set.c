@@ -0,0 +1,120 @@
+#include <assert.h>
+
+#include "kdgu.h"
+
+#define END 0x110000
+
+static uint8_t ref[4][END / 8];
+
+static unsigned long seed = 1;
+
+static uint32_t
+rnd(uint32_t n)
+{
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (seed >> 33) % n;
+}
+
+static bool
+get(const uint8_t *r, uint32_t c)
+{
+	return r[c / 8] >> c % 8 & 1;
+}
+
+static void
+put(uint8_t *r, uint32_t c, bool v)
+{
+	if (v) r[c / 8] |= 1 << c % 8;
+	else r[c / 8] &= ~(1 << c % 8);
+}
+
+/*
+ * Fills `s' and its reference with random ranges, mostly near the
+ * bottom so they overlap and cross the bitmap's edge at U+0100.
+ */
+static kdgu_set *
+random_set(uint8_t *r)
+{
+	kdgu_set *s = kdgu_setnew();
+	memset(r, 0, END / 8);
+
+	for (unsigned i = rnd(20); i--;) {
+		uint32_t a = rnd(4) ? rnd(0x300) : rnd(END);
+		uint32_t b = a + rnd(rnd(3) ? 40 : 5000);
+		if (b >= END) b = END - 1;
+
+		assert(kdgu_setadd(s, a, b));
+		for (uint32_t c = a; c <= b; c++) put(r, c, true);
+	}
+
+	return s;
+}
+
+/* Checks that `s' is a well formed inversion list holding `r'. */
+static void
+check(const kdgu_set *s, const uint8_t *r)
+{
+	assert(s->len % 2 == 0);
+	for (unsigned i = 1; i < s->len; i++) assert(s->r[i - 1] < s->r[i]);
+	if (s->len) assert(s->r[s->len - 1] <= END);
+
+	for (uint32_t c = 0; c < END; c++)
+		assert(kdgu_sethas(s, c) == get(r, c));
+}
+
+int
+main(void)
+{
+	for (int round = 0; round < 30; round++) {
+		kdgu_set *a = random_set(ref[0]), *b = random_set(ref[1]);
+		check(a, ref[0]), check(b, ref[1]);
+
+		kdgu_set *u = kdgu_setcopy(a), *n = kdgu_setcopy(a);
+		kdgu_set *d = kdgu_setcopy(a), *c = kdgu_setcopy(a);
+
+		assert(kdgu_setunion(u, b));
+		assert(kdgu_setintersect(n, b));
+		assert(kdgu_setdiff(d, b));
+		assert(kdgu_setcomplement(c));
+
+		for (uint32_t i = 0; i < END / 8; i++)
+			ref[2][i] = ref[0][i] | ref[1][i];
+		check(u, ref[2]);
+
+		for (uint32_t i = 0; i < END / 8; i++)
+			ref[2][i] = ref[0][i] & ref[1][i];
+		check(n, ref[2]);
+
+		for (uint32_t i = 0; i < END / 8; i++)
+			ref[2][i] = ref[0][i] & ~ref[1][i];
+		check(d, ref[2]);
+
+		for (uint32_t i = 0; i < END / 8; i++)
+			ref[2][i] = ~ref[0][i];
+		check(c, ref[2]);
+
+		/* Complementing twice gives back the set. */
+		assert(kdgu_setcomplement(c));
+		check(c, ref[0]);
+
+		kdgu_setfree(a), kdgu_setfree(b), kdgu_setfree(u);
+		kdgu_setfree(n), kdgu_setfree(d), kdgu_setfree(c);
+	}
+
+	kdgu_set *s = kdgu_setstr(&KDGU("zay\U0001F600a"));
+	assert(s->len == 6);
+	assert(kdgu_sethas(s, 'a') && kdgu_sethas(s, 'y') && kdgu_sethas(s, 'z'));
+	assert(kdgu_sethas(s, 0x1F600) && !kdgu_sethas(s, 'b'));
+	kdgu_setfree(s);
+
+	s = kdgu_setrange(0x100, 0x100);
+	assert(!kdgu_sethas(s, 0xFF) && kdgu_sethas(s, 0x100) && !kdgu_sethas(s, 0x101));
+	assert(!kdgu_setadd(s, 5, 4) && !kdgu_setadd(s, END, END));
+	kdgu_setfree(s);
+
+	s = kdgu_setcategory(CATEGORY_LU);
+	assert(kdgu_sethas(s, 'Q') && !kdgu_sethas(s, 'q') && kdgu_sethas(s, 0x391));
+	kdgu_setfree(s);
+
+	return 0;
+}